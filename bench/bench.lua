@@ -0,0 +1,182 @@
+#!/usr/bin/env lua
+-- MoonUSB benchmarks for the binding layer.
+-- Meant to be run against the fakeusb shim (see README.md), with:
+--    lua bench.lua [pattern] [scale]
+-- pattern: run only the benchmarks whose name matches the given Lua pattern,
+-- scale: multiplier for the number of iterations (default 1).
+local usb = require("moonusb")
+
+local pattern = arg[1] or ""
+local scale = tonumber(arg[2]) or 1
+
+local ctx = usb.init()
+
+print(string.format("%s, %s", _VERSION, usb._VERSION))
+print(string.format("%-36s %12s %12s", "benchmark", "ns/op", "ops/s"))
+
+local function bench(name, n, func)
+   if not string.find(name, pattern) then return end
+   n = math.max(1, math.floor(n*scale))
+   collectgarbage()
+   collectgarbage()
+   local t0 = usb.now()
+   func(n)
+   local t = usb.now() - t0
+   print(string.format("%-36s %12.1f %12.0f", name, t/n*1e9, n/t))
+end
+
+-- This must run before any device object is created, since get_device_list()
+-- creates new objects for all the devices:
+bench("get_device_list + free", 100000, function(n)
+   for i = 1, n do
+      for _, dev in ipairs(ctx:get_device_list()) do dev:free() end
+   end
+end)
+
+local device = assert(ctx:get_device_list()[1], "no devices (is fakeusb in the library path?)")
+local devhandle = device:open()
+local interface = devhandle:claim_interface(0)
+local mem = usb.malloc(nil, 65536)
+local ptr = mem:ptr()
+
+-------------------------------------------------------------------------------
+-- Asynchronous transfers
+-------------------------------------------------------------------------------
+
+bench("async resubmit (bulk in 512)", 200000, function(n)
+   -- one transfer object, resubmitted from its callback n times
+   local count = 0
+   devhandle:submit_bulk_transfer(0x81, ptr, 512, 0, function(transfer, status)
+      count = count + 1
+      return count < n
+   end)
+   while count < n do ctx:handle_events() end
+end)
+
+bench("async resubmit, 32 in flight", 200000, function(n)
+   local count = 0
+   local function callback(transfer, status)
+      count = count + 1
+      return count <= n - 32
+   end
+   for i = 1, 32 do
+      devhandle:submit_bulk_transfer(0x81, mem:ptr(512*(i-1)), 512, 0, callback)
+   end
+   while count < n do ctx:handle_events() end
+end)
+
+bench("async submit new (bulk out 512)", 100000, function(n)
+   -- a new transfer object per URB (creation + teardown)
+   local count = 0
+   local function callback() count = count + 1 end
+   for i = 1, n do
+      devhandle:submit_bulk_transfer(0x01, ptr, 512, 0, callback)
+      if i % 64 == 0 then ctx:handle_events() end
+   end
+   while count < n do ctx:handle_events() end
+end)
+
+bench("async control (get descriptor)", 100000, function(n)
+   local count = 0
+   usb.encode_control_setup(ptr, {request_type='standard', request_recipient='device',
+      direction='in', request='get descriptor', value=0x0100, index=0, length=18})
+   devhandle:submit_control_transfer(ptr, 64, 0, function()
+      count = count + 1
+      return count < n
+   end)
+   while count < n do ctx:handle_events() end
+end)
+
+bench("async iso (8 x 1024)", 50000, function(n)
+   local count = 0
+   devhandle:submit_iso_transfer(0x83, ptr, 8192, 8, 1024, 0, function(transfer)
+      count = count + 1
+      transfer:get_iso_packet_descriptors()
+      return count < n
+   end)
+   while count < n do ctx:handle_events() end
+end)
+
+bench("endpoint:submit (bulk in 512)", 100000, function(n)
+   local ep = interface:endpoint(0x81)
+   local count = 0
+   local function callback() count = count + 1 end
+   for i = 1, n do
+      ep:submit(ptr, 512, callback)
+      if i % 64 == 0 then ctx:handle_events() end
+   end
+   while count < n do ctx:handle_events() end
+   ep:free()
+end)
+
+-------------------------------------------------------------------------------
+-- Synchronous transfers
+-------------------------------------------------------------------------------
+
+bench("sync bulk_transfer (512)", 500000, function(n)
+   for i = 1, n do devhandle:bulk_transfer(0x81, ptr, 512, 0) end
+end)
+
+bench("sync endpoint:read (512)", 500000, function(n)
+   local ep = interface:endpoint(0x81)
+   for i = 1, n do ep:read(ptr, 512) end
+   ep:free()
+end)
+
+-------------------------------------------------------------------------------
+-- Objects creation and teardown
+-------------------------------------------------------------------------------
+
+bench("devhandle open/close", 100000, function(n)
+   for i = 1, n do device:open():close() end
+end)
+
+bench("claim/release interface", 100000, function(n)
+   local h = device:open()
+   for i = 1, n do h:claim_interface(0):release() end
+   h:close()
+end)
+
+bench("hostmem malloc/free (4096)", 200000, function(n)
+   for i = 1, n do usb.malloc(nil, 4096):free() end
+end)
+
+-------------------------------------------------------------------------------
+-- Data handling
+-------------------------------------------------------------------------------
+
+bench("hostmem write+read (512)", 500000, function(n)
+   local data = string.rep("x", 512)
+   for i = 1, n do
+      mem:write(0, nil, data)
+      mem:read(0, 512)
+   end
+end)
+
+bench("pack uint x128", 200000, function(n)
+   local t = {}
+   for i = 1, 128 do t[i] = i end
+   for i = 1, n do usb.pack('uint', t) end
+end)
+
+bench("unpack uint x128", 200000, function(n)
+   local data = usb.pack('uint', usb.flatten_table({0}))
+   data = string.rep(data, 128)
+   for i = 1, n do usb.unpack('uint', data) end
+end)
+
+bench("unpack_into uint x128", 200000, function(n)
+   local data = string.rep(usb.pack('uint', 0), 128)
+   local dst = {}
+   for i = 1, n do usb.unpack_into('uint', data, dst) end
+end)
+
+bench("codec decode (4 fields)", 500000, function(n)
+   local codec = usb.codec({{'a', 'u8'}, {'b', 'u16le'}, {'c', 'u32be'}, {'d', 'f32le'}})
+   local data, dst = string.rep("\0", codec:size()), {}
+   for i = 1, n do codec:decode(data, 0, dst) end
+end)
+
+interface:release()
+devhandle:close()
+ctx:exit()
@@ -0,0 +1,598 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2021 Stefano Trettel
+ *
+ * Software repository: MoonUSB, https://github.com/stetre/moonusb
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* fakeusb: an in-process stand-in for libusb-1.0, for benchmarking the binding layer
+ * on machines with no USB hardware (see bench/README.md).
+ *
+ * It implements the subset of the libusb API used by MoonUSB, on a set of fake devices
+ * each having a bulk IN/OUT pair (0x81/0x01), an interrupt IN endpoint (0x82) and an
+ * iso IN endpoint (0x83). Synchronous transfers complete immediately. Asynchronous
+ * transfers are queued at submission and completed (and their callbacks executed)
+ * by the libusb_handle_events_xxx() functions.
+ *
+ * The behaviour is configured with the following environment variables:
+ * FAKEUSB_DEVICES: number of fake devices (default: 1),
+ * FAKEUSB_LATENCY: time in microseconds from submission to completion of asynchronous
+ *                  transfers (default: 0, i.e. completion at the next event handling),
+ * FAKEUSB_BATCH:   max number of completions per event handling call (default: 0 = no limit),
+ * FAKEUSB_PATTERN: string of characters giving the completion status of successive
+ *                  transfers, cyclically (default: "c"), where 'c' = completed,
+ *                  's' = short (completed with half the length), 't' = timed out,
+ *                  'p' = stall, 'e' = error, 'o' = overflow.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/time.h>
+#include <libusb-1.0/libusb.h>
+
+struct libusb_context { int dummy; };
+struct libusb_device { int index; int refcount; };
+struct libusb_device_handle { struct libusb_device *device; };
+
+#define MAXDEVICES 127
+static struct libusb_device Devices[MAXDEVICES];
+static int NDevices = -1;
+static uint64_t Latency = 0; /* ns */
+static int Batch = 0;
+static const char *Pattern = "c";
+static size_t PatternLen = 1, PatternPos = 0;
+
+static uint64_t Now(void)
+    {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+    }
+
+static void Configure(void)
+    {
+    const char *s;
+    int i;
+    if(NDevices >= 0) return;
+    s = getenv("FAKEUSB_DEVICES");
+    NDevices = s ? atoi(s) : 1;
+    if(NDevices < 0) NDevices = 0;
+    if(NDevices > MAXDEVICES) NDevices = MAXDEVICES;
+    s = getenv("FAKEUSB_LATENCY");
+    Latency = s ? (uint64_t)atol(s)*1000 : 0;
+    s = getenv("FAKEUSB_BATCH");
+    Batch = s ? atoi(s) : 0;
+    s = getenv("FAKEUSB_PATTERN");
+    if(s && s[0] != '\0') Pattern = s;
+    PatternLen = strlen(Pattern);
+    for(i = 0; i < NDevices; i++)
+        { Devices[i].index = i; Devices[i].refcount = 1; }
+    }
+
+/*------------------------------------------------------------------------------*
+ | Library                                                                      |
+ *------------------------------------------------------------------------------*/
+
+int libusb_init(libusb_context **ctx)
+    {
+    Configure();
+    *ctx = (libusb_context*)calloc(1, sizeof(libusb_context));
+    return *ctx ? LIBUSB_SUCCESS : LIBUSB_ERROR_NO_MEM;
+    }
+
+void libusb_exit(libusb_context *ctx)
+    { free(ctx); }
+
+void libusb_set_log_cb(libusb_context *ctx, libusb_log_cb cb, int mode)
+    { (void)ctx; (void)cb; (void)mode; }
+
+int libusb_set_option(libusb_context *ctx, enum libusb_option option, ...)
+    { (void)ctx; (void)option; return LIBUSB_SUCCESS; }
+
+const struct libusb_version *libusb_get_version(void)
+    {
+    static const struct libusb_version version = { 1, 0, 24, 0, "-fake", "" };
+    return &version;
+    }
+
+int libusb_has_capability(uint32_t capability)
+    { return capability == LIBUSB_CAP_HAS_CAPABILITY; }
+
+int libusb_setlocale(const char *locale)
+    { (void)locale; return LIBUSB_SUCCESS; }
+
+const char *libusb_error_name(int errcode)
+    {
+    switch(errcode)
+        {
+        case LIBUSB_SUCCESS: return "LIBUSB_SUCCESS";
+        case LIBUSB_ERROR_IO: return "LIBUSB_ERROR_IO";
+        case LIBUSB_ERROR_INVALID_PARAM: return "LIBUSB_ERROR_INVALID_PARAM";
+        case LIBUSB_ERROR_NOT_FOUND: return "LIBUSB_ERROR_NOT_FOUND";
+        case LIBUSB_ERROR_TIMEOUT: return "LIBUSB_ERROR_TIMEOUT";
+        case LIBUSB_ERROR_PIPE: return "LIBUSB_ERROR_PIPE";
+        case LIBUSB_ERROR_OVERFLOW: return "LIBUSB_ERROR_OVERFLOW";
+        case LIBUSB_ERROR_NO_MEM: return "LIBUSB_ERROR_NO_MEM";
+        case LIBUSB_ERROR_NOT_SUPPORTED: return "LIBUSB_ERROR_NOT_SUPPORTED";
+        default: return "LIBUSB_ERROR_OTHER";
+        }
+    }
+
+const char *libusb_strerror(int errcode)
+    { return libusb_error_name(errcode); }
+
+/*------------------------------------------------------------------------------*
+ | Devices and descriptors                                                      |
+ *------------------------------------------------------------------------------*/
+
+ssize_t libusb_get_device_list(libusb_context *ctx, libusb_device ***list)
+    {
+    int i;
+    (void)ctx;
+    *list = (libusb_device**)calloc(NDevices + 1, sizeof(libusb_device*));
+    if(!*list) return LIBUSB_ERROR_NO_MEM;
+    for(i = 0; i < NDevices; i++)
+        { Devices[i].refcount++; (*list)[i] = &Devices[i]; }
+    return NDevices;
+    }
+
+void libusb_free_device_list(libusb_device **list, int unref_devices)
+    {
+    int i;
+    if(!list) return;
+    if(unref_devices)
+        for(i = 0; list[i]; i++) list[i]->refcount--;
+    free(list);
+    }
+
+libusb_device *libusb_ref_device(libusb_device *dev)
+    { dev->refcount++; return dev; }
+
+void libusb_unref_device(libusb_device *dev)
+    { dev->refcount--; }
+
+uint8_t libusb_get_bus_number(libusb_device *dev)
+    { (void)dev; return 1; }
+
+uint8_t libusb_get_port_number(libusb_device *dev)
+    { return 1 + dev->index; }
+
+int libusb_get_port_numbers(libusb_device *dev, uint8_t *port_numbers, int len)
+    {
+    if(len < 1) return LIBUSB_ERROR_OVERFLOW;
+    port_numbers[0] = 1 + dev->index;
+    return 1;
+    }
+
+libusb_device *libusb_get_parent(libusb_device *dev)
+    { (void)dev; return NULL; }
+
+uint8_t libusb_get_device_address(libusb_device *dev)
+    { return 2 + dev->index; }
+
+int libusb_get_device_speed(libusb_device *dev)
+    { (void)dev; return LIBUSB_SPEED_HIGH; }
+
+int libusb_get_max_packet_size(libusb_device *dev, unsigned char endpoint)
+    { (void)dev; return endpoint == 0x82 ? 64 : endpoint == 0x83 ? 1024 : 512; }
+
+int libusb_get_max_iso_packet_size(libusb_device *dev, unsigned char endpoint)
+    { return libusb_get_max_packet_size(dev, endpoint); }
+
+int libusb_get_device_descriptor(libusb_device *dev, struct libusb_device_descriptor *desc)
+    {
+    memset(desc, 0, sizeof(*desc));
+    desc->bLength = LIBUSB_DT_DEVICE_SIZE;
+    desc->bDescriptorType = LIBUSB_DT_DEVICE;
+    desc->bcdUSB = 0x0200;
+    desc->bDeviceClass = LIBUSB_CLASS_VENDOR_SPEC;
+    desc->bMaxPacketSize0 = 64;
+    desc->idVendor = 0x1d6b; /* Linux Foundation */
+    desc->idProduct = 0x0104 + dev->index;
+    desc->bcdDevice = 0x0100;
+    desc->iManufacturer = 1;
+    desc->iProduct = 2;
+    desc->iSerialNumber = 3;
+    desc->bNumConfigurations = 1;
+    return LIBUSB_SUCCESS;
+    }
+
+#define ENDPOINT(address, type, size, interval) {                         \
+    .bLength = LIBUSB_DT_ENDPOINT_SIZE, .bDescriptorType = LIBUSB_DT_ENDPOINT,  \
+    .bEndpointAddress = (address), .bmAttributes = (type),                      \
+    .wMaxPacketSize = (size), .bInterval = (interval) }
+static const struct libusb_endpoint_descriptor Endpoints[] = {
+    ENDPOINT(0x81, LIBUSB_TRANSFER_TYPE_BULK, 512, 0),
+    ENDPOINT(0x01, LIBUSB_TRANSFER_TYPE_BULK, 512, 0),
+    ENDPOINT(0x82, LIBUSB_TRANSFER_TYPE_INTERRUPT, 64, 1),
+    ENDPOINT(0x83, LIBUSB_TRANSFER_TYPE_ISOCHRONOUS, 1024, 1),
+};
+#undef ENDPOINT
+
+static const struct libusb_interface_descriptor Altsetting = {
+    .bLength = LIBUSB_DT_INTERFACE_SIZE, .bDescriptorType = LIBUSB_DT_INTERFACE,
+    .bNumEndpoints = 4, .bInterfaceClass = LIBUSB_CLASS_VENDOR_SPEC, .endpoint = Endpoints,
+};
+
+static const struct libusb_interface Interface = { .altsetting = &Altsetting, .num_altsetting = 1 };
+
+static int GetConfig(uint8_t value, struct libusb_config_descriptor **config)
+    {
+    struct libusb_config_descriptor *c;
+    if(value != 1) return LIBUSB_ERROR_NOT_FOUND;
+    c = (struct libusb_config_descriptor*)calloc(1, sizeof(*c));
+    if(!c) return LIBUSB_ERROR_NO_MEM;
+    c->bLength = LIBUSB_DT_CONFIG_SIZE;
+    c->bDescriptorType = LIBUSB_DT_CONFIG;
+    c->wTotalLength = LIBUSB_DT_CONFIG_SIZE + LIBUSB_DT_INTERFACE_SIZE + 4*LIBUSB_DT_ENDPOINT_SIZE;
+    c->bNumInterfaces = 1;
+    c->bConfigurationValue = 1;
+    c->bmAttributes = 0x80;
+    c->MaxPower = 50;
+    c->interface = &Interface;
+    *config = c;
+    return LIBUSB_SUCCESS;
+    }
+
+int libusb_get_active_config_descriptor(libusb_device *dev, struct libusb_config_descriptor **config)
+    { (void)dev; return GetConfig(1, config); }
+
+int libusb_get_config_descriptor(libusb_device *dev, uint8_t config_index, struct libusb_config_descriptor **config)
+    { (void)dev; return GetConfig(config_index + 1, config); }
+
+int libusb_get_config_descriptor_by_value(libusb_device *dev, uint8_t value, struct libusb_config_descriptor **config)
+    { (void)dev; return GetConfig(value, config); }
+
+void libusb_free_config_descriptor(struct libusb_config_descriptor *config)
+    { free(config); }
+
+int libusb_get_ss_endpoint_companion_descriptor(libusb_context *ctx, const struct libusb_endpoint_descriptor *endpoint,
+        struct libusb_ss_endpoint_companion_descriptor **ep_comp)
+    { (void)ctx; (void)endpoint; (void)ep_comp; return LIBUSB_ERROR_NOT_FOUND; }
+
+void libusb_free_ss_endpoint_companion_descriptor(struct libusb_ss_endpoint_companion_descriptor *ep_comp)
+    { free(ep_comp); }
+
+int libusb_get_bos_descriptor(libusb_device_handle *dev_handle, struct libusb_bos_descriptor **bos)
+    { (void)dev_handle; (void)bos; return LIBUSB_ERROR_PIPE; }
+
+void libusb_free_bos_descriptor(struct libusb_bos_descriptor *bos)
+    { free(bos); }
+
+/*------------------------------------------------------------------------------*
+ | Device handles                                                               |
+ *------------------------------------------------------------------------------*/
+
+int libusb_open(libusb_device *dev, libusb_device_handle **dev_handle)
+    {
+    libusb_device_handle *h = (libusb_device_handle*)calloc(1, sizeof(libusb_device_handle));
+    if(!h) return LIBUSB_ERROR_NO_MEM;
+    h->device = libusb_ref_device(dev);
+    *dev_handle = h;
+    return LIBUSB_SUCCESS;
+    }
+
+libusb_device_handle *libusb_open_device_with_vid_pid(libusb_context *ctx, uint16_t vendor_id, uint16_t product_id)
+    {
+    int i;
+    libusb_device_handle *h;
+    (void)ctx;
+    if(vendor_id != 0x1d6b) return NULL;
+    for(i = 0; i < NDevices; i++)
+        {
+        if(product_id == 0x0104 + i)
+            return libusb_open(&Devices[i], &h) == LIBUSB_SUCCESS ? h : NULL;
+        }
+    return NULL;
+    }
+
+void libusb_close(libusb_device_handle *dev_handle)
+    {
+    libusb_unref_device(dev_handle->device);
+    free(dev_handle);
+    }
+
+libusb_device *libusb_get_device(libusb_device_handle *dev_handle)
+    { return dev_handle->device; }
+
+int libusb_get_configuration(libusb_device_handle *dev_handle, int *config)
+    { (void)dev_handle; *config = 1; return LIBUSB_SUCCESS; }
+
+int libusb_set_configuration(libusb_device_handle *dev_handle, int configuration)
+    { (void)dev_handle; return configuration == 1 || configuration == -1 ? LIBUSB_SUCCESS : LIBUSB_ERROR_NOT_FOUND; }
+
+int libusb_claim_interface(libusb_device_handle *dev_handle, int interface_number)
+    { (void)dev_handle; return interface_number == 0 ? LIBUSB_SUCCESS : LIBUSB_ERROR_NOT_FOUND; }
+
+int libusb_release_interface(libusb_device_handle *dev_handle, int interface_number)
+    { (void)dev_handle; return interface_number == 0 ? LIBUSB_SUCCESS : LIBUSB_ERROR_NOT_FOUND; }
+
+int libusb_set_interface_alt_setting(libusb_device_handle *dev_handle, int interface_number, int alternate_setting)
+    {
+    (void)dev_handle;
+    return interface_number == 0 && alternate_setting == 0 ? LIBUSB_SUCCESS : LIBUSB_ERROR_NOT_FOUND;
+    }
+
+int libusb_clear_halt(libusb_device_handle *dev_handle, unsigned char endpoint)
+    { (void)dev_handle; (void)endpoint; return LIBUSB_SUCCESS; }
+
+int libusb_reset_device(libusb_device_handle *dev_handle)
+    { (void)dev_handle; return LIBUSB_SUCCESS; }
+
+int libusb_set_auto_detach_kernel_driver(libusb_device_handle *dev_handle, int enable)
+    { (void)dev_handle; (void)enable; return LIBUSB_SUCCESS; }
+
+int libusb_alloc_streams(libusb_device_handle *dev_handle, uint32_t num_streams, unsigned char *endpoints, int num_endpoints)
+    { (void)dev_handle; (void)num_streams; (void)endpoints; (void)num_endpoints; return LIBUSB_ERROR_NOT_SUPPORTED; }
+
+int libusb_free_streams(libusb_device_handle *dev_handle, unsigned char *endpoints, int num_endpoints)
+    { (void)dev_handle; (void)endpoints; (void)num_endpoints; return LIBUSB_ERROR_NOT_SUPPORTED; }
+
+unsigned char *libusb_dev_mem_alloc(libusb_device_handle *dev_handle, size_t length)
+    { (void)dev_handle; (void)length; return NULL; }
+
+int libusb_dev_mem_free(libusb_device_handle *dev_handle, unsigned char *buffer, size_t length)
+    { (void)dev_handle; (void)buffer; (void)length; return LIBUSB_ERROR_NOT_SUPPORTED; }
+
+int libusb_get_string_descriptor_ascii(libusb_device_handle *dev_handle, uint8_t desc_index, unsigned char *data, int length)
+    {
+    static const char *strings[] = { "", "fakeusb", "Fake device", "0000" };
+    (void)dev_handle;
+    if(desc_index == 0 || desc_index > 3) return LIBUSB_ERROR_PIPE;
+    return snprintf((char*)data, length, "%s", strings[desc_index]);
+    }
+
+/*------------------------------------------------------------------------------*
+ | Transfers                                                                    |
+ *------------------------------------------------------------------------------*/
+
+static enum libusb_transfer_status NextStatus(int *shortlen)
+    {
+    char c = Pattern[PatternPos];
+    PatternPos = (PatternPos + 1) % PatternLen;
+    *shortlen = 0;
+    switch(c)
+        {
+        case 's': *shortlen = 1; return LIBUSB_TRANSFER_COMPLETED;
+        case 't': return LIBUSB_TRANSFER_TIMED_OUT;
+        case 'p': return LIBUSB_TRANSFER_STALL;
+        case 'e': return LIBUSB_TRANSFER_ERROR;
+        case 'o': return LIBUSB_TRANSFER_OVERFLOW;
+        default: return LIBUSB_TRANSFER_COMPLETED;
+        }
+    }
+
+static int SyncResult(enum libusb_transfer_status status)
+    {
+    switch(status)
+        {
+        case LIBUSB_TRANSFER_COMPLETED: return LIBUSB_SUCCESS;
+        case LIBUSB_TRANSFER_TIMED_OUT: return LIBUSB_ERROR_TIMEOUT;
+        case LIBUSB_TRANSFER_STALL: return LIBUSB_ERROR_PIPE;
+        case LIBUSB_TRANSFER_OVERFLOW: return LIBUSB_ERROR_OVERFLOW;
+        default: return LIBUSB_ERROR_IO;
+        }
+    }
+
+int libusb_control_transfer(libusb_device_handle *dev_handle, uint8_t request_type, uint8_t bRequest,
+        uint16_t wValue, uint16_t wIndex, unsigned char *data, uint16_t wLength, unsigned int timeout)
+    {
+    int shortlen, ec;
+    (void)dev_handle; (void)bRequest; (void)wValue; (void)wIndex; (void)timeout;
+    ec = SyncResult(NextStatus(&shortlen));
+    if(ec != LIBUSB_SUCCESS) return ec;
+    if(request_type & LIBUSB_ENDPOINT_IN) memset(data, 0, wLength);
+    return shortlen ? wLength/2 : wLength;
+    }
+
+static int SyncTransfer(unsigned char *data, int length, int *transferred)
+    {
+    int shortlen, ec;
+    ec = SyncResult(NextStatus(&shortlen));
+    *transferred = ec == LIBUSB_SUCCESS ? (shortlen ? length/2 : length) : 0;
+    (void)data; /* data is neither produced nor consumed */
+    return ec;
+    }
+
+int libusb_bulk_transfer(libusb_device_handle *dev_handle, unsigned char endpoint, unsigned char *data,
+        int length, int *transferred, unsigned int timeout)
+    { (void)dev_handle; (void)endpoint; (void)timeout; return SyncTransfer(data, length, transferred); }
+
+int libusb_interrupt_transfer(libusb_device_handle *dev_handle, unsigned char endpoint, unsigned char *data,
+        int length, int *transferred, unsigned int timeout)
+    { (void)dev_handle; (void)endpoint; (void)timeout; return SyncTransfer(data, length, transferred); }
+
+/* Pending asynchronous transfers, in submission order (a circular queue) */
+typedef struct {
+    struct libusb_transfer *transfer;
+    uint64_t due; /* completion time (ns) */
+    int cancelled;
+} pending_t;
+
+static pending_t *Queue = NULL;
+static size_t QueueSize = 0, QueueHead = 0, QueueCount = 0;
+
+static pending_t *Pending(size_t i)
+    { return &Queue[(QueueHead + i) % QueueSize]; }
+
+struct libusb_transfer *libusb_alloc_transfer(int iso_packets)
+    {
+    size_t size = sizeof(struct libusb_transfer) + iso_packets*sizeof(struct libusb_iso_packet_descriptor);
+    struct libusb_transfer *transfer = (struct libusb_transfer*)calloc(1, size);
+    if(transfer) transfer->num_iso_packets = iso_packets;
+    return transfer;
+    }
+
+void libusb_free_transfer(struct libusb_transfer *transfer)
+    {
+    if(transfer && (transfer->flags & LIBUSB_TRANSFER_FREE_BUFFER)) free(transfer->buffer);
+    free(transfer);
+    }
+
+int libusb_submit_transfer(struct libusb_transfer *transfer)
+    {
+    size_t i;
+    if(QueueCount == QueueSize)
+        {
+        size_t newsize = QueueSize ? 2*QueueSize : 256;
+        pending_t *queue = (pending_t*)malloc(newsize*sizeof(pending_t));
+        if(!queue) return LIBUSB_ERROR_NO_MEM;
+        for(i = 0; i < QueueCount; i++) queue[i] = *Pending(i);
+        free(Queue);
+        Queue = queue;
+        QueueSize = newsize;
+        QueueHead = 0;
+        }
+    Queue[(QueueHead + QueueCount) % QueueSize].transfer = transfer;
+    Queue[(QueueHead + QueueCount) % QueueSize].due = Latency ? Now() + Latency : 0;
+    Queue[(QueueHead + QueueCount) % QueueSize].cancelled = 0;
+    QueueCount++;
+    return LIBUSB_SUCCESS;
+    }
+
+int libusb_cancel_transfer(struct libusb_transfer *transfer)
+    {
+    size_t i;
+    for(i = 0; i < QueueCount; i++)
+        {
+        pending_t *p = Pending(i);
+        if(p->transfer == transfer && !p->cancelled)
+            { p->cancelled = 1; p->due = 0; return LIBUSB_SUCCESS; }
+        }
+    return LIBUSB_ERROR_NOT_FOUND;
+    }
+
+void libusb_transfer_set_stream_id(struct libusb_transfer *transfer, uint32_t stream_id)
+    { (void)transfer; (void)stream_id; }
+
+uint32_t libusb_transfer_get_stream_id(struct libusb_transfer *transfer)
+    { (void)transfer; return 0; }
+
+static void Complete(struct libusb_transfer *transfer, int cancelled)
+    {
+    int i, shortlen;
+    if(cancelled)
+        {
+        transfer->status = LIBUSB_TRANSFER_CANCELLED;
+        transfer->actual_length = 0;
+        }
+    else if(transfer->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS)
+        {
+        transfer->status = LIBUSB_TRANSFER_COMPLETED;
+        transfer->actual_length = 0;
+        for(i = 0; i < transfer->num_iso_packets; i++)
+            {
+            struct libusb_iso_packet_descriptor *desc = &transfer->iso_packet_desc[i];
+            desc->status = NextStatus(&shortlen);
+            desc->actual_length = desc->status != LIBUSB_TRANSFER_COMPLETED ? 0 :
+                    shortlen ? desc->length/2 : desc->length;
+            }
+        }
+    else
+        {
+        int length = transfer->length;
+        if(transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL) length -= LIBUSB_CONTROL_SETUP_SIZE;
+        transfer->status = NextStatus(&shortlen);
+        transfer->actual_length = transfer->status != LIBUSB_TRANSFER_COMPLETED ? 0 :
+                shortlen ? length/2 : length;
+        }
+    transfer->callback(transfer);
+    }
+
+static int HandleEvents(struct timeval *tv, int *completed)
+    {
+    size_t n, max;
+    uint64_t now, timeout = tv ? (uint64_t)tv->tv_sec*1000000000 + (uint64_t)tv->tv_usec*1000 : UINT64_MAX;
+    if(QueueCount > 0 && !Pending(0)->cancelled && Pending(0)->due > 0)
+        {
+        /* wait until the first pending transfer is due, or until the timeout expires */
+        struct timespec ts;
+        now = Now();
+        if(Pending(0)->due > now)
+            {
+            uint64_t wait = Pending(0)->due - now;
+            if(wait > timeout) wait = timeout;
+            ts.tv_sec = wait/1000000000;
+            ts.tv_nsec = wait%1000000000;
+            nanosleep(&ts, NULL);
+            }
+        }
+    /* Complete the transfers that are due at this time. Transfers resubmitted in
+     * callbacks are appended to the queue, and they are not considered here. */
+    now = Now();
+    max = QueueCount;
+    if(Batch > 0 && max > (size_t)Batch) max = Batch;
+    for(n = 0; n < max; n++)
+        {
+        pending_t p = *Pending(0);
+        if(!p.cancelled && p.due > now) break;
+        QueueHead = (QueueHead + 1) % QueueSize;
+        QueueCount--;
+        Complete(p.transfer, p.cancelled);
+        }
+    if(completed) *completed = 1;
+    return LIBUSB_SUCCESS;
+    }
+
+int libusb_handle_events(libusb_context *ctx)
+    { (void)ctx; return HandleEvents(NULL, NULL); }
+
+int libusb_handle_events_completed(libusb_context *ctx, int *completed)
+    { (void)ctx; return HandleEvents(NULL, completed); }
+
+int libusb_handle_events_timeout(libusb_context *ctx, struct timeval *tv)
+    { (void)ctx; return HandleEvents(tv, NULL); }
+
+int libusb_handle_events_timeout_completed(libusb_context *ctx, struct timeval *tv, int *completed)
+    { (void)ctx; return HandleEvents(tv, completed); }
+
+int libusb_get_next_timeout(libusb_context *ctx, struct timeval *tv)
+    { (void)ctx; (void)tv; return 0; }
+
+void libusb_lock_events(libusb_context *ctx)
+    { (void)ctx; }
+
+void libusb_unlock_events(libusb_context *ctx)
+    { (void)ctx; }
+
+/*------------------------------------------------------------------------------*
+ | Hotplug                                                                      |
+ *------------------------------------------------------------------------------*/
+
+int libusb_hotplug_register_callback(libusb_context *ctx, int events, int flags, int vendor_id,
+        int product_id, int dev_class, libusb_hotplug_callback_fn cb_fn, void *user_data,
+        libusb_hotplug_callback_handle *callback_handle)
+    {
+    static libusb_hotplug_callback_handle next_handle = 1;
+    int i;
+    (void)vendor_id; (void)product_id; (void)dev_class;
+    *callback_handle = next_handle++;
+    if((flags & LIBUSB_HOTPLUG_ENUMERATE) && (events & LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED))
+        for(i = 0; i < NDevices; i++)
+            cb_fn(ctx, &Devices[i], LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, user_data);
+    return LIBUSB_SUCCESS;
+    }
+
+void libusb_hotplug_deregister_callback(libusb_context *ctx, libusb_hotplug_callback_handle callback_handle)
+    { (void)ctx; (void)callback_handle; }
+
@@ -0,0 +1,188 @@
+#!/usr/bin/env lua
+-- MoonUSB end-to-end benchmark of the emulator over a local USB/IP connection.
+--
+-- The device side is the moonusb.emulator module, running a benchmark device built
+-- on its device models.
+-- The host side is a minimal USB/IP client stand-in (no usbip tool nor vhci-hcd needed),
+-- that imports the device and keeps a number of URBs in flight on it, measuring the
+-- throughput and the latency (from sending a USBIP_CMD_SUBMIT to receiving its
+-- USBIP_RET_SUBMIT) over the loopback TCP connection.
+--
+-- Usage:
+--    lua usbip.lua device [port]
+--    lua usbip.lua export [port]
+--    lua usbip.lua client [workload] [count] [size] [depth] [port]
+-- workload: 'bulk-in', 'bulk-out', 'interrupt', 'control' or 'all' (default),
+-- count: number of URBs (default 20000),
+-- size: transfer length in bytes for bulk workloads (default 16384),
+-- depth: number of URBs in flight (default 8),
+-- port: TCP port (default 3240).
+-- The 'usbip' target of bench/Makefile runs both sides.
+--
+-- In 'export' mode, the device side is instead the first device of the fakeusb shim,
+-- exported with emulator.export(), so that the client measures the exporter's path
+-- to the async transfers API (the 'usbip-export' target).
+
+local socket = require("socket")
+local usb = require("moonusb")
+
+local fmt = string.format
+local pack, unpack = string.pack, string.unpack
+
+local mode = arg[1] or "client"
+
+local BUSNUM, DEVNUM = 1, 1
+local BUSID = BUSNUM.."-"..DEVNUM
+local EP_BULK, EP_INTERRUPT = 1, 2
+local INTERRUPT_SIZE = 64
+
+-------------------------------------------------------------------------------
+-- Device side
+-------------------------------------------------------------------------------
+
+local function device(port)
+   local emulator = require("moonusb.emulator")
+   -- Pre-generated responses, one per requested length
+   local source = setmetatable({}, { __index = function(t, len)
+      local data = string.rep("\x55\xaa", (len+1)//2):sub(1, len)
+      t[len] = data
+      return data
+   end})
+
+   local function receive_submit(submit)
+      -- control (the other endpoints are served by the built-in models):
+      -- return wLength bytes of data for IN requests
+      local bmRequestType, _, _, _, wLength = unpack("<I1I1I2I2I2", submit.setup)
+      if bmRequestType & 0x80 ~= 0 then
+         emulator.send_submit_response(submit, 0, 0, source[wLength])
+      else
+         emulator.send_submit_response(submit, 0, 0)
+      end
+   end
+
+   emulator.start({
+      port = port,
+      busnum = BUSNUM,
+      devnum = DEVNUM,
+      vendor_id = 0x1d6b,
+      product_id = 0x0104,
+      device_class = 'vendor specific',
+      interfaces = { { class = 'vendor specific' } },
+      receive_submit = receive_submit,
+      endpoints = {
+         [0x80 | EP_BULK] = emulator.source({ pattern = "\x55\xaa" }),
+         [EP_BULK] = emulator.sink(),
+         [0x80 | EP_INTERRUPT] = emulator.interrupt({ interval = 0, size = INTERRUPT_SIZE }),
+      },
+   })
+end
+
+local function export(port)
+   local emulator = require("moonusb.emulator")
+   local ctx = usb.init()
+   local device = assert(ctx:get_device_list()[1], "no devices (is fakeusb in the library path?)")
+   local devhandle = device:open()
+   -- bus and device numbers are overridden, so that the client finds the device
+   emulator.start(emulator.export(ctx, device, devhandle, {
+      port = port,
+      busnum = BUSNUM,
+      devnum = DEVNUM,
+   }))
+end
+
+-------------------------------------------------------------------------------
+-- Host side (USB/IP client stand-in)
+-------------------------------------------------------------------------------
+
+local USBIP_VER = 0x0111
+local OP_REQ_IMPORT = 0x8003
+local USBIP_CMD_SUBMIT, USBIP_RET_SUBMIT = 1, 3
+local DEVID = BUSNUM << 16 | DEVNUM
+
+local function import(port)
+   local conn = assert(socket.connect("127.0.0.1", port))
+   conn:setoption('tcp-nodelay', true)
+   assert(conn:send(pack(">I2I2I4c32", USBIP_VER, OP_REQ_IMPORT, 0, BUSID)))
+   local _, _, status = unpack(">I2I2I4", assert(conn:receive(8)))
+   assert(status == 0, "import failed")
+   assert(conn:receive(312)) -- device info
+   return conn
+end
+
+local function percentile(sorted, p)
+   return sorted[math.max(1, math.ceil(p*#sorted))]
+end
+
+local function run(workload, count, size, depth, port)
+   local conn = import(port)
+   local ep, dir, len, setup, outdata = EP_BULK, 0, size, string.rep("\0", 8), nil
+   if workload == 'bulk-in' then
+      dir = 1
+   elseif workload == 'bulk-out' then
+      outdata = string.rep("\x5a", size)
+   elseif workload == 'interrupt' then
+      ep, dir, len = EP_INTERRUPT, 1, INTERRUPT_SIZE
+   elseif workload == 'control' then
+      -- GET_DESCRIPTOR (device)
+      ep, dir, len = 0, 1, 18
+      setup = pack("<I1I1I2I2I2", 0x80, 6, 0x0100, 0, 18)
+   else
+      error("unknown workload '"..workload.."'")
+   end
+
+   local sent_at, latency = {}, {}
+   local seqnum, received, bytes = 0, 0, 0
+
+   local function submit()
+      seqnum = seqnum + 1
+      local hdr = pack(">I4I4I4I4I4I4I4I4I4I4c8", USBIP_CMD_SUBMIT, seqnum, DEVID, dir, ep,
+         0, len, 0, 0, 0, setup)
+      sent_at[seqnum] = usb.now()
+      assert(conn:send(outdata and hdr..outdata or hdr))
+   end
+
+   local t0 = usb.now()
+   for i = 1, math.min(depth, count) do submit() end
+   while received < count do
+      local hdr = assert(conn:receive(48))
+      local cmd, seq, _, _, _, status, actual_length = unpack(">I4I4I4I4I4i4I4", hdr)
+      assert(cmd == USBIP_RET_SUBMIT and status == 0, "bad response")
+      if dir == 1 and actual_length > 0 then assert(conn:receive(actual_length)) end
+      latency[#latency+1] = usb.now() - sent_at[seq]
+      sent_at[seq] = nil
+      bytes = bytes + (dir == 1 and actual_length or len)
+      received = received + 1
+      if seqnum < count then submit() end
+   end
+   local elapsed = usb.now() - t0
+   conn:close()
+
+   table.sort(latency)
+   print(fmt("%-10s %6d %6d %10.0f %9.2f %9.1f %9.1f %9.1f %9.1f", workload, len, depth,
+      count/elapsed, bytes/elapsed/1e6,
+      percentile(latency, .5)*1e6, percentile(latency, .9)*1e6,
+      percentile(latency, .99)*1e6, latency[#latency]*1e6))
+end
+
+local function client(workload, count, size, depth, port)
+   print(fmt("%-10s %6s %6s %10s %9s %9s %9s %9s %9s", "workload", "size", "depth",
+      "URB/s", "MB/s", "p50(us)", "p90(us)", "p99(us)", "max(us)"))
+   if workload == 'all' then
+      for _, w in ipairs({ 'bulk-in', 'bulk-out', 'interrupt', 'control' }) do
+         run(w, count, size, depth, port)
+      end
+   else
+      run(workload, count, size, depth, port)
+   end
+end
+
+if mode == "device" then
+   device(tonumber(arg[2]) or 3240)
+elseif mode == "export" then
+   export(tonumber(arg[2]) or 3240)
+elseif mode == "client" then
+   client(arg[2] or 'all', tonumber(arg[3]) or 20000, tonumber(arg[4]) or 16384,
+      tonumber(arg[5]) or 8, tonumber(arg[6]) or 3240)
+else
+   error("usage: lua usbip.lua device|export|client ...")
+end
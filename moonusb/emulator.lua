@@ -48,6 +48,8 @@ local VENDOR_ID, PRODUCT_ID, RELEASE_NUMBER
 local PATH, SPEED, BUSNUM, DEVNUM, BUSID, DEVID
 local DEVICE_CLASS, DEVICE_SUBCLASS, DEVICE_PROTOCOL
 local NUM_CONFIGURATIONS, CONFIGURATION_VALUE, INTERFACES
+local ENDPOINTS -- device models, indexed by endpoint address
+local POLLED -- device models that need to be polled (those with a poll() method)
 
 -- usbip opcodes
 local OP_REQ_DEVLIST    = 0x8005
@@ -100,46 +102,84 @@ local USB_SPEED = doubleface({
 
 -- USBIP protocol --------------------------------------------------------------
 
+local client_fd -- fd of the client socket, for the C send path
+
+-- Responses are sent by the C functions in src/usbip.c where these are supported (Linux),
+-- and are packed and sent from Lua otherwise.
+local C_TRANSPORT = pcall(usb.usbip_uncork)
+local cork, uncork = usb.usbip_cork, usb.usbip_uncork
+if not C_TRANSPORT then cork, uncork = function() end, function() end end
+
+local function respond(submit, status, error_count, data, actual_length, iso_descriptors)
+-- Sends a USBIP_RET_SUBMIT. With the C transport, the header and the data (a string, a
+-- hostmem, or a ptr to actual_length bytes) are gathered with writev(), so the data is
+-- not copied. Otherwise the data must be a string.
+   if C_TRANSPORT then
+      usb.usbip_send_ret_submit(client_fd, submit.seqnum, submit.devid, USB_DIR[submit.direction],
+         submit.ep, status, actual_length, submit.start_frame, submit.number_of_packets,
+         error_count, data, iso_descriptors)
+      return
+   end
+   local hdr = pack(">I4I4I4I4I4i4I4I4I4I4I8", USBIP_RET_SUBMIT, submit.seqnum, submit.devid,
+      USB_DIR[submit.direction], submit.ep, status, actual_length, submit.start_frame,
+      submit.number_of_packets, error_count, 0)
+   if data and #data > 1024 then
+      client:send(hdr)
+      client:send(data)
+   else
+      client:send(data and hdr..data or hdr)
+   end
+   if iso_descriptors then client:send(iso_descriptors) end
+end
+
+local function respond_error(submit, status)
+-- Sends a USBIP_RET_SUBMIT with an error status and no data. For iso submits the
+-- packet descriptors are sent as well (with no actual data), since the client reads
+-- number_of_packets of them.
+   local d
+   if submit.number_of_packets > 0 then
+      d = {}
+      for i = 1, submit.number_of_packets do
+         local offset, length = unpack(">I4I4", submit.iso_packet_descriptors, (i-1)*16+1)
+         d[i] = pack(">I4I4I4i4", offset, length, 0, status)
+      end
+      d = table.concat(d)
+   end
+   respond(submit, status, 0, nil, 0, d)
+end
+
 local function send_submit_response(submit, status, error_count, data)
 -- Send a USBIP_RET_SUBMIT response.
 -- submit: the unmodified submit received via the receive_submit() callback,
 -- status: 0 for success, non-zero for error @@ codes from <errno.h>?
 -- error_count: integer
 -- data: binary string containing the URB response, or nil if none
-   local t = {}
-   -- truncate data if too long to fit (the driver will repeat the
-   -- submit request with the appropriate length)
-   if data and #data > submit.transfer_buffer_length then
-      data = data:sub(1, submit.transfer_buffer_length)
+   local actual_length
+   if submit.direction == 'in' then
+      -- truncate data if too long to fit (the driver will repeat the
+      -- submit request with the appropriate length)
+      if data and #data > submit.transfer_buffer_length then
+         data = data:sub(1, submit.transfer_buffer_length)
+      end
+      actual_length = data and #data or 0
+   else -- for 'out' submits, the data is the one that was received
+      data = nil
+      actual_length = (status or 0) == 0 and submit.transfer_buffer_length or 0
    end
-   t[#t+1] = pack(">I4", USBIP_RET_SUBMIT)
-   t[#t+1] = pack(">I4", submit.seqnum)
-   t[#t+1] = pack(">I4", submit.devid)
-   t[#t+1] = pack(">I4", USB_DIR[submit.direction])
-   t[#t+1] = pack(">I4", submit.ep)
-   t[#t+1] = pack(">i4", status or 0)
-   t[#t+1] = pack(">I4", data and #data or 0) -- actual_length
-   t[#t+1] = pack(">I4", submit.start_frame)
-   t[#t+1] = pack(">I4", submit.number_of_packets)
-   t[#t+1] = pack(">I4", error_count or 0)
-   t[#t+1] = zeropad(8) -- setup
-   t[#t+1] = data
-   client:send(table.concat(t))
+   respond(submit, status or 0, error_count or 0, data, actual_length)
 end
 
 local function send_unlink_response(unlink, status)
 -- Send a USBIP_RET_UNLINK response.
 -- unlink: the unmodified unlink received via the receive_unlink() callback,
 -- status: 0 for success, non-zero for error @@ codes from <errno.h>?
-   local t = {}
-   t[#t+1] = pack(">I4", USBIP_RET_UNLINK)
-   t[#t+1] = pack(">I4", unlink.victim_seqnum)
-   t[#t+1] = pack(">I4", unlink.devid)
-   t[#t+1] = pack(">I4", USB_DIR[unlink.direction])
-   t[#t+1] = pack(">I4", unlink.ep)
-   t[#t+1] = pack(">i4", status or 0)
-   t[#t+1] = zeropad(24)
-   client:send(table.concat(t))
+   if C_TRANSPORT then
+      usb.usbip_send_ret_unlink(client_fd, unlink.seqnum, unlink.devid, USB_DIR[unlink.direction],
+         unlink.ep, status or 0)
+      return
+   end
+   client:send(pack(">I4I4I4I4I4i4", USBIP_RET_UNLINK, unlink.seqnum, unlink.devid,
+      USB_DIR[unlink.direction], unlink.ep, status or 0)..zeropad(24))
 end
 
 local function send_devlist_response()
@@ -193,6 +233,564 @@ local function send_import_response(busid)
    return true
 end
 
+-- Device models --------------------------------------------------------------
+-- Built-in endpoint implementations for load generation. Each model is an object
+-- with a submit(submit) and an unlink(seqnum) method, and is bound to one or more
+-- endpoint addresses via cfg.endpoints. Response data is pre-generated (one buffer
+-- per requested length), so serving an URB allocates no data in Lua.
+
+local now = usb.now
+local Scheduled = {} -- delayed responses, ordered by due time: { due, model, submit }
+
+local function schedule(due, model, submit)
+   local i = #Scheduled
+   while i > 0 and Scheduled[i].due > due do i = i - 1 end
+   table.insert(Scheduled, i + 1, { due = due, model = model, submit = submit })
+end
+
+local function unschedule(model, seqnum)
+   for i, e in ipairs(Scheduled) do
+      if e.model == model and e.submit.seqnum == seqnum then
+         table.remove(Scheduled, i)
+         return true
+      end
+   end
+   return false
+end
+
+local function run_scheduled()
+-- Completes the due responses, and returns the due time of the next one (if any).
+   local t = now()
+   while Scheduled[1] and Scheduled[1].due <= t do
+      local e = table.remove(Scheduled, 1)
+      e.model:complete(e.submit)
+   end
+   return Scheduled[1] and Scheduled[1].due
+end
+
+local function buffers(pattern)
+-- Returns a table of pre-generated buffers, indexed by length, repeating the given pattern.
+   return setmetatable({}, { __index = function(t, len)
+      local data = rep(pattern, len // #pattern + 1):sub(1, len)
+      rawset(t, len, data)
+      return data
+   end})
+end
+
+local RAMP = string.char(table.unpack((function()
+   local t = {} for i = 0, 255 do t[i+1] = i end return t
+end)()))
+
+local function unlink_pending(pending, seqnum)
+   for i, submit in ipairs(pending) do
+      if submit.seqnum == seqnum then table.remove(pending, i) return true end
+   end
+   return false
+end
+
+local function source(cfg)
+-- Bulk IN source: answers each submit with transfer_buffer_length bytes of pattern data.
+   cfg = cfg or {}
+   local data = buffers(cfg.pattern or RAMP)
+   return {
+      submit = function(self, submit)
+         respond(submit, 0, 0, data[submit.transfer_buffer_length], submit.transfer_buffer_length)
+      end,
+      unlink = function(self, seqnum) return false end,
+   }
+end
+
+local function sink(cfg)
+-- Bulk OUT sink: accepts and discards any data.
+   return {
+      submit = function(self, submit)
+         respond(submit, 0, 0, nil, submit.transfer_buffer_length)
+      end,
+      unlink = function(self, seqnum) return false end,
+   }
+end
+
+local function loopback(cfg)
+-- Bulk loopback: data received on the OUT endpoint is returned on the IN endpoint,
+-- in order. IN submits are held until data is available.
+   local fifo, pending = {}, {}
+   local function serve()
+      while fifo[1] and pending[1] do
+         local submit = table.remove(pending, 1)
+         local len = submit.transfer_buffer_length
+         local data = fifo[1]
+         if #data > len then
+            fifo[1] = data:sub(len + 1)
+            data = data:sub(1, len)
+         else
+            table.remove(fifo, 1)
+         end
+         respond(submit, 0, 0, data, #data)
+      end
+   end
+   return {
+      submit = function(self, submit)
+         if submit.direction == 'out' then
+            respond(submit, 0, 0, nil, submit.transfer_buffer_length)
+            if submit.data then fifo[#fifo+1] = submit.data end
+         else
+            pending[#pending+1] = submit
+         end
+         serve()
+      end,
+      unlink = function(self, seqnum) return unlink_pending(pending, seqnum) end,
+      reset = function(self) fifo, pending = {}, {} end,
+   }
+end
+
+local function interrupt(cfg)
+-- Interrupt IN generator: answers one submit every cfg.interval milliseconds with
+-- cfg.data, or with cfg.size bytes of pattern data.
+   cfg = cfg or {}
+   local interval = (cfg.interval or 10)/1000
+   local data = cfg.data or buffers(cfg.pattern or RAMP)[cfg.size or 8]
+   local truncated = setmetatable({}, { __index = function(t, len)
+      local d = data:sub(1, len)
+      rawset(t, len, d)
+      return d
+   end})
+   local next_time = 0
+   return {
+      submit = function(self, submit)
+         local t = now()
+         if next_time < t then next_time = t end
+         schedule(next_time, self, submit)
+         next_time = next_time + interval
+      end,
+      complete = function(self, submit)
+         local d = truncated[submit.transfer_buffer_length]
+         respond(submit, 0, 0, d, #d)
+      end,
+      unlink = function(self, seqnum) return unschedule(self, seqnum) end,
+      reset = function(self) next_time = 0 end,
+   }
+end
+
+local function iso(cfg)
+-- Isochronous stream: IN submits are answered with all the requested packets filled
+-- with pattern data, OUT submits are accepted and discarded. If cfg.interval is given,
+-- one submit is completed every cfg.interval milliseconds.
+   cfg = cfg or {}
+   local interval = cfg.interval and cfg.interval/1000
+   local data = buffers(cfg.pattern or RAMP)
+   -- Response descriptors and total length, cached by request descriptors
+   local descriptors = setmetatable({}, { __index = function(t, req)
+      local d, total = {}, 0
+      for i = 1, #req//16 do
+         local offset, length = unpack(">I4I4", req, (i-1)*16 + 1)
+         d[i] = pack(">I4I4I4i4", offset, length, length, 0)
+         total = total + length
+      end
+      local entry = { table.concat(d), total }
+      rawset(t, req, entry)
+      return entry
+   end})
+   local next_time = 0
+   return {
+      submit = function(self, submit)
+         if not interval then return self:complete(submit) end
+         local t = now()
+         if next_time < t then next_time = t end
+         schedule(next_time, self, submit)
+         next_time = next_time + interval
+      end,
+      complete = function(self, submit)
+         local d = descriptors[submit.iso_packet_descriptors or ""]
+         local total = d[2]
+         respond(submit, 0, 0, submit.direction == 'in' and data[total] or nil, total, d[1])
+      end,
+      unlink = function(self, seqnum) return unschedule(self, seqnum) end,
+      reset = function(self) next_time = 0 end,
+   }
+end
+
+-- Replay --------------------------------------------------------------------
+-- Replays a log recorded with usb.record_open() (see src/record.c for its format).
+
+local ERRNO = { -- libusb_transfer_status -> negated errno
+   [0] = 0,    -- completed
+   [1] = -71,  -- error (-EPROTO)
+   [2] = -110, -- timed out (-ETIMEDOUT)
+   [3] = -2,   -- cancelled (-ENOENT)
+   [4] = -32,  -- stall (-EPIPE)
+   [5] = -19,  -- no device (-ENODEV)
+   [6] = -75,  -- overflow (-EOVERFLOW)
+}
+
+local function load_log(filename)
+-- Returns the recorded speed, and the recorded transfers indexed by endpoint address
+-- (non-control) or by setup packet (control).
+   local f, errmsg = io.open(filename, "rb")
+   if not f then error(errmsg) end
+   local s = f:read("a")
+   f:close()
+   local magic, version, speed, pos = unpack("=c8I2I1", s)
+   if magic ~= "MUSBREC\0" or version ~= 1 then error("invalid log file '"..filename.."'") end
+   pos = 17
+   local endpoints, control = {}, {}
+   local function add(t, key, e)
+      if not t[key] then t[key] = { i = 0 } end
+      table.insert(t[key], e)
+   end
+   while pos <= #s do
+      local e, xtype, ep, reserved, length, niso, datalen, setup = {}
+      xtype, ep, e.status, reserved, e.latency, e.time, length, e.actual_length, niso, datalen, pos =
+         unpack("=I1I1I1I1I4I8I4I4I4I4", s, pos)
+      e.latency = e.latency/1e6
+      if xtype == 0 then setup = s:sub(pos, pos+7); pos = pos + 8 end
+      if niso > 0 then
+         e.iso = {}
+         for i = 1, niso do
+            local plen, pactual, pstatus
+            plen, pactual, pstatus, pos = unpack("=I4I4I4", s, pos)
+            e.iso[i] = { length = plen, actual_length = pactual, status = pstatus }
+         end
+      end
+      e.data = s:sub(pos, pos+datalen-1)
+      pos = pos + datalen
+      if setup then
+         add(control, setup, e)
+         add(control, setup:sub(1, 6), e) -- fallback, for requests with a different wLength
+      else
+         add(endpoints, ep, e)
+      end
+   end
+   return speed, endpoints, control
+end
+
+local function iso_response(submit, e)
+-- Returns data and descriptors for an iso submit, with the recorded packets
+   local data, desc = {}, {}
+   local offset = 1 -- offset of the recorded packet in e.data
+   local total = 0
+   for i = 1, submit.number_of_packets do
+      local req_offset, req_length = unpack(">I4I4", submit.iso_packet_descriptors, (i-1)*16 + 1)
+      local p = e.iso and e.iso[i] or { length = 0, actual_length = 0, status = 0 }
+      local actual = math.min(p.actual_length, req_length)
+      if submit.direction == 'in' then data[#data+1] = e.data:sub(offset, offset+actual-1) end
+      desc[i] = pack(">I4I4I4i4", req_offset, req_length, actual, ERRNO[p.status] or -71)
+      offset = offset + p.length
+      total = total + actual
+   end
+   return table.concat(data), table.concat(desc), total
+end
+
+local function replay(filename, cfg)
+-- Returns an emulator configuration (to be passed to emulator.start) for a device
+-- replaying the given log. The fields in cfg are copied in it, and take precedence
+-- over the recorded ones.
+   cfg = cfg or {}
+   local speed, endpoints, control = load_log(filename)
+   local speedup = cfg.speedup or 1
+   local pending, last_due = {}, {}
+
+   local function nextentry(list)
+      list.i = list.i % #list + 1
+      return list[list.i]
+   end
+
+   local model = {
+      submit = function(self, submit)
+         local key = submit.ep | (submit.direction == 'in' and 0x80 or 0)
+         local list
+         if submit.ep == 0 then
+            list = control[submit.setup] or control[submit.setup:sub(1, 6)]
+            if not list then -- not recorded: stall IN requests, accept OUT requests
+               return respond(submit, submit.direction == 'in' and -32 or 0, 0, nil, 0)
+            end
+         else
+            list = endpoints[key]
+            if not list then return respond_error(submit, -32) end
+         end
+         submit.entry = nextentry(list)
+         if submit.entry.status == 2 or submit.entry.status == 3 then
+            -- timed out or cancelled: the device never answered, wait for the unlink
+            pending[#pending+1] = submit
+            return
+         end
+         local delay = (speedup > 0 and speedup < math.huge) and submit.entry.latency/speedup or 0
+         local t = now()
+         local due = math.max(t + delay, last_due[key] or 0) -- keep the endpoint's order
+         last_due[key] = due
+         if due <= t then return self:complete(submit) end
+         schedule(due, self, submit)
+      end,
+      complete = function(self, submit)
+         local e = submit.entry
+         local status = ERRNO[e.status] or -71
+         if submit.number_of_packets > 0 then
+            local data, desc, total = iso_response(submit, e)
+            return respond(submit, status, 0, data, total, desc)
+         end
+         local len = math.min(e.actual_length, submit.transfer_buffer_length)
+         local data = submit.direction == 'in' and e.data:sub(1, len) or nil
+         respond(submit, status, 0, data, data and #data or len)
+      end,
+      unlink = function(self, seqnum)
+         return unlink_pending(pending, seqnum) or unschedule(self, seqnum)
+      end,
+      reset = function(self)
+         pending, last_due = {}, {}
+         for _, list in pairs(endpoints) do list.i = 0 end
+         for _, list in pairs(control) do list.i = 0 end
+      end,
+   }
+
+   -- Device information, from the recorded descriptors
+   local t = {}
+   local dev = control["\x80\x06\x00\x01\x00\x00"]
+   if dev then
+      local d = dev[1].data
+      local class, subclass, protocol = unpack("I1I1I1", d, 5)
+      local vendor_id, product_id, release, _, _, _, num_configurations = unpack("<I2I2I2I1I1I1I1", d, 9)
+      t.vendor_id, t.product_id, t.release_number = vendor_id, product_id, bcd2str(release)
+      t.device_class = USB_CLASS[class] or 'vendor specific'
+      t.device_subclass, t.device_protocol = subclass, protocol
+      t.num_configurations = num_configurations
+   end
+   local conf = control["\x80\x06\x00\x02\x00\x00"]
+   if conf then
+      local d, pos = conf[1].data, 1
+      t.configuration_value = d:byte(6)
+      t.interfaces = {}
+      while pos + 1 <= #d do
+         local len, dtype = d:byte(pos, pos+1)
+         if len == 0 then break end
+         if dtype == 4 and d:byte(pos+3) == 0 then -- interface, altsetting 0
+            local class, subclass, protocol = d:byte(pos+5, pos+7)
+            table.insert(t.interfaces, { class = USB_CLASS[class] or 'vendor specific',
+               subclass = subclass, protocol = protocol })
+         end
+         pos = pos + len
+      end
+   end
+   t.speed = USB_SPEED[speed] or 'high'
+   t.endpoints = { [0x00] = model, [0x80] = model }
+   for ep in pairs(endpoints) do t.endpoints[ep] = model end
+   for k, v in pairs(cfg) do
+      if k == 'endpoints' then
+         for ep, m in pairs(v) do t.endpoints[ep] = m end
+      elseif k ~= 'speedup' then
+         t[k] = v
+      end
+   end
+   return t
+end
+
+-- Exporter ------------------------------------------------------------------
+-- Exports a real device: submits are mapped to asynchronous libusb transfers, with
+-- as many in flight as the host submits, and responses are sent as they complete.
+
+local STATUS = { -- transferstatus -> libusb_transfer_status
+   ['completed'] = 0, ['error'] = 1, ['timeout'] = 2, ['cancelled'] = 3,
+   ['stall'] = 4, ['no device'] = 5, ['overflow'] = 6,
+}
+
+local function export(context, device, devhandle, cfg)
+-- Returns an emulator configuration (to be passed to emulator.start) for a device
+-- exporting the given real device. The fields in cfg are copied in it, and take
+-- precedence over the ones from the device.
+   cfg = cfg or {}
+   local poll_interval = cfg.poll_interval or 0.0005
+   local desc = device:get_device_descriptor()
+   local interfaces, eptype, itfs, config
+   local model, t -- defined below
+
+   local function claim_interfaces()
+   -- Claims all the interfaces of the active configuration, if any
+      interfaces, eptype, itfs = {}, {}, {}
+      local ok
+      ok, config = pcall(device.get_active_config_descriptor, device)
+      if not ok then config = nil; return end -- unconfigured
+      for _, itf in ipairs(config.interface) do
+         local alt = itf[1]
+         interfaces[alt.number] = devhandle:claim_interface(alt.number)
+         itfs[#itfs+1] = { class = alt.class, subclass = alt.subclass, protocol = alt.protocol }
+         for _, a in ipairs(itf) do
+            for _, ep in ipairs(a.endpoint) do eptype[ep.address] = ep.transfer_type end
+         end
+      end
+   end
+   claim_interfaces()
+
+   local function set_configuration(value)
+   -- libusb fails with 'busy' while interfaces are claimed, so these are released
+   -- and claimed again (those of the new configuration). Selecting the configuration
+   -- already active is a no-op, as the host does it routinely after enumeration.
+      local ok, active = pcall(devhandle.get_configuration, devhandle)
+      if ok and active == value then return true end
+      for _, itf in pairs(interfaces) do itf:release() end
+      ok = pcall(devhandle.set_configuration, devhandle, value)
+      claim_interfaces()
+      for ep in pairs(eptype) do t.endpoints[ep] = model end
+      return ok
+   end
+
+   -- Pool of transfer buffers, indexed by size (a power of 2)
+   local pool = {}
+   local function getmem(len)
+      local size = 64
+      while size < len do size = size*2 end
+      local list = pool[size]
+      if not list then list = {}; pool[size] = list end
+      return table.remove(list) or usb.malloc(devhandle, size), size
+   end
+   -- Released buffers go back to the pool only at the next submit, since a corked
+   -- response may still refer to them (submits are received only when uncorked).
+   local released = {}
+   local function putmem(mem, size) released[#released+1] = { mem, size } end
+   local function recycle()
+      for i, r in ipairs(released) do
+         table.insert(pool[r[2]], r[1])
+         released[i] = nil
+      end
+   end
+
+   local inflight = {} -- seqnum -> entry
+   local bytransfer = {} -- transfer -> entry
+
+   local function completed(transfer, status)
+      local e = bytransfer[transfer]
+      bytransfer[transfer] = nil
+      inflight[e.submit.seqnum] = nil
+      local submit, mem = e.submit, e.mem
+      if not e.unlinked then
+         local errno = ERRNO[STATUS[status]] or -71
+         local actual = transfer:get_actual_length()
+         if submit.number_of_packets > 0 then
+            local data, d = {}, {}
+            local descriptors = transfer:get_iso_packet_descriptors() or {}
+            local total = 0
+            for i = 1, submit.number_of_packets do
+               local req_offset, req_length = unpack(">I4I4", submit.iso_packet_descriptors, (i-1)*16+1)
+               local p = descriptors[i]
+               local len = p and p.length or 0
+               if submit.direction == 'in' and len > 0 then data[#data+1] = mem:read(p.offset, len) end
+               d[i] = pack(">I4I4I4i4", req_offset, req_length, len, p and ERRNO[STATUS[p.status]] or errno)
+               total = total + len
+            end
+            respond(submit, errno, 0, table.concat(data), total, table.concat(d))
+         elseif submit.direction == 'in' then
+            local data
+            if actual > 0 then
+               data = C_TRANSPORT and mem:ptr(e.offset, actual) or mem:read(e.offset, actual)
+            end
+            respond(submit, errno, 0, data, actual)
+         else
+            respond(submit, errno, 0, nil, actual)
+         end
+      end
+      putmem(mem, e.size)
+   end
+
+   local function standard_request(submit)
+   -- Handles the standard requests that must go through libusb rather than being
+   -- sent as is. Returns true if the request was handled.
+      local bmRequestType, bRequest, wValue, wIndex = unpack("<I1I1I2I2", submit.setup)
+      local ok
+      if bmRequestType == 0x00 and bRequest == 0x09 then -- SET_CONFIGURATION
+         ok = set_configuration(wValue)
+      elseif bmRequestType == 0x01 and bRequest == 0x0b and interfaces[wIndex] then -- SET_INTERFACE
+         ok = pcall(interfaces[wIndex].set_alt_setting, interfaces[wIndex], wValue)
+      elseif bmRequestType == 0x02 and bRequest == 0x01 and wValue == 0 then -- CLEAR_FEATURE(ENDPOINT_HALT)
+         ok = pcall(devhandle.clear_halt, devhandle, wIndex & 0xff)
+      else
+         return false
+      end
+      respond(submit, ok and 0 or -32, 0, nil, 0)
+      return true
+   end
+
+   model = {
+      submit = function(self, submit)
+         local len = submit.transfer_buffer_length
+         local ep = submit.ep | (submit.direction == 'in' and 0x80 or 0)
+         local e = { submit = submit, offset = 0 }
+         recycle()
+         local ok, transfer
+         if submit.ep == 0 then
+            if standard_request(submit) then return end
+            e.mem, e.size = getmem(8 + len)
+            e.offset = 8
+            e.mem:write(0, nil, submit.setup)
+            if submit.data then e.mem:write(8, nil, submit.data) end
+            ok, transfer = pcall(devhandle.submit_control_transfer, devhandle, e.mem:ptr(), 8 + len, 0, completed)
+         else
+            e.mem, e.size = getmem(len)
+            if submit.data then e.mem:write(0, nil, submit.data) end
+            if submit.number_of_packets > 0 then
+               -- The packets must be contiguous and fit in the transfer buffer
+               local n, lengths, total = submit.number_of_packets, {}, 0
+               ok = true
+               for i = 1, n do
+                  local offset, length = unpack(">I4I4", submit.iso_packet_descriptors, (i-1)*16+1)
+                  if offset ~= total or total + length > len then ok = false break end
+                  lengths[i] = length
+                  total = total + length
+               end
+               if ok then
+                  ok, transfer = pcall(devhandle.submit_iso_transfer, devhandle, ep, e.mem:ptr(), total, n, lengths, 0, completed)
+               end
+            elseif eptype[ep] == 'interrupt' then
+               ok, transfer = pcall(devhandle.submit_interrupt_transfer, devhandle, ep, e.mem:ptr(), len, 0, completed)
+            else
+               ok, transfer = pcall(devhandle.submit_bulk_transfer, devhandle, ep, e.mem:ptr(), len, 0, completed)
+            end
+         end
+         if not ok then
+            putmem(e.mem, e.size)
+            return respond_error(submit, -71) -- -EPROTO
+         end
+         e.transfer = transfer
+         inflight[submit.seqnum] = e
+         bytransfer[transfer] = e
+      end,
+      unlink = function(self, seqnum)
+         local e = inflight[seqnum]
+         if not e then return false end
+         -- The transfer is cancelled, and its completion will not be reported
+         e.unlinked = true
+         pcall(e.transfer.cancel, e.transfer)
+         return true
+      end,
+      busy = function(self) return next(inflight) ~= nil end,
+      poll = function(self, block)
+         if next(inflight) then context:handle_events(block and poll_interval or 0) end
+      end,
+      reset = function(self)
+         for seqnum in pairs(inflight) do self:unlink(seqnum) end
+         local deadline = now() + 1
+         while next(inflight) and now() < deadline do context:handle_events(0.01) end
+      end,
+   }
+
+   t = {
+      busnum = device:get_bus_number(),
+      devnum = device:get_address(),
+      vendor_id = desc.vendor_id,
+      product_id = desc.product_id,
+      release_number = desc.release_number,
+      device_class = desc.class,
+      device_subclass = desc.subclass,
+      device_protocol = desc.protocol,
+      num_configurations = desc.num_configurations,
+      configuration_value = config and config.value or 0,
+      speed = device:get_speed(),
+      interfaces = itfs,
+      endpoints = { [0x00] = model, [0x80] = model },
+   }
+   for ep in pairs(eptype) do t.endpoints[ep] = model end
+   for k, v in pairs(cfg) do
+      if k ~= 'poll_interval' then t[k] = v end
+   end
+   return t
+end
+
 local function receive_cmd()
 -- Receives a command (in attached state), and handles it to the user.
    local hdr = client:receive(48)
@@ -210,12 +808,18 @@ local function receive_cmd()
       submit.number_of_packets = unpack(">I4", hdr, 33)
       submit.interval = unpack(">I4", hdr, 37)
       submit.setup = unpack("c8", hdr, 41)
+      if submit.number_of_packets == 0xffffffff then submit.number_of_packets = 0 end
       local len = submit.transfer_buffer_length
       if submit.direction == 'out' and len > 0 then
          submit.data = client:receive(len)
          if not submit.data then return false end
       end
-      RECEIVE_SUBMIT(submit)
+      if submit.number_of_packets > 0 then -- iso packet descriptors
+         submit.iso_packet_descriptors = client:receive(16*submit.number_of_packets)
+         if not submit.iso_packet_descriptors then return false end
+      end
+      local model = ENDPOINTS[submit.ep | (submit.direction == 'in' and 0x80 or 0)]
+      if model then model:submit(submit) else RECEIVE_SUBMIT(submit) end
       return true
    elseif cmd == USBIP_CMD_UNLINK then
       local unlink = {}
@@ -224,7 +828,17 @@ local function receive_cmd()
       unlink.direction = USB_DIR[unpack(">I4", hdr, 13)]
       unlink.ep = unpack(">I4", hdr, 17)
       unlink.victim_seqnum = unpack(">I4", hdr, 21)
-      RECEIVE_UNLINK(unlink)
+      for _, model in pairs(ENDPOINTS) do
+         if model:unlink(unlink.victim_seqnum) then
+            send_unlink_response(unlink, -104) -- -ECONNRESET
+            return true
+         end
+      end
+      if RECEIVE_UNLINK then
+         RECEIVE_UNLINK(unlink)
+      else -- the victim has already been completed
+         send_unlink_response(unlink, 0)
+      end
       return true
    else
       printf("received unknown cmd=0x%.8x\n", cmd)
@@ -271,6 +885,14 @@ local function start(cfg)
    DETACHED = cfg.detached or function() end
    RECEIVE_SUBMIT = cfg.receive_submit
    RECEIVE_UNLINK = cfg.receive_unlink
+   ENDPOINTS = cfg.endpoints or {}
+   POLLED = {}
+   for _, model in pairs(ENDPOINTS) do
+      if model.poll and not POLLED[model] then
+         POLLED[model] = true
+         POLLED[#POLLED+1] = model
+      end
+   end
    DEVID = (BUSNUM << 16 | DEVNUM) -- see usbip_common.h in the Linux kernel
    BUSID = pack("c32", BUSNUM.."-"..DEVNUM)
    -- Create server socket and start listening for client connections
@@ -279,6 +901,8 @@ local function start(cfg)
    assert(server:setoption('reuseaddr', true))
    while true do
       client = assert(server:accept())
+      client:setoption('tcp-nodelay', true)
+      client_fd = client:getfd()
       local ip, port = client:getpeername()
       printf("client %s:%d connected\n", ip, port)
       local attached = receive_op()
@@ -287,11 +911,31 @@ local function start(cfg)
          ATTACHED() -- notify the user
          local recvt, r = { client }, nil
          while true do
+            -- responses due to timers and models are corked, and sent together
+            cork()
             if has_timers then timers.trigger() end
-            r = socket.select(recvt, nil, 0)
-            if r and r[client] then 
+            local timeout = has_timers and 0 or nil
+            local due = run_scheduled()
+            uncork()
+            if due then
+               local dt = math.max(0, due - now())
+               timeout = timeout and math.min(timeout, dt) or dt
+            end
+            for _, model in ipairs(POLLED) do
+               if model:busy() then timeout = 0 end
+            end
+            r = socket.select(recvt, nil, timeout)
+            local readable = r and r[client]
+            if readable then 
                if not receive_cmd() then break end
             end
+            cork()
+            for _, model in ipairs(POLLED) do model:poll(not readable) end
+            uncork()
+         end
+         Scheduled = {}
+         for _, model in pairs(ENDPOINTS) do
+            if model.reset then model:reset() end
          end
          printf("device detached\n")
          DETACHED() -- notify the user
@@ -306,5 +950,13 @@ return {
    start = start,
    send_submit_response = send_submit_response,
    send_unlink_response = send_unlink_response,
+   -- device models
+   source = source,
+   sink = sink,
+   loopback = loopback,
+   interrupt = interrupt,
+   iso = iso,
+   replay = replay,
+   export = export,
 }
 
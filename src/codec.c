@@ -0,0 +1,319 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2021 Stefano Trettel
+ *
+ * Software repository: MoonUSB, https://github.com/stetre/moonusb
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "internal.h"
+
+/* A codec is compiled from a list of field specifications:
+ *
+ * codec = usb.codec({ {name, spec [, bits=true]}, ... })
+ *
+ * where name is a string (or false, for padding), and spec is either a type
+ * ('char', 'ushort', ...), or a string in the form [iuf]N[le|be] (e.g. 'i16le',
+ * 'u32be', 'f32'). With bits=true, spec must be uN or iN, with N=1..64, and the
+ * field is a bitfield. Bitfields are packed LSB-first, one after the other, while
+ * any other field starts at the next byte boundary.
+ */
+
+typedef moonusb_codecfield_t field_t;
+
+static int freecodec(lua_State *L, ud_t *ud)
+    {
+    codec_t *codec = (codec_t*)ud->handle;
+    if(!freeuserdata(L, ud, "codec")) return 0;
+    Free(L, codec->field);
+    Free(L, codec);
+    return 0;
+    }
+
+static int ParseSpec(const char *spec, int bits, field_t *field)
+/* Returns 0 on success, ERR_VALUE if the spec is invalid */
+    {
+    char kind = spec[0];
+    char *end;
+    unsigned long n;
+    int endianness = MOONUSB_ENDIANNESS_NATIVE;
+    if(kind != 'i' && kind != 'u' && kind != 'f')
+        return ERR_VALUE;
+    n = strtoul(spec+1, &end, 10);
+    if(end == spec+1)
+        return ERR_VALUE;
+    if(strcmp(end, "le") == 0) endianness = MOONUSB_ENDIANNESS_LITTLE;
+    else if(strcmp(end, "be") == 0) endianness = MOONUSB_ENDIANNESS_BIG;
+    else if(*end != '\0') return ERR_VALUE;
+    if(bits)
+        {
+        if(kind == 'f' || n < 1 || n > 64 || endianness != MOONUSB_ENDIANNESS_NATIVE)
+            return ERR_VALUE;
+        field->issigned = (kind == 'i');
+        field->nbits = n;
+        return 0;
+        }
+    field->swap = needswap(endianness);
+#define T(k, nn, t) if(kind == (k) && n == (nn)) { field->type = MOONUSB_TYPE_##t; return 0; }
+    T('i', 8, CHAR) T('u', 8, UCHAR) T('i', 16, SHORT) T('u', 16, USHORT)
+    T('i', 32, INT) T('u', 32, UINT) T('i', 64, LONG) T('u', 64, ULONG)
+    T('f', 32, FLOAT) T('f', 64, DOUBLE)
+#undef T
+    return ERR_VALUE;
+    }
+
+static int Create(lua_State *L)
+    {
+    int err, bits, i, nfields, names;
+    size_t pos = 0; /* in bits */
+    ud_t *ud;
+    codec_t *codec;
+    field_t *field;
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+    nfields = luaL_len(L, 1);
+    if(nfields == 0)
+        return argerror(L, 1, ERR_EMPTY);
+    field = (field_t*)MallocNoErr(L, nfields*sizeof(field_t));
+    if(!field)
+        return errmemory(L);
+    memset(field, 0, nfields*sizeof(field_t));
+    lua_newtable(L); /* names */
+    names = lua_gettop(L);
+    for(i = 0; i < nfields; i++)
+        {
+        if(lua_geti(L, 1, i+1) != LUA_TTABLE)
+            { Free(L, field); return argerror(L, 1, ERR_TABLE); }
+        /* name */
+        lua_geti(L, -1, 1);
+        if(lua_type(L, -1) == LUA_TSTRING)
+            lua_rawseti(L, names, i+1);
+        else if(lua_isnoneornil(L, -1) || (lua_type(L, -1) == LUA_TBOOLEAN && !lua_toboolean(L, -1)))
+            {
+            lua_pop(L, 1);
+            lua_pushboolean(L, 0);
+            lua_rawseti(L, names, i+1);
+            field[i].skip = 1;
+            }
+        else
+            { Free(L, field); return luaL_error(L, "field %d: invalid name", i+1); }
+        /* bits */
+        lua_getfield(L, -1, "bits");
+        bits = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+        /* spec */
+        lua_geti(L, -1, 2);
+        err = ERR_VALUE;
+        if(lua_type(L, -1) == LUA_TSTRING)
+            {
+            err = ParseSpec(lua_tostring(L, -1), bits, &field[i]);
+            if(err && !bits)
+                {
+                field[i].type = testtype(L, -1, &err);
+                field[i].swap = 0;
+                }
+            }
+        lua_pop(L, 2);
+        if(err)
+            { Free(L, field); return luaL_error(L, "field %d: invalid spec", i+1); }
+        /* layout */
+        if(bits)
+            {
+            field[i].offset = pos;
+            pos += field[i].nbits;
+            }
+        else
+            {
+            pos = (pos + 7) & ~(size_t)7;
+            field[i].offset = pos/8;
+            pos += 8*sizeoftype(field[i].type);
+            }
+        }
+    codec = (codec_t*)MallocNoErr(L, sizeof(codec_t));
+    if(!codec)
+        { Free(L, field); return errmemory(L); }
+    codec->size = (pos + 7)/8;
+    codec->nfields = nfields;
+    codec->field = field;
+    ud = newuserdata(L, codec, CODEC_MT, "codec");
+    ud->parent_ud = NULL;
+    ud->destructor = freecodec;
+    lua_pushvalue(L, names);
+    ud->ref1 = luaL_ref(L, LUA_REGISTRYINDEX);
+    return 1;
+    }
+
+static const unsigned char *CheckSrc(lua_State *L, int arg, size_t offset, size_t size)
+/* Checks that the hostmem or binary string at arg contains size bytes starting
+ * from offset, and returns a pointer to them.
+ */
+    {
+    size_t len;
+    const unsigned char *ptr;
+    hostmem_t *hostmem;
+    if(lua_type(L, arg) == LUA_TSTRING)
+        ptr = (const unsigned char*)lua_tolstring(L, arg, &len);
+    else
+        {
+        hostmem = checkhostmem(L, arg, NULL);
+        ptr = hostmem->ptr;
+        len = hostmem->size;
+        }
+    if(offset > len || size > len - offset)
+        { luaL_error(L, errstring(ERR_BOUNDARIES)); return NULL; }
+    return ptr + offset;
+    }
+
+static int Decode(lua_State *L)
+/* dst = codec:decode(data, [offset], [dst]) */
+    {
+    int i, names;
+    uint64_t val;
+    ud_t *ud;
+    field_t *field;
+    codec_t *codec = checkcodec(L, 1, &ud);
+    size_t offset = luaL_optinteger(L, 3, 0);
+    const unsigned char *ptr = CheckSrc(L, 2, offset, codec->size);
+    if(lua_isnoneornil(L, 4))
+        lua_createtable(L, 0, codec->nfields);
+    else
+        {
+        luaL_checktype(L, 4, LUA_TTABLE);
+        lua_pushvalue(L, 4);
+        }
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ud->ref1);
+    names = lua_gettop(L);
+    for(i = 0; i < codec->nfields; i++)
+        {
+        field = &codec->field[i];
+        if(field->skip) continue;
+        lua_rawgeti(L, names, i+1);
+        if(field->type != 0)
+            pushelem(L, field->type, ptr + field->offset, field->swap);
+        else
+            {
+            val = getbits(ptr, field->offset, field->nbits);
+            if(field->issigned && field->nbits < 64 && (val & ((uint64_t)1 << (field->nbits-1))))
+                val |= ~(uint64_t)0 << field->nbits; /* sign extension */
+            lua_pushinteger(L, (lua_Integer)val);
+            }
+        lua_rawset(L, -4);
+        }
+    lua_pop(L, 1);
+    return 1;
+    }
+
+static int Encode(lua_State *L)
+/* codec:encode(src, hostmem, [offset])
+ * data = codec:encode(src)
+ */
+    {
+    int i, names, isnum;
+    lua_Integer val;
+    ud_t *ud;
+    field_t *field;
+    hostmem_t *hostmem = NULL;
+    unsigned char *ptr;
+    codec_t *codec = checkcodec(L, 1, &ud);
+    size_t offset = luaL_optinteger(L, 4, 0);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    if(lua_isnoneornil(L, 3))
+        {
+        ptr = (unsigned char*)Malloc(L, codec->size);
+        memset(ptr, 0, codec->size);
+        }
+    else
+        {
+        hostmem = checkhostmem(L, 3, NULL);
+        if(offset > hostmem->size || codec->size > hostmem->size - offset)
+            return luaL_error(L, errstring(ERR_BOUNDARIES));
+        ptr = hostmem->ptr + offset;
+        }
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ud->ref1);
+    names = lua_gettop(L);
+    for(i = 0; i < codec->nfields; i++)
+        {
+        field = &codec->field[i];
+        if(field->skip) continue;
+        lua_rawgeti(L, names, i+1);
+        lua_pushvalue(L, -1);
+        lua_rawget(L, 2);
+        if(field->type != 0)
+            {
+            if(toelem(L, -1, field->type, ptr + field->offset, field->swap) != 0)
+                goto fail;
+            }
+        else
+            {
+            val = lua_tointegerx(L, -1, &isnum);
+            if(!isnum)
+                goto fail;
+            setbits(ptr, field->offset, field->nbits, (uint64_t)val);
+            }
+        lua_pop(L, 2);
+        }
+    lua_pop(L, 1);
+    if(hostmem)
+        return 0;
+    lua_pushlstring(L, (char*)ptr, codec->size);
+    Free(L, ptr);
+    return 1;
+fail:
+    if(!hostmem) Free(L, ptr);
+    return luaL_error(L, "field '%s': %s", lua_tostring(L, -2),
+        errstring(lua_isnil(L, -1) ? ERR_NOTPRESENT : ERR_TYPE));
+    }
+
+static int Size(lua_State *L)
+    {
+    codec_t *codec = checkcodec(L, 1, NULL);
+    lua_pushinteger(L, codec->size);
+    return 1;
+    }
+
+DESTROY_FUNC(codec)
+
+static const struct luaL_Reg Methods[] = 
+    {
+        { "free", Destroy },
+        { "decode", Decode },
+        { "encode", Encode },
+        { "size", Size },
+        { NULL, NULL } /* sentinel */
+    };
+
+static const struct luaL_Reg MetaMethods[] = 
+    {
+        { "__gc",  Destroy },
+        { NULL, NULL } /* sentinel */
+    };
+
+static const struct luaL_Reg Functions[] = 
+    {
+        { "codec", Create },
+        { NULL, NULL } /* sentinel */
+    };
+
+void moonusb_open_codec(lua_State *L)
+    {
+    udata_define(L, CODEC_MT, Methods, MetaMethods);
+    luaL_setfuncs(L, Functions, 0);
+    }
+
@@ -0,0 +1,377 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2021 Stefano Trettel
+ *
+ * Software repository: MoonUSB, https://github.com/stetre/moonusb
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "internal.h"
+
+/* Lazy configuration descriptor.
+ * A config object keeps the libusb_config_descriptor and pushes only the fields
+ * that are accessed, instead of building the whole nested table at once.
+ * Config objects are cached per device (in a table referenced by the device's ref1),
+ * so that subsequent requests for the same configuration return the same object.
+ * The cache is invalidated when the configuration is changed or the device is reset.
+ * The cfg.interface table is built on first access and kept by the config object
+ * (in its ref1), so it goes away together with the object when the cache is invalidated.
+ */
+
+#define KEY_ACTIVE 0
+#define KEY_INDEX(index) ((index)+1) /* 1 .. 256 */
+#define KEY_VALUE(value) (-(value)-1) /* -1 .. -256 */
+
+static int freeconfig(lua_State *L, ud_t *ud)
+    {
+    config_t *config = (config_t*)ud->handle;
+    if(!freeuserdata(L, ud, "config")) return 0;
+    libusb_free_config_descriptor(config);
+    return 0;
+    }
+
+static int newconfig(lua_State *L, ud_t *device_ud, config_t *config)
+    {
+    ud_t *ud;
+    ud = newuserdata(L, config, CONFIG_MT, "config");
+    ud->parent_ud = device_ud;
+    ud->context = device_ud->context;
+    ud->destructor = freeconfig;
+    ud->ref1 = LUA_NOREF; /* cfg.interface table, built on first access */
+    return 1;
+    }
+
+static int GetCached(lua_State *L, ud_t *device_ud, int key)
+/* If found, pushes the cached config object and returns 1, otherwise returns 0 */
+    {
+    if(device_ud->ref1 == LUA_NOREF) return 0;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, device_ud->ref1);
+    lua_rawgeti(L, -1, key);
+    if(testconfig(L, -1, NULL)) /* still valid */
+        { lua_remove(L, -2); return 1; }
+    lua_pop(L, 2);
+    return 0;
+    }
+
+static void SetCached(lua_State *L, ud_t *device_ud, int key)
+/* Caches the config object on top of the stack (leaving it there) */
+    {
+    if(device_ud->ref1 == LUA_NOREF)
+        {
+        lua_newtable(L);
+        device_ud->ref1 = luaL_ref(L, LUA_REGISTRYINDEX);
+        }
+    lua_rawgeti(L, LUA_REGISTRYINDEX, device_ud->ref1);
+    lua_pushvalue(L, -2);
+    lua_rawseti(L, -2, key);
+    lua_pop(L, 1);
+    }
+
+void invalidateconfigcache(lua_State *L, ud_t *device_ud)
+/* Drops the cached config objects. Objects already retrieved by the script are
+ * not deleted, but subsequent requests will get fresh ones. */
+    {
+    Unreference(L, device_ud->ref1);
+    }
+
+int pushactiveconfig(lua_State *L, device_t *device, ud_t *device_ud)
+/* Pushes the active config object and returns 0, or returns a libusb error
+ * code (pushing nothing) */
+    {
+    config_t *config;
+    int ec;
+    if(GetCached(L, device_ud, KEY_ACTIVE)) return 0;
+    ec = libusb_get_active_config_descriptor(device, &config);
+    if(ec) return ec;
+    newconfig(L, device_ud, config);
+    SetCached(L, device_ud, KEY_ACTIVE);
+    return 0;
+    }
+
+static int GetActiveConfig(lua_State *L)
+    {
+    ud_t *ud;
+    device_t *device = checkdevice(L, 1, &ud);
+    int ec = pushactiveconfig(L, device, ud);
+    CheckError(L, ec);
+    return 1;
+    }
+
+static int GetConfig(lua_State *L)
+    {
+    ud_t *ud;
+    config_t *config;
+    device_t *device = checkdevice(L, 1, &ud);
+    lua_Integer index = luaL_checkinteger(L, 2);
+    int ec;
+    if(index < 0 || index > 255) return argerror(L, 2, ERR_RANGE);
+    if(GetCached(L, ud, KEY_INDEX(index))) return 1;
+    ec = libusb_get_config_descriptor(device, index, &config);
+    CheckError(L, ec);
+    newconfig(L, ud, config);
+    SetCached(L, ud, KEY_INDEX(index));
+    return 1;
+    }
+
+static int GetConfigByValue(lua_State *L)
+    {
+    ud_t *ud;
+    config_t *config;
+    device_t *device = checkdevice(L, 1, &ud);
+    lua_Integer value = luaL_checkinteger(L, 2);
+    int ec;
+    if(value < 0 || value > 255) return argerror(L, 2, ERR_RANGE);
+    if(GetCached(L, ud, KEY_VALUE(value))) return 1;
+    ec = libusb_get_config_descriptor_by_value(device, value, &config);
+    CheckError(L, ec);
+    newconfig(L, ud, config);
+    SetCached(L, ud, KEY_VALUE(value));
+    return 1;
+    }
+
+/*------------------------------------------------------------------------------*
+ | Accessors                                                                    |
+ *------------------------------------------------------------------------------*/
+
+/* Interfaces, alternate settings and endpoints are numbered from 1, as in the 
+ * tables returned by get_config_descriptor(), so that cfg:endpoint(i, a, e) is
+ * the same as cfg.interface[i][a].endpoint[e].
+ */
+
+static const struct libusb_interface_descriptor *CheckAltsetting(lua_State *L, config_t *config, int arg)
+    {
+    const struct libusb_interface *interface;
+    lua_Integer i = luaL_checkinteger(L, arg);
+    lua_Integer a = luaL_optinteger(L, arg+1, 1);
+    if(i < 1 || i > config->bNumInterfaces)
+        { argerror(L, arg, ERR_RANGE); return NULL; }
+    interface = &config->interface[i-1];
+    if(a < 1 || a > interface->num_altsetting)
+        { argerror(L, arg+1, ERR_RANGE); return NULL; }
+    return &interface->altsetting[a-1];
+    }
+
+static const struct libusb_endpoint_descriptor *CheckEndpoint(lua_State *L, config_t *config, int arg)
+    {
+    const struct libusb_interface_descriptor *alt = CheckAltsetting(L, config, arg);
+    lua_Integer e = luaL_checkinteger(L, arg+2);
+    if(e < 1 || e > alt->bNumEndpoints)
+        { argerror(L, arg+2, ERR_RANGE); return NULL; }
+    return &alt->endpoint[e-1];
+    }
+
+static int NumAltsettings(lua_State *L)
+    {
+    config_t *config = checkconfig(L, 1, NULL);
+    lua_Integer i = luaL_checkinteger(L, 2);
+    if(i < 1 || i > config->bNumInterfaces)
+        return argerror(L, 2, ERR_RANGE);
+    lua_pushinteger(L, config->interface[i-1].num_altsetting);
+    return 1;
+    }
+
+static int NumEndpoints(lua_State *L)
+    {
+    config_t *config = checkconfig(L, 1, NULL);
+    const struct libusb_interface_descriptor *alt = CheckAltsetting(L, config, 2);
+    lua_pushinteger(L, alt->bNumEndpoints);
+    return 1;
+    }
+
+static int Altsetting(lua_State *L)
+/* interfacedescriptor = cfg:altsetting(i, [a=1]) */
+    {
+    ud_t *ud;
+    config_t *config = checkconfig(L, 1, &ud);
+    const struct libusb_interface_descriptor *alt = CheckAltsetting(L, config, 2);
+    pushinterfacedescriptor(L, alt, ud->context);
+    return 1;
+    }
+
+static int Endpoint(lua_State *L)
+/* endpointdescriptor = cfg:endpoint(i, a, e) */
+    {
+    ud_t *ud;
+    config_t *config = checkconfig(L, 1, &ud);
+    const struct libusb_endpoint_descriptor *ep = CheckEndpoint(L, config, 2);
+    pushendpointdescriptor(L, ep, ud->context);
+    return 1;
+    }
+
+static int EndpointInfo(lua_State *L)
+/* address, transfer_type, max_packet_size, interval = cfg:endpoint_info(i, a, e) 
+ * (same as endpoint(), but without creating a table)
+ */
+    {
+    config_t *config = checkconfig(L, 1, NULL);
+    const struct libusb_endpoint_descriptor *ep = CheckEndpoint(L, config, 2);
+    lua_pushinteger(L, ep->bEndpointAddress);
+    pushtransfertype(L, ep->bmAttributes & 0x03);
+    lua_pushinteger(L, ep->wMaxPacketSize);
+    lua_pushinteger(L, ep->bInterval);
+    return 4;
+    }
+
+static int FindEndpoint(lua_State *L)
+/* i, a, e = cfg:find_endpoint(address) */
+    {
+    int i, a, e;
+    const struct libusb_interface *interface;
+    const struct libusb_interface_descriptor *alt;
+    config_t *config = checkconfig(L, 1, NULL);
+    lua_Integer address = luaL_checkinteger(L, 2);
+    for(i = 0; i < config->bNumInterfaces; i++)
+        {
+        interface = &config->interface[i];
+        for(a = 0; a < interface->num_altsetting; a++)
+            {
+            alt = &interface->altsetting[a];
+            for(e = 0; e < alt->bNumEndpoints; e++)
+                {
+                if(alt->endpoint[e].bEndpointAddress != address) continue;
+                lua_pushinteger(L, i+1);
+                lua_pushinteger(L, a+1);
+                lua_pushinteger(L, e+1);
+                return 3;
+                }
+            }
+        }
+    lua_pushnil(L);
+    return 1;
+    }
+
+static int Table(lua_State *L)
+/* configdescriptor = cfg:table() */
+    {
+    ud_t *ud;
+    config_t *config = checkconfig(L, 1, &ud);
+    pushconfigdescriptor(L, config, ud->context);
+    return 1;
+    }
+
+static int PushField(lua_State *L, config_t *config, ud_t *ud, const char *key)
+/* Pushes the field of the config descriptor table with the given name, if any */
+    {
+    unsigned int i;
+    int j;
+    if(strcmp(key, "num_interfaces") == 0)
+        lua_pushinteger(L, config->bNumInterfaces);
+    else if(strcmp(key, "value") == 0)
+        lua_pushinteger(L, config->bConfigurationValue);
+    else if(strcmp(key, "index") == 0)
+        lua_pushinteger(L, config->iConfiguration);
+    else if(strcmp(key, "self_powered") == 0)
+        lua_pushboolean(L, config->bmAttributes & 0x40);
+    else if(strcmp(key, "remote_wakeup") == 0)
+        lua_pushboolean(L, config->bmAttributes & 0x20);
+    else if(strcmp(key, "max_power") == 0)
+        lua_pushinteger(L, config->MaxPower);
+    else if(strcmp(key, "extra") == 0)
+        {
+        if(config->extra && config->extra_length > 0)
+            lua_pushlstring(L, (char*)config->extra, config->extra_length);
+        else
+            lua_pushnil(L);
+        }
+    else if(strcmp(key, "interface") == 0)
+        {
+        if(ud->ref1 != LUA_NOREF) /* already built */
+            {
+            lua_rawgeti(L, LUA_REGISTRYINDEX, ud->ref1);
+            return 1;
+            }
+        lua_newtable(L);
+        for(i = 0; i < config->bNumInterfaces; i++)
+            {
+            lua_newtable(L);
+            for(j = 0; j < config->interface[i].num_altsetting; j++)
+                {
+                pushinterfacedescriptor(L, &config->interface[i].altsetting[j], ud->context);
+                lua_rawseti(L, -2, j+1);
+                }
+            lua_rawseti(L, -2, i+1);
+            }
+        lua_pushvalue(L, -1);
+        ud->ref1 = luaL_ref(L, LUA_REGISTRYINDEX);
+        }
+    else
+        return 0;
+    return 1;
+    }
+
+static int Index(lua_State *L)
+/* cfg.field, or method lookup */
+    {
+    ud_t *ud;
+    config_t *config = checkconfig(L, 1, &ud);
+    lua_pushvalue(L, 2);
+    lua_rawget(L, lua_upvalueindex(1)); /* methods */
+    if(!lua_isnil(L, -1) || lua_type(L, 2) != LUA_TSTRING)
+        return 1;
+    lua_pop(L, 1);
+    if(!PushField(L, config, ud, lua_tostring(L, 2)))
+        lua_pushnil(L);
+    return 1;
+    }
+
+DESTROY_FUNC(config)
+PARENT_FUNC(config)
+
+static const struct luaL_Reg Methods[] = 
+    {
+        { "free", Destroy },
+        { "device", Parent },
+        { "num_altsettings", NumAltsettings },
+        { "num_endpoints", NumEndpoints },
+        { "altsetting", Altsetting },
+        { "endpoint", Endpoint },
+        { "endpoint_info", EndpointInfo },
+        { "find_endpoint", FindEndpoint },
+        { "table", Table },
+        { NULL, NULL } /* sentinel */
+    };
+
+static const struct luaL_Reg MetaMethods[] = 
+    {
+        { "__gc",  Destroy },
+        { NULL, NULL } /* sentinel */
+    };
+
+static const struct luaL_Reg DeviceMethods[] = 
+    {
+        { "get_active_config", GetActiveConfig },
+        { "get_config", GetConfig },
+        { "get_config_by_value", GetConfigByValue },
+        { NULL, NULL } /* sentinel */
+    };
+
+void moonusb_open_config(lua_State *L)
+    {
+    udata_define(L, CONFIG_MT, Methods, MetaMethods);
+    /* Replace the __index table with a function that materializes the fields
+     * on access, and falls back to the methods table for the others */
+    luaL_getmetatable(L, CONFIG_MT);
+    lua_pushvalue(L, -1);
+    lua_pushcclosure(L, Index, 1);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+    udata_addmethods(L, DEVICE_MT, DeviceMethods);
+    }
+
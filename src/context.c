@@ -29,6 +29,7 @@ static int freecontext(lua_State *L, ud_t *ud)
     {
     context_t *context = (context_t*)ud->handle;
     freechildren(L, HOTPLUG_MT, ud);
+    freechildren(L, INVENTORY_MT, ud);
     freechildren(L, DEVICE_MT, ud);
     if(!freeuserdata(L, ud, "context")) return 0;
     libusb_exit(context);
@@ -154,6 +155,257 @@ static int Open_device(lua_State *L)
     return 2; // device, devhandle
     }
 
+/*------------------------------------------------------------------------------*
+ | Device lookup                                                                |
+ *------------------------------------------------------------------------------*/
+
+#define MAX_PORTS 8 /* USB 3.0 limits the depth to 7 */
+
+typedef struct {
+    int vid, pid, class, bus, address; /* -1 = any */
+    int nports; /* -1 = any */
+    uint8_t ports[MAX_PORTS];
+    int open;
+} filter_t;
+
+static int OptField(lua_State *L, int arg, const char *name, int maxval)
+    {
+    lua_Integer val;
+    int isnum;
+    if(lua_getfield(L, arg, name) == LUA_TNIL)
+        { lua_pop(L, 1); return -1; }
+    val = lua_tointegerx(L, -1, &isnum);
+    lua_pop(L, 1);
+    if(!isnum) return luaL_error(L, "%s: %s", name, errstring(ERR_TYPE));
+    if(val < 0 || val > maxval) return luaL_error(L, "%s: %s", name, errstring(ERR_RANGE));
+    return (int)val;
+    }
+
+static int CheckFilter(lua_State *L, int arg, filter_t *filter)
+    {
+    int i;
+    filter->nports = -1;
+    filter->open = 0;
+    if(lua_isnoneornil(L, arg))
+        {
+        filter->vid = filter->pid = filter->class = filter->bus = filter->address = -1;
+        return 0;
+        }
+    luaL_checktype(L, arg, LUA_TTABLE);
+    filter->vid = OptField(L, arg, "vid", 0xffff);
+    filter->pid = OptField(L, arg, "pid", 0xffff);
+    filter->class = OptField(L, arg, "class", 0xff);
+    filter->bus = OptField(L, arg, "bus", 0xff);
+    filter->address = OptField(L, arg, "address", 0xff);
+    lua_getfield(L, arg, "open");
+    filter->open = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+    if(lua_getfield(L, arg, "port_path") != LUA_TNIL)
+        {
+        if(!lua_istable(L, -1))
+            return luaL_error(L, "port_path: %s", errstring(ERR_TABLE));
+        filter->nports = luaL_len(L, -1);
+        if(filter->nports > MAX_PORTS)
+            return luaL_error(L, "port_path: %s", errstring(ERR_LENGTH));
+        for(i = 0; i < filter->nports; i++)
+            {
+            lua_rawgeti(L, -1, i+1);
+            filter->ports[i] = luaL_checkinteger(L, -1);
+            lua_pop(L, 1);
+            }
+        }
+    lua_pop(L, 1);
+    return 0;
+    }
+
+static int Match(device_t *device, filter_t *filter)
+/* Checks the cheapest criteria first */
+    {
+    int n;
+    uint8_t ports[MAX_PORTS];
+    struct libusb_device_descriptor desc;
+    if(filter->bus >= 0 && libusb_get_bus_number(device) != filter->bus) return 0;
+    if(filter->address >= 0 && libusb_get_device_address(device) != filter->address) return 0;
+    if(filter->nports >= 0)
+        {
+        n = libusb_get_port_numbers(device, ports, MAX_PORTS);
+        if(n != filter->nports) return 0;
+        if(memcmp(ports, filter->ports, n) != 0) return 0;
+        }
+    if(filter->vid >= 0 || filter->pid >= 0 || filter->class >= 0)
+        {
+        if(libusb_get_device_descriptor(device, &desc) != 0) return 0;
+        if(filter->vid >= 0 && desc.idVendor != filter->vid) return 0;
+        if(filter->pid >= 0 && desc.idProduct != filter->pid) return 0;
+        if(filter->class >= 0 && desc.bDeviceClass != filter->class) return 0;
+        }
+    return 1;
+    }
+
+static int Find_devices(lua_State *L)
+/* devices, [devhandles] = context:find_devices([filter])
+ * Only the matching devices are given userdata (and are opened, if filter.open=true).
+ */
+    {
+    int ec, count = 0;
+    filter_t filter;
+    device_t **list, *device;
+    devhandle_t *devhandle;
+    context_t *context = checkcontext(L, 1, NULL);
+    ssize_t i, n;
+    CheckFilter(L, 2, &filter);
+    n = libusb_get_device_list(context, &list);
+    if(n < 0) CheckError(L, n);
+    lua_newtable(L);
+    if(filter.open) lua_newtable(L);
+    for(i=0; i<n; i++)
+        {
+        device = list[i];
+        if(!Match(device, &filter)) continue;
+        if(filter.open)
+            {
+            ec = libusb_open(device, &devhandle);
+            if(ec != 0) continue; /* skip devices that can't be opened */
+            }
+        count++;
+        getdevice(L, context, device);
+        lua_rawseti(L, filter.open ? -3 : -2, count);
+        if(filter.open)
+            {
+            newdevhandle(L, device, devhandle);
+            lua_rawseti(L, -2, count);
+            }
+        }
+    /* Matching devices have been referenced by newdevice(), so we can release
+     * the references held by the list */
+    libusb_free_device_list(list, 1);
+    return filter.open ? 2 : 1;
+    }
+
+/*------------------------------------------------------------------------------*
+ | Snapshot                                                                     |
+ *------------------------------------------------------------------------------*/
+
+/* Packed snapshot layout: n-element columns, with the 16-bit ones first
+ * so that they are aligned if the offset is even. */
+#define SNAPSHOT_BYTES_PER_DEVICE (2+2+1+1+1+1+1+1+1+7)
+
+static void SetColumn(lua_State *L, const char *name, size_t offset)
+    {
+    lua_pushinteger(L, offset);
+    lua_setfield(L, -2, name);
+    }
+
+static int PackSnapshot(lua_State *L, devinfo_t *info, size_t n, int arg)
+/* columns, n = context:snapshot(hostmem, [offset]) */
+    {
+    size_t i, j, size;
+    uint16_t *vid, *pid;
+    uint8_t *class, *subclass, *protocol, *bus, *address, *speed, *nports, *ports;
+    hostmem_t *hostmem = checkhostmem(L, arg, NULL);
+    size_t offset = luaL_optinteger(L, arg+1, 0);
+    size = n*SNAPSHOT_BYTES_PER_DEVICE;
+    if(offset > hostmem->size || size > hostmem->size - offset)
+        { lua_pushnil(L); lua_pushinteger(L, size); return 2; }
+    vid = (uint16_t*)(hostmem->ptr + offset);
+    pid = vid + n;
+    class = (uint8_t*)(pid + n);
+    subclass = class + n;
+    protocol = subclass + n;
+    bus = protocol + n;
+    address = bus + n;
+    speed = address + n;
+    nports = speed + n;
+    ports = nports + n;
+    for(i = 0; i < n; i++)
+        {
+        vid[i] = info[i].desc.idVendor;
+        pid[i] = info[i].desc.idProduct;
+        class[i] = info[i].desc.bDeviceClass;
+        subclass[i] = info[i].desc.bDeviceSubClass;
+        protocol[i] = info[i].desc.bDeviceProtocol;
+        bus[i] = info[i].bus;
+        address[i] = info[i].address;
+        speed[i] = info[i].speed;
+        nports[i] = info[i].nports;
+        for(j = 0; j < 7; j++) ports[7*i+j] = info[i].ports[j];
+        }
+    lua_newtable(L);
+    SetColumn(L, "vendor_id", (unsigned char*)vid - hostmem->ptr);
+    SetColumn(L, "product_id", (unsigned char*)pid - hostmem->ptr);
+    SetColumn(L, "class", class - hostmem->ptr);
+    SetColumn(L, "subclass", subclass - hostmem->ptr);
+    SetColumn(L, "protocol", protocol - hostmem->ptr);
+    SetColumn(L, "bus_number", bus - hostmem->ptr);
+    SetColumn(L, "device_address", address - hostmem->ptr);
+    SetColumn(L, "speed", speed - hostmem->ptr);
+    SetColumn(L, "num_ports", nports - hostmem->ptr);
+    SetColumn(L, "port_numbers", ports - hostmem->ptr);
+    lua_pushinteger(L, n);
+    return 2;
+    }
+
+#define COLUMN(name, expr) do {                 \
+    lua_createtable(L, n, 0);                   \
+    for(i = 0; i < n; i++)                      \
+        {                                       \
+        lua_pushinteger(L, (expr));             \
+        lua_rawseti(L, -2, i+1);                \
+        }                                       \
+    lua_setfield(L, -2, name);                  \
+} while(0)
+
+static int PushSnapshot(lua_State *L, devinfo_t *info, size_t n)
+/* columns, n = context:snapshot() */
+    {
+    size_t i, j, len;
+    char path[7*4];
+    lua_newtable(L);
+    COLUMN("vendor_id", info[i].desc.idVendor);
+    COLUMN("product_id", info[i].desc.idProduct);
+    COLUMN("class", info[i].desc.bDeviceClass);
+    COLUMN("subclass", info[i].desc.bDeviceSubClass);
+    COLUMN("protocol", info[i].desc.bDeviceProtocol);
+    COLUMN("bus_number", info[i].bus);
+    COLUMN("device_address", info[i].address);
+    COLUMN("speed", info[i].speed);
+    lua_createtable(L, n, 0);
+    for(i = 0; i < n; i++)
+        {
+        for(j = 0, len = 0; j < info[i].nports; j++)
+            len += snprintf(path + len, sizeof(path) - len, j ? ".%u" : "%u", info[i].ports[j]);
+        lua_pushlstring(L, path, len);
+        lua_rawseti(L, -2, i+1);
+        }
+    lua_setfield(L, -2, "port_path");
+    lua_pushinteger(L, n);
+    return 2;
+    }
+
+#undef COLUMN
+
+static int Snapshot(lua_State *L)
+/* The metadata is collected in one pass over a single libusb device list,
+ * without creating device objects. */
+    {
+    size_t i, n = 0;
+    device_t **list;
+    devinfo_t *info;
+    context_t *context = checkcontext(L, 1, NULL);
+    ssize_t count;
+    if(!lua_isnoneornil(L, 2)) (void)checkhostmem(L, 2, NULL);
+    lua_settop(L, 3);
+    count = libusb_get_device_list(context, &list);
+    if(count < 0) CheckError(L, count);
+    info = (devinfo_t*)lua_newuserdata(L, (count > 0 ? count : 1)*sizeof(devinfo_t));
+    for(i = 0; i < (size_t)count; i++)
+        if(getdevinfo(list[i], &info[n]) == 0) n++;
+    libusb_free_device_list(list, 1);
+    if(lua_isnoneornil(L, 2))
+        return PushSnapshot(L, info, n);
+    return PackSnapshot(L, info, n, 2);
+    }
+
 #if 0
 //@@int libusb_wrap_sys_device(context_t *context, intptr_t sys_dev, devhandle_t **devhandle);
 static int Wrap_sys_device(lua_State *L)
@@ -175,6 +427,8 @@ static const struct luaL_Reg Methods[] =
         { "set_log_cb", Set_log_cb },
         { "get_device_list", Get_device_list },
         { "open_device", Open_device },
+        { "find_devices", Find_devices },
+        { "snapshot", Snapshot },
 //      { "wrap_sys_device", Wrap_sys_device },
         { NULL, NULL } /* sentinel */
     };
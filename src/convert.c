@@ -0,0 +1,607 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2021 Stefano Trettel
+ *
+ * Software repository: MoonUSB, https://github.com/stetre/moonusb
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "internal.h"
+
+/*------------------------------------------------------------------------------*
+ | Conversion between binary types                                              |
+ *------------------------------------------------------------------------------*/
+
+/* Conversions compute y = x*scale + offset. Conversions to integer types round to
+ * nearest (ties to even) and saturate to the range of the destination type.
+ *
+ * The most common conversions between small integer types and float (with no byte
+ * swapping involved) are done by dedicated kernels that compute in single precision,
+ * vectorized with SSE2 (and with AVX2, if supported by the CPU) on x86.
+ * Anything else goes through a generic scalar path that computes in double precision.
+ */
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define HAVE_SSE2
+#include <immintrin.h>
+#if defined(__GNUC__) && !defined(__clang__) && (__GNUC__ >= 5)
+#define HAVE_AVX2
+#endif
+#endif
+
+typedef void (*kernel_t)(void *dst, const void *src, size_t n, float scale, float offset);
+
+#ifdef HAVE_AVX2
+static int HaveAvx2 = 0;
+#endif
+
+static inline float RoundF(float x)
+/* Round to nearest, ties to even (same as cvtps2dq with the default MXCSR) */
+    {
+    const float magic = 8388608.0f; /* 2^23 */
+    if(__builtin_fabsf(x) >= magic) return x; /* already integral */
+    return x >= 0 ? (x + magic) - magic : (x - magic) + magic;
+    }
+
+static inline double RoundD(double x)
+    {
+    const double magic = 4503599627370496.0; /* 2^52 */
+    if(__builtin_fabs(x) >= magic) return x;
+    return x >= 0 ? (x + magic) - magic : (x - magic) + magic;
+    }
+
+/*------------------------------------------------------------------------------*
+ | Scalar kernels                                                               |
+ *------------------------------------------------------------------------------*/
+
+#define TOFLOAT(name, T)                                                        \
+static void name(void *dst, const void *src, size_t n, float scale, float offset) \
+    {                                                                           \
+    size_t i;                                                                   \
+    float *d = (float*)dst;                                                     \
+    const T *s = (const T*)src;                                                 \
+    for(i = 0; i < n; i++)                                                      \
+        d[i] = (float)s[i]*scale + offset;                                      \
+    }
+
+TOFLOAT(CharToFloat, int8_t)
+TOFLOAT(UcharToFloat, uint8_t)
+TOFLOAT(ShortToFloat, int16_t)
+TOFLOAT(UshortToFloat, uint16_t)
+TOFLOAT(IntToFloat, int32_t)
+
+#define FROMFLOAT(name, T, lo, hi)                                              \
+static void name(void *dst, const void *src, size_t n, float scale, float offset) \
+    {                                                                           \
+    size_t i;                                                                   \
+    float y;                                                                    \
+    T *d = (T*)dst;                                                             \
+    const float *s = (const float*)src;                                         \
+    for(i = 0; i < n; i++)                                                      \
+        {                                                                       \
+        y = s[i]*scale + offset;                                                \
+        if(!(y >= (lo))) y = (lo); /* NaN as well */                            \
+        if(y > (hi)) y = (hi);                                                  \
+        d[i] = (T)RoundF(y);                                                    \
+        }                                                                       \
+    }
+
+/* The upper limit for int is the largest float below 2^31 */
+FROMFLOAT(FloatToChar, int8_t, -128.0f, 127.0f)
+FROMFLOAT(FloatToUchar, uint8_t, 0.0f, 255.0f)
+FROMFLOAT(FloatToShort, int16_t, -32768.0f, 32767.0f)
+FROMFLOAT(FloatToUshort, uint16_t, 0.0f, 65535.0f)
+FROMFLOAT(FloatToInt, int32_t, -2147483648.0f, 2147483520.0f)
+
+/*------------------------------------------------------------------------------*
+ | SSE2 kernels                                                                 |
+ *------------------------------------------------------------------------------*/
+
+#ifdef HAVE_SSE2
+
+#define STORE4(p, v) _mm_storeu_ps((p), _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(v), vs), vo))
+
+static void CharToFloat_sse2(void *dst, const void *src, size_t n, float scale, float offset)
+    {
+    size_t i = 0;
+    float *d = (float*)dst;
+    const int8_t *s = (const int8_t*)src;
+    __m128 vs = _mm_set1_ps(scale), vo = _mm_set1_ps(offset);
+    __m128i v, lo, hi;
+    for(; i + 16 <= n; i += 16)
+        {
+        v = _mm_loadu_si128((const __m128i*)(s+i));
+        lo = _mm_srai_epi16(_mm_unpacklo_epi8(v, v), 8);
+        hi = _mm_srai_epi16(_mm_unpackhi_epi8(v, v), 8);
+        STORE4(d+i, _mm_srai_epi32(_mm_unpacklo_epi16(lo, lo), 16));
+        STORE4(d+i+4, _mm_srai_epi32(_mm_unpackhi_epi16(lo, lo), 16));
+        STORE4(d+i+8, _mm_srai_epi32(_mm_unpacklo_epi16(hi, hi), 16));
+        STORE4(d+i+12, _mm_srai_epi32(_mm_unpackhi_epi16(hi, hi), 16));
+        }
+    CharToFloat(d+i, s+i, n-i, scale, offset);
+    }
+
+static void UcharToFloat_sse2(void *dst, const void *src, size_t n, float scale, float offset)
+    {
+    size_t i = 0;
+    float *d = (float*)dst;
+    const uint8_t *s = (const uint8_t*)src;
+    __m128 vs = _mm_set1_ps(scale), vo = _mm_set1_ps(offset);
+    __m128i zero = _mm_setzero_si128();
+    __m128i v, lo, hi;
+    for(; i + 16 <= n; i += 16)
+        {
+        v = _mm_loadu_si128((const __m128i*)(s+i));
+        lo = _mm_unpacklo_epi8(v, zero);
+        hi = _mm_unpackhi_epi8(v, zero);
+        STORE4(d+i, _mm_unpacklo_epi16(lo, zero));
+        STORE4(d+i+4, _mm_unpackhi_epi16(lo, zero));
+        STORE4(d+i+8, _mm_unpacklo_epi16(hi, zero));
+        STORE4(d+i+12, _mm_unpackhi_epi16(hi, zero));
+        }
+    UcharToFloat(d+i, s+i, n-i, scale, offset);
+    }
+
+static void ShortToFloat_sse2(void *dst, const void *src, size_t n, float scale, float offset)
+    {
+    size_t i = 0;
+    float *d = (float*)dst;
+    const int16_t *s = (const int16_t*)src;
+    __m128 vs = _mm_set1_ps(scale), vo = _mm_set1_ps(offset);
+    __m128i v;
+    for(; i + 8 <= n; i += 8)
+        {
+        v = _mm_loadu_si128((const __m128i*)(s+i));
+        STORE4(d+i, _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16));
+        STORE4(d+i+4, _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16));
+        }
+    ShortToFloat(d+i, s+i, n-i, scale, offset);
+    }
+
+static void UshortToFloat_sse2(void *dst, const void *src, size_t n, float scale, float offset)
+    {
+    size_t i = 0;
+    float *d = (float*)dst;
+    const uint16_t *s = (const uint16_t*)src;
+    __m128 vs = _mm_set1_ps(scale), vo = _mm_set1_ps(offset);
+    __m128i zero = _mm_setzero_si128();
+    __m128i v;
+    for(; i + 8 <= n; i += 8)
+        {
+        v = _mm_loadu_si128((const __m128i*)(s+i));
+        STORE4(d+i, _mm_unpacklo_epi16(v, zero));
+        STORE4(d+i+4, _mm_unpackhi_epi16(v, zero));
+        }
+    UshortToFloat(d+i, s+i, n-i, scale, offset);
+    }
+
+static void IntToFloat_sse2(void *dst, const void *src, size_t n, float scale, float offset)
+    {
+    size_t i = 0;
+    float *d = (float*)dst;
+    const int32_t *s = (const int32_t*)src;
+    __m128 vs = _mm_set1_ps(scale), vo = _mm_set1_ps(offset);
+    for(; i + 4 <= n; i += 4)
+        STORE4(d+i, _mm_loadu_si128((const __m128i*)(s+i)));
+    IntToFloat(d+i, s+i, n-i, scale, offset);
+    }
+
+#undef STORE4
+
+/* Scales, clamps and converts 4 floats to int32 */
+#define LOAD4(p) _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(                         \
+                    _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(p), vs), vo), vlo), vhi))
+
+#define SETUP(lo, hi)                                                           \
+    __m128 vs = _mm_set1_ps(scale), vo = _mm_set1_ps(offset);                   \
+    __m128 vlo = _mm_set1_ps(lo), vhi = _mm_set1_ps(hi)
+
+static void FloatToChar_sse2(void *dst, const void *src, size_t n, float scale, float offset)
+    {
+    size_t i = 0;
+    int8_t *d = (int8_t*)dst;
+    const float *s = (const float*)src;
+    __m128i a, b;
+    SETUP(-128.0f, 127.0f);
+    for(; i + 16 <= n; i += 16)
+        {
+        a = _mm_packs_epi32(LOAD4(s+i), LOAD4(s+i+4));
+        b = _mm_packs_epi32(LOAD4(s+i+8), LOAD4(s+i+12));
+        _mm_storeu_si128((__m128i*)(d+i), _mm_packs_epi16(a, b));
+        }
+    FloatToChar(d+i, s+i, n-i, scale, offset);
+    }
+
+static void FloatToUchar_sse2(void *dst, const void *src, size_t n, float scale, float offset)
+    {
+    size_t i = 0;
+    uint8_t *d = (uint8_t*)dst;
+    const float *s = (const float*)src;
+    __m128i a, b;
+    SETUP(0.0f, 255.0f);
+    for(; i + 16 <= n; i += 16)
+        {
+        a = _mm_packs_epi32(LOAD4(s+i), LOAD4(s+i+4));
+        b = _mm_packs_epi32(LOAD4(s+i+8), LOAD4(s+i+12));
+        _mm_storeu_si128((__m128i*)(d+i), _mm_packus_epi16(a, b));
+        }
+    FloatToUchar(d+i, s+i, n-i, scale, offset);
+    }
+
+static void FloatToShort_sse2(void *dst, const void *src, size_t n, float scale, float offset)
+    {
+    size_t i = 0;
+    int16_t *d = (int16_t*)dst;
+    const float *s = (const float*)src;
+    SETUP(-32768.0f, 32767.0f);
+    for(; i + 8 <= n; i += 8)
+        _mm_storeu_si128((__m128i*)(d+i), _mm_packs_epi32(LOAD4(s+i), LOAD4(s+i+4)));
+    FloatToShort(d+i, s+i, n-i, scale, offset);
+    }
+
+static void FloatToUshort_sse2(void *dst, const void *src, size_t n, float scale, float offset)
+/* SSE2 has no unsigned 32->16 pack, so bias to the signed range and back */
+    {
+    size_t i = 0;
+    uint16_t *d = (uint16_t*)dst;
+    const float *s = (const float*)src;
+    __m128i bias32 = _mm_set1_epi32(32768), bias16 = _mm_set1_epi16((short)0x8000);
+    __m128i a, b;
+    SETUP(0.0f, 65535.0f);
+    for(; i + 8 <= n; i += 8)
+        {
+        a = _mm_sub_epi32(LOAD4(s+i), bias32);
+        b = _mm_sub_epi32(LOAD4(s+i+4), bias32);
+        _mm_storeu_si128((__m128i*)(d+i), _mm_xor_si128(_mm_packs_epi32(a, b), bias16));
+        }
+    FloatToUshort(d+i, s+i, n-i, scale, offset);
+    }
+
+static void FloatToInt_sse2(void *dst, const void *src, size_t n, float scale, float offset)
+    {
+    size_t i = 0;
+    int32_t *d = (int32_t*)dst;
+    const float *s = (const float*)src;
+    SETUP(-2147483648.0f, 2147483520.0f);
+    for(; i + 4 <= n; i += 4)
+        _mm_storeu_si128((__m128i*)(d+i), LOAD4(s+i));
+    FloatToInt(d+i, s+i, n-i, scale, offset);
+    }
+
+#undef LOAD4
+#undef SETUP
+
+#endif /* HAVE_SSE2 */
+
+/*------------------------------------------------------------------------------*
+ | AVX2 kernels                                                                 |
+ *------------------------------------------------------------------------------*/
+
+#ifdef HAVE_AVX2
+
+#define TOFLOAT_AVX2(name, T, load)                                       \
+__attribute__((target("avx2")))                                                 \
+static void name##_avx2(void *dst, const void *src, size_t n, float scale, float offset) \
+    {                                                                           \
+    size_t i = 0;                                                               \
+    float *d = (float*)dst;                                                     \
+    const T *s = (const T*)src;                                                 \
+    __m256 vs = _mm256_set1_ps(scale), vo = _mm256_set1_ps(offset);             \
+    __m256i v;                                                                  \
+    for(; i + 8 <= n; i += 8)                                                   \
+        {                                                                       \
+        v = load;                                                               \
+        _mm256_storeu_ps(d+i, _mm256_add_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(v), vs), vo)); \
+        }                                                                       \
+    name(d+i, s+i, n-i, scale, offset);                                         \
+    }
+
+TOFLOAT_AVX2(CharToFloat, int8_t, _mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i*)(s+i))))
+TOFLOAT_AVX2(UcharToFloat, uint8_t, _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(s+i))))
+TOFLOAT_AVX2(ShortToFloat, int16_t, _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(s+i))))
+TOFLOAT_AVX2(UshortToFloat, uint16_t, _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(s+i))))
+TOFLOAT_AVX2(IntToFloat, int32_t, _mm256_loadu_si256((const __m256i*)(s+i)))
+
+#define LOAD8(p) _mm256_cvtps_epi32(_mm256_min_ps(_mm256_max_ps(                \
+                _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(p), vs), vo), vlo), vhi))
+
+#define FROMFLOAT_AVX2(name, T, lo, hi, pack)                                   \
+__attribute__((target("avx2")))                                                 \
+static void name##_avx2(void *dst, const void *src, size_t n, float scale, float offset) \
+    {                                                                           \
+    size_t i = 0;                                                               \
+    T *d = (T*)dst;                                                             \
+    const float *s = (const float*)src;                                         \
+    __m256 vs = _mm256_set1_ps(scale), vo = _mm256_set1_ps(offset);             \
+    __m256 vlo = _mm256_set1_ps(lo), vhi = _mm256_set1_ps(hi);                  \
+    __m256i v;                                                                  \
+    for(; i + 16 <= n; i += 16)                                                 \
+        {                                                                       \
+        /* the pack works within 128-bit lanes, so fix the order afterwards */  \
+        v = _mm256_permute4x64_epi64(pack(LOAD8(s+i), LOAD8(s+i+8)), 0xd8);     \
+        _mm256_storeu_si256((__m256i*)(d+i), v);                                \
+        }                                                                       \
+    name(d+i, s+i, n-i, scale, offset);                                         \
+    }
+
+FROMFLOAT_AVX2(FloatToShort, int16_t, -32768.0f, 32767.0f, _mm256_packs_epi32)
+FROMFLOAT_AVX2(FloatToUshort, uint16_t, 0.0f, 65535.0f, _mm256_packus_epi32)
+
+#undef LOAD8
+
+#endif /* HAVE_AVX2 */
+
+static kernel_t FastKernel(int srctype, int dsttype)
+/* Returns the dedicated kernel for the given conversion, or NULL if there is none */
+    {
+#if defined(HAVE_AVX2)
+#define K(name) (HaveAvx2 ? name##_avx2 : name##_sse2)
+#define K_(name) (name##_sse2) /* no AVX2 version */
+#elif defined(HAVE_SSE2)
+#define K(name) (name##_sse2)
+#define K_(name) (name##_sse2)
+#else
+#define K(name) (name)
+#define K_(name) (name)
+#endif
+    if(dsttype == MOONUSB_TYPE_FLOAT)
+        {
+        switch(srctype)
+            {
+            case MOONUSB_TYPE_CHAR: return K(CharToFloat);
+            case MOONUSB_TYPE_UCHAR: return K(UcharToFloat);
+            case MOONUSB_TYPE_SHORT: return K(ShortToFloat);
+            case MOONUSB_TYPE_USHORT: return K(UshortToFloat);
+            case MOONUSB_TYPE_INT: return K(IntToFloat);
+            default: return NULL;
+            }
+        }
+    if(srctype == MOONUSB_TYPE_FLOAT)
+        {
+        switch(dsttype)
+            {
+            case MOONUSB_TYPE_CHAR: return K_(FloatToChar);
+            case MOONUSB_TYPE_UCHAR: return K_(FloatToUchar);
+            case MOONUSB_TYPE_SHORT: return K(FloatToShort);
+            case MOONUSB_TYPE_USHORT: return K(FloatToUshort);
+            case MOONUSB_TYPE_INT: return K_(FloatToInt);
+            default: return NULL;
+            }
+        }
+#undef K
+#undef K_
+    return NULL;
+    }
+
+/*------------------------------------------------------------------------------*
+ | Generic path                                                                 |
+ *------------------------------------------------------------------------------*/
+
+#define ISINTEGER(type) ((type) != MOONUSB_TYPE_FLOAT && (type) != MOONUSB_TYPE_DOUBLE)
+#define IS64BIT(type) ((type) == MOONUSB_TYPE_LONG || (type) == MOONUSB_TYPE_ULONG)
+
+static void Load(const unsigned char *p, size_t size, int swap, void *val)
+    {
+    uint16_t u16; uint32_t u32; uint64_t u64;
+    switch(size)
+        {
+        case 2: memcpy(&u16, p, 2); if(swap) u16 = __builtin_bswap16(u16); memcpy(val, &u16, 2); break;
+        case 4: memcpy(&u32, p, 4); if(swap) u32 = __builtin_bswap32(u32); memcpy(val, &u32, 4); break;
+        case 8: memcpy(&u64, p, 8); if(swap) u64 = __builtin_bswap64(u64); memcpy(val, &u64, 8); break;
+        default: memcpy(val, p, size);
+        }
+    }
+
+static void Store(unsigned char *p, size_t size, int swap, const void *val)
+    {
+    Load((const unsigned char*)val, size, swap, p);
+    }
+
+static double LoadD(const unsigned char *p, int type, int swap)
+    {
+    union { int8_t c; uint8_t uc; int16_t s; uint16_t us; int32_t i; uint32_t ui;
+            int64_t l; uint64_t ul; float f; double d; } v;
+    Load(p, sizeoftype(type), swap, &v);
+    switch(type)
+        {
+        case MOONUSB_TYPE_CHAR: return v.c;
+        case MOONUSB_TYPE_UCHAR: return v.uc;
+        case MOONUSB_TYPE_SHORT: return v.s;
+        case MOONUSB_TYPE_USHORT: return v.us;
+        case MOONUSB_TYPE_INT: return v.i;
+        case MOONUSB_TYPE_UINT: return v.ui;
+        case MOONUSB_TYPE_LONG: return (double)v.l;
+        case MOONUSB_TYPE_ULONG: return (double)v.ul;
+        case MOONUSB_TYPE_FLOAT: return v.f;
+        case MOONUSB_TYPE_DOUBLE: return v.d;
+        }
+    return 0;
+    }
+
+static void StoreD(unsigned char *p, int type, int swap, double y)
+    {
+    union { int8_t c; uint8_t uc; int16_t s; uint16_t us; int32_t i; uint32_t ui;
+            int64_t l; uint64_t ul; float f; double d; } v;
+#define SAT(lo, hi) do { if(!(y >= (lo))) y = (lo); if(y > (hi)) y = (hi); y = RoundD(y); } while(0)
+    switch(type)
+        {
+        case MOONUSB_TYPE_CHAR: SAT(INT8_MIN, INT8_MAX); v.c = (int8_t)y; break;
+        case MOONUSB_TYPE_UCHAR: SAT(0, UINT8_MAX); v.uc = (uint8_t)y; break;
+        case MOONUSB_TYPE_SHORT: SAT(INT16_MIN, INT16_MAX); v.s = (int16_t)y; break;
+        case MOONUSB_TYPE_USHORT: SAT(0, UINT16_MAX); v.us = (uint16_t)y; break;
+        case MOONUSB_TYPE_INT: SAT(INT32_MIN, INT32_MAX); v.i = (int32_t)y; break;
+        case MOONUSB_TYPE_UINT: SAT(0, UINT32_MAX); v.ui = (uint32_t)y; break;
+        /* 2^63 and 2^64 are not representable as int64/uint64: */
+        case MOONUSB_TYPE_LONG: SAT(-9223372036854775808.0, 9223372036854774784.0);
+                                v.l = (int64_t)y; break;
+        case MOONUSB_TYPE_ULONG: SAT(0, 18446744073709549568.0); v.ul = (uint64_t)y; break;
+        case MOONUSB_TYPE_FLOAT: v.f = (float)y; break;
+        case MOONUSB_TYPE_DOUBLE: v.d = y; break;
+        }
+#undef SAT
+    Store(p, sizeoftype(type), swap, &v);
+    }
+
+static void StoreI(unsigned char *p, int type, int swap, int64_t sval, uint64_t uval, int isunsigned)
+/* Stores an integer value (sval if !isunsigned, uval otherwise) with saturation */
+    {
+    union { int8_t c; uint8_t uc; int16_t s; uint16_t us; int32_t i; uint32_t ui;
+            int64_t l; uint64_t ul; } v;
+    int64_t lo = 0;
+    uint64_t hi = 0;
+    switch(type)
+        {
+        case MOONUSB_TYPE_CHAR: lo = INT8_MIN; hi = INT8_MAX; break;
+        case MOONUSB_TYPE_UCHAR: lo = 0; hi = UINT8_MAX; break;
+        case MOONUSB_TYPE_SHORT: lo = INT16_MIN; hi = INT16_MAX; break;
+        case MOONUSB_TYPE_USHORT: lo = 0; hi = UINT16_MAX; break;
+        case MOONUSB_TYPE_INT: lo = INT32_MIN; hi = INT32_MAX; break;
+        case MOONUSB_TYPE_UINT: lo = 0; hi = UINT32_MAX; break;
+        case MOONUSB_TYPE_LONG: lo = INT64_MIN; hi = INT64_MAX; break;
+        case MOONUSB_TYPE_ULONG: lo = 0; hi = UINT64_MAX; break;
+        }
+    if(isunsigned)
+        { if(uval > hi) uval = hi; }
+    else if(sval < lo)
+        uval = (uint64_t)lo;
+    else if(sval > 0 && (uint64_t)sval > hi)
+        uval = hi;
+    else
+        uval = (uint64_t)sval;
+    /* uval now holds the two's complement representation of the result */
+    switch(type)
+        {
+        case MOONUSB_TYPE_CHAR: v.c = (int8_t)uval; break;
+        case MOONUSB_TYPE_UCHAR: v.uc = (uint8_t)uval; break;
+        case MOONUSB_TYPE_SHORT: v.s = (int16_t)uval; break;
+        case MOONUSB_TYPE_USHORT: v.us = (uint16_t)uval; break;
+        case MOONUSB_TYPE_INT: v.i = (int32_t)uval; break;
+        case MOONUSB_TYPE_UINT: v.ui = (uint32_t)uval; break;
+        case MOONUSB_TYPE_LONG: v.l = (int64_t)uval; break;
+        case MOONUSB_TYPE_ULONG: v.ul = uval; break;
+        }
+    Store(p, sizeoftype(type), swap, &v);
+    }
+
+static void ConvertGeneric(unsigned char *dst, int dsttype, int dstswap,
+        const unsigned char *src, int srctype, int srcswap, size_t n, double scale, double offset)
+    {
+    size_t i;
+    size_t ds = sizeoftype(dsttype), ss = sizeoftype(srctype);
+    union { int8_t c; uint8_t uc; int16_t s; uint16_t us; int32_t i; uint32_t ui;
+            int64_t l; uint64_t ul; } v;
+    int64_t sval;
+    if(ISINTEGER(srctype) && ISINTEGER(dsttype) && scale == 1 && offset == 0
+            && (IS64BIT(srctype) || IS64BIT(dsttype)))
+        { /* doubles can't hold all 64-bit integers, so convert exactly */
+        for(i = 0; i < n; i++)
+            {
+            Load(src + i*ss, ss, srcswap, &v);
+            switch(srctype)
+                {
+                case MOONUSB_TYPE_CHAR: sval = v.c; break;
+                case MOONUSB_TYPE_UCHAR: sval = v.uc; break;
+                case MOONUSB_TYPE_SHORT: sval = v.s; break;
+                case MOONUSB_TYPE_USHORT: sval = v.us; break;
+                case MOONUSB_TYPE_INT: sval = v.i; break;
+                case MOONUSB_TYPE_UINT: sval = v.ui; break;
+                case MOONUSB_TYPE_LONG: sval = v.l; break;
+                default: StoreI(dst + i*ds, dsttype, dstswap, 0, v.ul, 1); continue;
+                }
+            StoreI(dst + i*ds, dsttype, dstswap, sval, 0, 0);
+            }
+        return;
+        }
+    for(i = 0; i < n; i++)
+        StoreD(dst + i*ds, dsttype, dstswap, LoadD(src + i*ss, srctype, srcswap)*scale + offset);
+    }
+
+static void SwapCopy(unsigned char *dst, const unsigned char *src, size_t n, size_t size)
+    {
+    size_t i;
+    uint16_t u16; uint32_t u32; uint64_t u64;
+    /* the memory may be unaligned (e.g. hostmem created from a pointer), so
+     * use memcpy(), which the compiler turns into plain loads and stores */
+#define SWAPLOOP(U, swapfunc) for(i = 0; i < n; i++)                \
+        { memcpy(&(U), src + i*size, size); (U) = swapfunc(U); memcpy(dst + i*size, &(U), size); }
+    switch(size)
+        {
+        case 2: SWAPLOOP(u16, __builtin_bswap16); break;
+        case 4: SWAPLOOP(u32, __builtin_bswap32); break;
+        case 8: SWAPLOOP(u64, __builtin_bswap64); break;
+        default: memmove(dst, src, n*size);
+        }
+#undef SWAPLOOP
+    }
+
+static int Convert(lua_State *L)
+/* convert(dst, dsttype, src, srctype, [n], [scale], [offset], [dstendianness], [srcendianness]) */
+    {
+    kernel_t kernel;
+    hostmem_t *dst = checkhostmem(L, 1, NULL);
+    int dsttype = checktype(L, 2);
+    hostmem_t *src = checkhostmem(L, 3, NULL);
+    int srctype = checktype(L, 4);
+    size_t ds = sizeoftype(dsttype), ss = sizeoftype(srctype);
+    size_t maxn = dst->size/ds < src->size/ss ? dst->size/ds : src->size/ss;
+    size_t n = luaL_optinteger(L, 5, maxn);
+    double scale = luaL_optnumber(L, 6, 1.0);
+    double offset = luaL_optnumber(L, 7, 0.0);
+    int dstswap = needswap(optendianness(L, 8, MOONUSB_ENDIANNESS_NATIVE));
+    int srcswap = needswap(optendianness(L, 9, MOONUSB_ENDIANNESS_NATIVE));
+    if(n > maxn)
+        return luaL_error(L, errstring(ERR_BOUNDARIES));
+    if(n == 0) return 0;
+    /* Elements are converted in place only if the areas coincide and the element size
+     * is the same, otherwise a write could clobber source elements not yet read. */
+    if(dst->ptr < src->ptr + n*ss && src->ptr < dst->ptr + n*ds
+            && (dst->ptr != src->ptr || ds != ss))
+        return luaL_error(L, errstring(ERR_OVERLAP));
+    if(scale == 1 && offset == 0 && dsttype == srctype)
+        {
+        if(dstswap == srcswap)
+            memmove(dst->ptr, src->ptr, n*ds);
+        else
+            SwapCopy(dst->ptr, src->ptr, n, ds);
+        return 0;
+        }
+    if(!dstswap && !srcswap && (kernel = FastKernel(srctype, dsttype)) != NULL)
+        {
+        kernel(dst->ptr, src->ptr, n, (float)scale, (float)offset);
+        return 0;
+        }
+    ConvertGeneric(dst->ptr, dsttype, dstswap, src->ptr, srctype, srcswap, n, scale, offset);
+    return 0;
+    }
+
+static const struct luaL_Reg Functions[] = 
+    {
+        { "convert", Convert },
+        { NULL, NULL } /* sentinel */
+    };
+
+void moonusb_open_convert(lua_State *L)
+    {
+#ifdef HAVE_AVX2
+    HaveAvx2 = __builtin_cpu_supports("avx2");
+#endif
+    luaL_setfuncs(L, Functions, 0);
+    }
+
@@ -87,14 +87,35 @@ static int Flatten1_(lua_State *L, int table_index, int cur_index, int arg)
     return n;
     }
 
+static int IsFlat(lua_State *L, int arg)
+/* If the table at arg is a plain table (no metatable) whose array part contains
+ * no nested tables, returns its length, otherwise returns -1.
+ */
+    {
+    int i, len, t;
+    if(lua_getmetatable(L, arg))
+        { lua_pop(L, 1); return -1; }
+    len = lua_rawlen(L, arg);
+    for(i = 1; i <= len; i++)
+        {
+        t = lua_rawgeti(L, arg, i);
+        lua_pop(L, 1);
+        if(t == LUA_TTABLE) return -1;
+        }
+    return len;
+    }
+
 int toflattable(lua_State *L, int arg)
 /* Creates a flat table with all the arguments starting from arg, and leaves 
  * it on top of the stack.
+ * If arg is already a flat table, it is pushed as is (the caller must not modify it).
  */
     {
     int table_index, last_arg, i, n;
     if(lua_type(L, arg) == LUA_TTABLE)
         {
+        if((n = IsFlat(L, arg)) >= 0)
+            { lua_pushvalue(L, arg); return n; }
         lua_newtable(L);
         n = Flatten1_(L, lua_gettop(L), 0, arg);
         }
@@ -128,6 +149,12 @@ static int Flatten(lua_State *L)
 
 static int FlattenTable(lua_State *L)
     {
+    if(lua_type(L, 1) == LUA_TTABLE)
+        { /* always return a new table, even if the argument is already flat */
+        lua_newtable(L);
+        Flatten1_(L, lua_gettop(L), 0, 1);
+        return 1;
+        }
     toflattable(L, 1);
     return 1;
     }
@@ -211,18 +238,19 @@ static int Pack(lua_State *L)
 /*-----------------------------------------------------------------------------*/
 
 #define UNPACK(T, what) /* what= number or integer */   \
-static int Unpack##T(lua_State *L, const void* data, size_t len) \
+static int Unpack##T(lua_State *L, const void* data, size_t len, int dst, lua_Integer base) \
     {                                                   \
     size_t n;                                           \
     size_t i=0;                                         \
     if((len < sizeof(T)) || (len % sizeof(T)) != 0)     \
         return ERR_LENGTH;                              \
     n = len / sizeof(T);                                \
-    lua_newtable(L);                                    \
+    if(dst == 0)                                        \
+        { lua_newtable(L); dst = lua_gettop(L); }       \
     for(i = 0; i < n; i++)                              \
         {                                               \
         lua_push##what(L, ((T*)data)[i]);               \
-        lua_rawseti(L, -2, i+1);                        \
+        lua_rawseti(L, dst, base+i+1);                  \
         }                                               \
     return 0;                                           \
     }
@@ -242,26 +270,32 @@ UNPACK_INTEGERS(uint32_t)
 UNPACK_INTEGERS(int64_t)
 UNPACK_INTEGERS(uint64_t)
 
-static int Unpack_(lua_State *L, int type, const void *data, size_t len)
+static int Unpack_(lua_State *L, int type, const void *data, size_t len, int dst, lua_Integer base)
+/* Unpacks data into the table at index dst, starting from dst[base+1], or
+ * into a new table if dst=0. Leaves the table on top of the stack.
+ */
     {
     int err = 0;
     switch(type)
         {
-        case MOONUSB_TYPE_CHAR:   err = Unpackint8_t(L, data, len); break;
-        case MOONUSB_TYPE_UCHAR:  err = Unpackuint8_t(L, data, len); break;
-        case MOONUSB_TYPE_SHORT:  err = Unpackint16_t(L, data, len); break;
-        case MOONUSB_TYPE_USHORT: err = Unpackuint16_t(L, data, len); break;
-        case MOONUSB_TYPE_INT:    err = Unpackint32_t(L, data, len); break;
-        case MOONUSB_TYPE_UINT:   err = Unpackuint32_t(L, data, len); break;
-        case MOONUSB_TYPE_LONG:   err = Unpackint64_t(L, data, len); break;
-        case MOONUSB_TYPE_ULONG:  err = Unpackuint64_t(L, data, len); break;
-        case MOONUSB_TYPE_FLOAT:  err = Unpackfloat(L, data, len); break;
-        case MOONUSB_TYPE_DOUBLE: err = Unpackdouble(L, data, len); break;
+#define U(T) do { err = Unpack##T(L, data, len, dst, base); } while(0)
+        case MOONUSB_TYPE_CHAR:   U(int8_t); break;
+        case MOONUSB_TYPE_UCHAR:  U(uint8_t); break;
+        case MOONUSB_TYPE_SHORT:  U(int16_t); break;
+        case MOONUSB_TYPE_USHORT: U(uint16_t); break;
+        case MOONUSB_TYPE_INT:    U(int32_t); break;
+        case MOONUSB_TYPE_UINT:   U(uint32_t); break;
+        case MOONUSB_TYPE_LONG:   U(int64_t); break;
+        case MOONUSB_TYPE_ULONG:  U(uint64_t); break;
+        case MOONUSB_TYPE_FLOAT:  U(float); break;
+        case MOONUSB_TYPE_DOUBLE: U(double); break;
+#undef U
         default:
             return unexpected(L);
         }
     if(err)
         return luaL_error(L, errstring(err));
+    if(dst != 0) lua_pushvalue(L, dst);
     return 1;
     }
 
@@ -271,7 +305,165 @@ static int Unpack(lua_State *L)
     size_t len;
     int type = checktype(L, 1);
     const void *data = luaL_checklstring(L, 2, &len);
-    return Unpack_(L, type, data, len);
+    return Unpack_(L, type, data, len, 0, 0);
+    }
+
+static int UnpackInto(lua_State *L)
+/* n = unpack_into(type, data, dst, [offset]) */
+    {
+    size_t len;
+    int type = checktype(L, 1);
+    const void *data = luaL_checklstring(L, 2, &len);
+    lua_Integer offset;
+    luaL_checktype(L, 3, LUA_TTABLE);
+    offset = luaL_optinteger(L, 4, 0);
+    if(offset < 0)
+        return argerror(L, 4, ERR_VALUE);
+    Unpack_(L, type, data, len, 3, offset);
+    lua_pushinteger(L, len/sizeoftype(type));
+    return 1;
+    }
+
+/*-----------------------------------------------------------------------------*/
+
+int needswap(int endianness)
+/* Returns 1 if values with the given byte order must be byte-swapped on this host */
+    {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return endianness == MOONUSB_ENDIANNESS_LITTLE;
+#else
+    return endianness == MOONUSB_ENDIANNESS_BIG;
+#endif
+    }
+
+#define Swap16(x) __builtin_bswap16(x)
+#define Swap32(x) __builtin_bswap32(x)
+#define Swap64(x) __builtin_bswap64(x)
+
+int pushelem(lua_State *L, int type, const void *ptr, int swap)
+/* Pushes the value of the given type located at ptr (possibly unaligned) */
+    {
+    uint16_t u16; uint32_t u32; uint64_t u64;
+    float f; double d;
+#define LOAD(T, U, swapfunc) do {                   \
+    memcpy(&(U), ptr, sizeof(U));                   \
+    if(swap) (U) = swapfunc(U);                     \
+    lua_pushinteger(L, (T)(U));                     \
+} while(0)
+    switch(type)
+        {
+        case MOONUSB_TYPE_CHAR:   lua_pushinteger(L, *(int8_t*)ptr); break;
+        case MOONUSB_TYPE_UCHAR:  lua_pushinteger(L, *(uint8_t*)ptr); break;
+        case MOONUSB_TYPE_SHORT:  LOAD(int16_t, u16, Swap16); break;
+        case MOONUSB_TYPE_USHORT: LOAD(uint16_t, u16, Swap16); break;
+        case MOONUSB_TYPE_INT:    LOAD(int32_t, u32, Swap32); break;
+        case MOONUSB_TYPE_UINT:   LOAD(uint32_t, u32, Swap32); break;
+        case MOONUSB_TYPE_LONG:   LOAD(int64_t, u64, Swap64); break;
+        case MOONUSB_TYPE_ULONG:  LOAD(uint64_t, u64, Swap64); break;
+        case MOONUSB_TYPE_FLOAT:  
+            memcpy(&u32, ptr, sizeof(u32));
+            if(swap) u32 = Swap32(u32);
+            memcpy(&f, &u32, sizeof(f));
+            lua_pushnumber(L, f);
+            break;
+        case MOONUSB_TYPE_DOUBLE:
+            memcpy(&u64, ptr, sizeof(u64));
+            if(swap) u64 = Swap64(u64);
+            memcpy(&d, &u64, sizeof(d));
+            lua_pushnumber(L, d);
+            break;
+        default:
+            return unexpected(L);
+        }
+#undef LOAD
+    return 1;
+    }
+
+int toelem(lua_State *L, int arg, int type, void *ptr, int swap)
+/* Stores the value at arg, encoded according to type, at ptr (possibly unaligned).
+ * Returns ERR_TYPE if the value is not of the expected kind, leaving ptr untouched.
+ */
+    {
+    int isnum;
+    lua_Integer i = 0;
+    lua_Number n = 0;
+    uint16_t u16; uint32_t u32; uint64_t u64;
+    float f; double d;
+    if(type == MOONUSB_TYPE_FLOAT || type == MOONUSB_TYPE_DOUBLE)
+        n = lua_tonumberx(L, arg, &isnum);
+    else
+        i = lua_tointegerx(L, arg, &isnum);
+    if(!isnum) return ERR_TYPE;
+#define STORE(U, swapfunc) do {                     \
+    (U) = i;                                        \
+    if(swap) (U) = swapfunc(U);                     \
+    memcpy(ptr, &(U), sizeof(U));                   \
+} while(0)
+    switch(type)
+        {
+        case MOONUSB_TYPE_CHAR:
+        case MOONUSB_TYPE_UCHAR:  *(uint8_t*)ptr = i; break;
+        case MOONUSB_TYPE_SHORT:
+        case MOONUSB_TYPE_USHORT: STORE(u16, Swap16); break;
+        case MOONUSB_TYPE_INT:
+        case MOONUSB_TYPE_UINT:   STORE(u32, Swap32); break;
+        case MOONUSB_TYPE_LONG:
+        case MOONUSB_TYPE_ULONG:  STORE(u64, Swap64); break;
+        case MOONUSB_TYPE_FLOAT:
+            f = n;
+            memcpy(&u32, &f, sizeof(u32));
+            if(swap) u32 = Swap32(u32);
+            memcpy(ptr, &u32, sizeof(u32));
+            break;
+        case MOONUSB_TYPE_DOUBLE:
+            d = n;
+            memcpy(&u64, &d, sizeof(u64));
+            if(swap) u64 = Swap64(u64);
+            memcpy(ptr, &u64, sizeof(u64));
+            break;
+        default:
+            return unexpected(L);
+        }
+#undef STORE
+    return 0;
+    }
+
+/*-----------------------------------------------------------------------------*/
+
+uint64_t getbits(const unsigned char *ptr, size_t bitoffset, unsigned int nbits)
+/* Returns the value of the nbits-wide (1..64) bitfield starting at the given bit offset,
+ * with bits numbered LSB-first within each byte (as in HID reports)
+ */
+    {
+    uint64_t val = 0;
+    const unsigned char *p = ptr + bitoffset/8;
+    unsigned int shift = bitoffset%8;
+    unsigned int i, nbytes = (shift + nbits + 7)/8; /* 1..9 */
+    for(i = 0; i < nbytes && i < 8; i++)
+        val |= (uint64_t)p[i] << (8*i);
+    val >>= shift;
+    if(nbytes == 9)
+        val |= (uint64_t)p[8] << (64 - shift);
+    if(nbits < 64)
+        val &= ((uint64_t)1 << nbits) - 1;
+    return val;
+    }
+
+void setbits(unsigned char *ptr, size_t bitoffset, unsigned int nbits, uint64_t val)
+/* Sets the value of the bitfield (see getbits), leaving the surrounding bits untouched */
+    {
+    unsigned char *p = ptr + bitoffset/8;
+    unsigned int shift = bitoffset%8;
+    unsigned int n;
+    while(nbits > 0)
+        {
+        n = 8 - shift < nbits ? 8 - shift : nbits; /* bits to set in this byte */
+        *p = (*p & ~(((1u << n) - 1) << shift)) | ((val & ((1u << n) - 1)) << shift);
+        val >>= n;
+        nbits -= n;
+        shift = 0;
+        p++;
+        }
     }
 
 /*-----------------------------------------------------------------------------*/
@@ -321,7 +513,15 @@ int checkdata(lua_State *L, int arg, int type, void *dst, size_t dstsize)
 
 int pushdata(lua_State *L, int type, void *data, size_t datalen)
     {
-    return Unpack_(L, type, data, datalen);
+    return Unpack_(L, type, data, datalen, 0, 0);
+    }
+
+int unpackinto(lua_State *L, int type, void *data, size_t datalen, int dst, lua_Integer base)
+/* Same as pushdata(), but overwrites the elements dst[base+1], dst[base+2], ...
+ * of the table at index dst (which is then pushed on the stack).
+ */
+    {
+    return Unpack_(L, type, data, datalen, dst, base);
     }
 
 static const struct luaL_Reg Functions[] = 
@@ -331,6 +531,7 @@ static const struct luaL_Reg Functions[] =
         { "sizeof", Sizeof },
         { "pack", Pack },
         { "unpack", Unpack },
+        { "unpack_into", UnpackInto },
         { NULL, NULL } /* sentinel */
     };
 
@@ -148,7 +148,7 @@ static void pushssendpointcompaniondescriptor(lua_State *L, const struct libusb_
     lua_pushinteger(L, s->wBytesPerInterval); lua_setfield(L, -2, "bytes_per_interval");
     }
 
-static void pushendpointdescriptor(lua_State *L, const struct libusb_endpoint_descriptor *s, context_t *context)
+void pushendpointdescriptor(lua_State *L, const struct libusb_endpoint_descriptor *s, context_t *context)
     {
     int transfer_type, ec;
     struct libusb_ss_endpoint_companion_descriptor *ep_comp;
@@ -191,7 +191,7 @@ static void pushendpointdescriptor(lua_State *L, const struct libusb_endpoint_de
         }
     }
 
-static void pushinterfacedescriptor(lua_State *L, const struct libusb_interface_descriptor *s, context_t *context)
+void pushinterfacedescriptor(lua_State *L, const struct libusb_interface_descriptor *s, context_t *context)
     {
     lua_newtable(L);
     lua_pushinteger(L, s->bInterfaceNumber);
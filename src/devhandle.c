@@ -34,7 +34,9 @@ static int freedevhandle(lua_State *L, ud_t *ud)
     freechildren(L, HOSTMEM_MT, ud);
     freechildren(L, TRANSFER_MT, ud);
     freechildren(L, INTERFACE_MT, ud);
+    if(ud->info) freestats(L, (devstats_t*)ud->info);
     if(!freeuserdata(L, ud, "devhandle")) return 0;
+    recordforget(devhandle);
     if(lock_on_close)
         {
         libusb_lock_events(context);
@@ -53,12 +55,68 @@ int newdevhandle(lua_State *L, device_t *device, devhandle_t *devhandle)
     ud->parent_ud = userdata(device);
     ud->context = userdata(device)->context;
     ud->destructor = freedevhandle;
+    ud->info = newstats(L);
     // Automatically detach the kernel driver when an interface is claimed,
     // and re-attach it when the interface is released (only relevant on linux):
     (void)libusb_set_auto_detach_kernel_driver(devhandle, 1);
     return 1;
     }
 
+/*------------------------------------------------------------------------------*
+ | Descriptor cache                                                             |
+ *------------------------------------------------------------------------------*/
+
+/* Descriptors and strings retrieved via a devhandle are cached per device, in a table
+ * referenced by the device's ref2, so that asking again for them needs no transfers.
+ * The cache is invalidated when the device is reset or detached.
+ */
+
+#define KEY_ASCII(index)            ((lua_Integer)(index))
+#define KEY_STRING(index, langid)   (((lua_Integer)1 << 40) | ((lua_Integer)(langid) << 8) | (index))
+#define KEY_DESCRIPTOR(type, index, len) \
+    (((lua_Integer)2 << 40) | ((lua_Integer)(type) << 24) | ((lua_Integer)(index) << 16) | (len))
+#define KEY_BOS                     ((lua_Integer)3 << 40)
+#define KEY_LANGID                  ((lua_Integer)4 << 40)
+
+static int CacheGet(lua_State *L, ud_t *device_ud, lua_Integer key)
+/* If found, pushes the cached value and returns 1, otherwise returns 0 */
+    {
+    if(device_ud->ref2 == LUA_NOREF) return 0;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, device_ud->ref2);
+    if(lua_rawgeti(L, -1, key) == LUA_TNIL)
+        { lua_pop(L, 2); return 0; }
+    lua_remove(L, -2);
+    return 1;
+    }
+
+static void CacheSet(lua_State *L, ud_t *device_ud, lua_Integer key)
+/* Caches the value on top of the stack (leaving it there) */
+    {
+    if(device_ud->ref2 == LUA_NOREF)
+        {
+        lua_newtable(L);
+        device_ud->ref2 = luaL_ref(L, LUA_REGISTRYINDEX);
+        }
+    lua_rawgeti(L, LUA_REGISTRYINDEX, device_ud->ref2);
+    lua_pushvalue(L, -2);
+    lua_rawseti(L, -2, key);
+    lua_pop(L, 1);
+    }
+
+void invalidatedevicecache(lua_State *L, ud_t *device_ud)
+    {
+    Unreference(L, device_ud->ref2);
+    invalidateconfigcache(L, device_ud);
+    }
+
+static int FlushCache(lua_State *L)
+    {
+    ud_t *ud;
+    (void)checkdevhandle(L, 1, &ud);
+    invalidatedevicecache(L, ud->parent_ud);
+    return 0;
+    }
+
 static int ClaimInterface(lua_State *L)
     {
     devhandle_t *devhandle = checkdevhandle(L, 1, NULL);
@@ -70,50 +128,646 @@ static int ClaimInterface(lua_State *L)
 static int Get_descriptor(lua_State *L)
     {
     int ec;
+    ud_t *ud;
     char *ptr=NULL;
-    devhandle_t *devhandle = checkdevhandle(L, 1, NULL);
+    devhandle_t *devhandle = checkdevhandle(L, 1, &ud);
     uint8_t desc_type = luaL_checkinteger(L, 2); /* libusb_descriptor_type */
     uint8_t desc_index = luaL_checkinteger(L, 3);
     char *buf = (char*)optlightuserdata(L, 4);
     size_t len = luaL_checkinteger(L, 5);
-    if(len == 0)
+    size_t cachedlen;
+    const char *cached;
+    lua_Integer key = KEY_DESCRIPTOR(desc_type, desc_index, len & 0xffff);
+    if(len == 0 || len > 0xffff)
         return argerror(L, 5, ERR_VALUE);
+    if(CacheGet(L, ud->parent_ud, key))
+        {
+        if(buf)
+            {
+            cached = lua_tolstring(L, -1, &cachedlen);
+            memcpy(buf, cached, cachedlen);
+            }
+        return 1;
+        }
     if(!buf)
         {
         ptr = Malloc(L, len*sizeof(char));
         buf = ptr;
         }
-    ec = libusb_get_descriptor(devhandle, desc_type, desc_index, (unsigned char*)ptr, (int)len);
+    ec = libusb_get_descriptor(devhandle, desc_type, desc_index, (unsigned char*)buf, (int)len);
     if(ec<0)
         { Free(L, ptr); CheckError(L, ec); }
     lua_pushlstring(L, buf, ec); // ec = no. of bytes received
     Free(L, ptr);
+    CacheSet(L, ud->parent_ud, key);
     return 1;
     }
 
+static int GetLangid(lua_State *L, devhandle_t *devhandle, ud_t *device_ud)
+/* Returns the first language id supported by the device (as done by libusb
+ * for the ASCII variant), or a negative libusb error code */
+    {
+    int ec, langid;
+    unsigned char data[255];
+    if(CacheGet(L, device_ud, KEY_LANGID))
+        {
+        langid = lua_tointeger(L, -1);
+        lua_pop(L, 1);
+        return langid;
+        }
+    ec = libusb_get_string_descriptor(devhandle, 0, 0, data, sizeof(data));
+    if(ec < 0) return ec;
+    if(ec < 4) return LIBUSB_ERROR_IO;
+    langid = data[2] | (data[3] << 8);
+    lua_pushinteger(L, langid);
+    CacheSet(L, device_ud, KEY_LANGID);
+    lua_pop(L, 1);
+    return langid;
+    }
+
+static int PushString(lua_State *L, const unsigned char *data, int len, int ascii)
+/* Pushes the string descriptor data (len bytes), converted to ASCII if required.
+ * This is the only conversion used for the strings cached with KEY_ASCII.
+ * Returns 0, or a libusb error code (pushing nothing) if the descriptor is invalid.
+ */
+    {
+    int i, n = 0;
+    char s[128];
+    if(!ascii)
+        {
+        if(len > data[0]) len = data[0];
+        lua_pushlstring(L, (const char*)data, len);
+        return 0;
+        }
+    /* same checks as libusb_get_string_descriptor_ascii() */
+    if(len < 2 || data[1] != LIBUSB_DT_STRING || data[0] > len)
+        return LIBUSB_ERROR_IO;
+    len = data[0];
+    for(i = 2; i+1 < len; i += 2) /* UTF-16LE, non-ASCII characters are replaced with '?' */
+        s[n++] = (data[i+1] != 0 || (data[i] & 0x80)) ? '?' : (char)data[i];
+    lua_pushlstring(L, s, n);
+    return 0;
+    }
+
 static int Get_string_descriptor(lua_State *L)
     {
 #define maxlen 256 /* the length field of the descriptor is 8 bits long */
     int ec;
+    ud_t *ud;
     uint16_t langid;
+    lua_Integer key;
     unsigned char data[maxlen];
-    devhandle_t *devhandle = checkdevhandle(L, 1, NULL);
+    devhandle_t *devhandle = checkdevhandle(L, 1, &ud);
     uint8_t index = luaL_checkinteger(L, 2);
     if(index==0)
         { lua_pushnil(L); return 1; }
     if(lua_isnoneornil(L, 3))
-        ec = libusb_get_string_descriptor_ascii(devhandle, index, data, maxlen);
+        {
+        key = KEY_ASCII(index);
+        if(CacheGet(L, ud->parent_ud, key)) return 1;
+        /* converted here rather than by libusb_get_string_descriptor_ascii(), so that
+         * the cached value is the same as the one retrieved by get_strings() */
+        ec = GetLangid(L, devhandle, ud->parent_ud);
+        if(ec<0) CheckError(L, ec);
+        ec = libusb_get_string_descriptor(devhandle, index, ec, data, maxlen);
+        if(ec<0) CheckError(L, ec);
+        ec = PushString(L, data, ec, 1);
+        CheckError(L, ec);
+        }
     else
         {
         langid = luaL_checkinteger(L, 3);
+        key = KEY_STRING(index, langid);
+        if(CacheGet(L, ud->parent_ud, key)) return 1;
         ec = libusb_get_string_descriptor(devhandle, index, langid, data, maxlen);
+        if(ec<0) CheckError(L, ec);
+        lua_pushlstring(L, (char*)data, ec);
         }
-    if(ec<0) CheckError(L, ec);
-    lua_pushlstring(L, (char*)data, ec);
+    CacheSet(L, ud->parent_ud, key);
     return 1;
 #undef maxlen
     }
 
+/*------------------------------------------------------------------------------*
+ | Batch retrieval of strings                                                   |
+ *------------------------------------------------------------------------------*/
+
+#define STRBUFSZ (LIBUSB_CONTROL_SETUP_SIZE + 255)
+
+/* The state of a batch of transfers is kept in a userdata, together with the transfer
+ * buffers, so that it can't be released while transfers are in flight. The wait for
+ * completion runs in protected mode: if it is interrupted by an error (e.g. raised by
+ * a callback of another transfer dispatched by libusb_handle_events_completed()), the
+ * outstanding transfers are cancelled and drained before the error is propagated.
+ */
+
+typedef struct {
+    context_t *context;
+    int remaining; /* no. of outstanding transfers */
+    int completed; /* set when remaining drops to 0 */
+    int aborted; /* 1 if no more transfers are to be submitted */
+    int ntransfers;
+    struct libusb_transfer **transfer; /* ntransfers slots (NULL = unused) */
+} batch_t;
+
+static batch_t *newbatch(lua_State *L, context_t *context, int ntransfers, size_t extrasize, void **extra)
+/* Pushes a userdata with the batch state, ntransfers transfer slots, and extrasize
+ * bytes of zeroed extra space (returned in *extra) */
+    {
+    batch_t *batch;
+    size_t size = sizeof(batch_t) + ntransfers*sizeof(struct libusb_transfer*) + extrasize;
+    batch = (batch_t*)lua_newuserdata(L, size);
+    memset(batch, 0, size);
+    batch->context = context;
+    batch->ntransfers = ntransfers;
+    batch->transfer = (struct libusb_transfer**)(batch + 1);
+    *extra = batch->transfer + ntransfers;
+    return batch;
+    }
+
+static void BatchCancel(batch_t *batch)
+    {
+    int i;
+    batch->aborted = 1;
+    for(i = 0; i < batch->ntransfers; i++)
+        if(batch->transfer[i]) libusb_cancel_transfer(batch->transfer[i]);
+    }
+
+static void BatchFree(batch_t *batch)
+/* Frees the transfers (they must have completed) */
+    {
+    int i;
+    for(i = 0; i < batch->ntransfers; i++)
+        {
+        if(batch->transfer[i]) libusb_free_transfer(batch->transfer[i]);
+        batch->transfer[i] = NULL;
+        }
+    }
+
+static int BatchWait(lua_State *L)
+/* Protected function: waits for the completion of the batch at index 1 */
+    {
+    int ec;
+    batch_t *batch = (batch_t*)lua_touserdata(L, 1);
+    while(batch->remaining > 0)
+        {
+        batch->completed = 0;
+        ec = libusb_handle_events_completed(batch->context, &batch->completed);
+        if(ec < 0 && ec != LIBUSB_ERROR_INTERRUPTED && !batch->aborted)
+            BatchCancel(batch); /* the transfers then complete as cancelled */
+        }
+    return 0;
+    }
+
+static void BatchAbort(lua_State *L, batch_t *batch)
+/* Error handler: cancels and drains the outstanding transfers, and frees them
+ * (leaving the error on top of the stack) */
+    {
+    BatchCancel(batch);
+    while(batch->remaining > 0)
+        {
+        lua_pushcfunction(L, BatchWait);
+        lua_pushlightuserdata(L, batch);
+        if(lua_pcall(L, 1, 0, 0) != LUA_OK)
+            lua_pop(L, 1); /* keep the first error */
+        }
+    BatchFree(batch);
+    }
+
+static void LIBUSB_CALL BatchCallback(struct libusb_transfer *transfer)
+    {
+    batch_t *batch = (batch_t*)transfer->user_data;
+    if(--batch->remaining == 0) batch->completed = 1;
+    }
+
+static int Get_strings(lua_State *L)
+/* strings = devhandle:get_strings({[key]=index}, [langid])
+ * The missing strings are retrieved by submitting all the control transfers
+ * at once, and then waiting for all of them to complete.
+ */
+    {
+    int i, n, ascii, langid, *len;
+    ud_t *ud;
+    batch_t *batch;
+    void *extra;
+    unsigned char *buf;
+    struct libusb_transfer *transfer;
+    lua_Integer index;
+    devhandle_t *devhandle = checkdevhandle(L, 1, &ud);
+    ud_t *device_ud = ud->parent_ud;
+    luaL_checktype(L, 2, LUA_TTABLE);
+    ascii = lua_isnoneornil(L, 3);
+    if(ascii)
+        {
+        langid = GetLangid(L, devhandle, device_ud);
+        if(langid < 0) CheckError(L, langid);
+        }
+    else
+        langid = luaL_checkinteger(L, 3);
+    lua_settop(L, 3);
+
+    /* Collect the missing strings, as {key, index} pairs */
+    lua_newtable(L); /* results, at 4 */
+    lua_newtable(L); /* pending, at 5 */
+    n = 0;
+    lua_pushnil(L);
+    while(lua_next(L, 2))
+        {
+        index = lua_tointeger(L, -1);
+        if(index < 1 || index > 255)
+            { lua_pop(L, 1); continue; }
+        if(CacheGet(L, device_ud, ascii ? KEY_ASCII(index) : KEY_STRING(index, langid)))
+            {
+            lua_pushvalue(L, -3); /* key */
+            lua_insert(L, -2);
+            lua_rawset(L, 4);
+            }
+        else
+            {
+            lua_pushvalue(L, -2); /* key */
+            lua_rawseti(L, 5, ++n);
+            }
+        lua_pop(L, 1);
+        }
+    if(n == 0)
+        { lua_pop(L, 1); return 1; }
+
+    /* Submit the transfers */
+    batch = newbatch(L, ud->context, n, n*(STRBUFSZ + sizeof(int)), &extra); /* at 6 */
+    buf = (unsigned char*)extra;
+    len = (int*)(buf + n*STRBUFSZ);
+    for(i = 0; i < n; i++)
+        {
+        lua_rawgeti(L, 5, i+1);
+        lua_rawget(L, 2);
+        index = lua_tointeger(L, -1);
+        lua_pop(L, 1);
+        transfer = libusb_alloc_transfer(0);
+        if(!transfer) continue;
+        libusb_fill_control_setup(buf + i*STRBUFSZ, LIBUSB_ENDPOINT_IN, LIBUSB_REQUEST_GET_DESCRIPTOR,
+                (uint16_t)((LIBUSB_DT_STRING << 8) | index), langid, 255);
+        libusb_fill_control_transfer(transfer, devhandle, buf + i*STRBUFSZ, BatchCallback, batch, 1000);
+        if(libusb_submit_transfer(transfer) != 0)
+            { libusb_free_transfer(transfer); continue; }
+        batch->transfer[i] = transfer;
+        batch->remaining++;
+        }
+
+    /* Wait for completion. Note that this may also dispatch the callbacks
+     * of other transfers submitted on the same context. */
+    lua_pushcfunction(L, BatchWait);
+    lua_pushvalue(L, 6);
+    if(lua_pcall(L, 1, 0, 0) != LUA_OK)
+        {
+        BatchAbort(L, batch);
+        return lua_error(L);
+        }
+    for(i = 0; i < n; i++)
+        {
+        transfer = batch->transfer[i];
+        len[i] = (transfer && transfer->status == LIBUSB_TRANSFER_COMPLETED) ? transfer->actual_length : -1;
+        }
+    BatchFree(batch); /* the data are in buf */
+
+    /* Collect the results */
+    for(i = 0; i < n; i++)
+        {
+        if(len[i] < 2) continue;
+        lua_rawgeti(L, 5, i+1); /* key */
+        lua_pushvalue(L, -1);
+        lua_rawget(L, 2);
+        index = lua_tointeger(L, -1);
+        lua_pop(L, 1);
+        if(PushString(L, buf + i*STRBUFSZ + LIBUSB_CONTROL_SETUP_SIZE, len[i], ascii) != 0)
+            { lua_pop(L, 1); continue; }
+        CacheSet(L, device_ud, ascii ? KEY_ASCII(index) : KEY_STRING(index, langid));
+        lua_rawset(L, 4);
+        }
+    lua_pop(L, 2); /* pending, batch */
+    return 1;
+    }
+
+/*------------------------------------------------------------------------------*
+ | Parallel probing                                                             |
+ *------------------------------------------------------------------------------*/
+
+/* The latency of probing a device is dominated by the control transfers needed
+ * to retrieve its strings (first the language id, then the strings themselves).
+ * Instead of probing the devices one at a time, we submit the transfers for all
+ * of them at once and let libusb complete them concurrently, chaining the string
+ * requests of each device to the completion of its language id request. This way
+ * the total time stays roughly flat as the number of devices grows.
+ */
+
+#define PROBE_LANGID 3 /* index of the langid request in probe->transfer[] */
+
+static const char *StringName[3] = { "manufacturer", "product", "serial_number" };
+
+typedef struct {
+    device_t *device;
+    ud_t *device_ud;
+    devhandle_t *devhandle;
+    int ec; /* libusb_open() error code */
+    int pending; /* no. of outstanding transfers */
+    int done; /* 1 if the result has been delivered */
+    int langid; /* -1 if to be retrieved */
+    uint8_t index[3]; /* indices of the strings to be retrieved (0 = none) */
+    unsigned int timeout;
+    batch_t *batch;
+    struct libusb_transfer **transfer; /* 4 slots in batch->transfer[] */
+    unsigned char buf[4][STRBUFSZ];
+} probe_t;
+
+typedef struct {
+    int n; /* no. of devices */
+    int open, strings, config;
+    unsigned int timeout;
+    int errref; /* first error raised by the callback, if any */
+    probe_t *probe; /* n probes, in the same userdata as the batch */
+} probeall_t;
+
+static void LIBUSB_CALL ProbeCallback(struct libusb_transfer *transfer);
+
+static void ProbeSubmit(probe_t *probe, int k)
+/* Submits the k-th request of the probe (k = PROBE_LANGID for the langid) */
+    {
+    struct libusb_transfer *transfer;
+    uint8_t index = k == PROBE_LANGID ? 0 : probe->index[k];
+    uint16_t langid = k == PROBE_LANGID ? 0 : probe->langid;
+    if(probe->batch->aborted) return; /* being cancelled */
+    transfer = libusb_alloc_transfer(0);
+    if(!transfer) return;
+    libusb_fill_control_setup(probe->buf[k], LIBUSB_ENDPOINT_IN, LIBUSB_REQUEST_GET_DESCRIPTOR,
+            (uint16_t)((LIBUSB_DT_STRING << 8) | index), langid, 255);
+    libusb_fill_control_transfer(transfer, probe->devhandle, probe->buf[k], ProbeCallback, probe, probe->timeout);
+    if(libusb_submit_transfer(transfer) != 0)
+        { libusb_free_transfer(transfer); return; }
+    probe->transfer[k] = transfer;
+    probe->pending++;
+    probe->batch->remaining++;
+    }
+
+static void ProbeSubmitStrings(probe_t *probe)
+    {
+    int k;
+    for(k = 0; k < 3; k++)
+        if(probe->index[k]) ProbeSubmit(probe, k);
+    }
+
+static void LIBUSB_CALL ProbeCallback(struct libusb_transfer *transfer)
+    {
+    probe_t *probe = (probe_t*)transfer->user_data;
+    unsigned char *data;
+    if(transfer == probe->transfer[PROBE_LANGID])
+        {
+        data = libusb_control_transfer_get_data(transfer);
+        if(transfer->status == LIBUSB_TRANSFER_COMPLETED && transfer->actual_length >= 4)
+            {
+            probe->langid = data[2] | (data[3] << 8);
+            ProbeSubmitStrings(probe);
+            }
+        }
+    probe->pending--;
+    if(--probe->batch->remaining == 0) probe->batch->completed = 1;
+    }
+
+static void ProbeDeliver(lua_State *L, probe_t *probe, int results, int i, int config, int func, int *errref)
+/* Completes the result for the i-th device and delivers it to the callback (at func), if any */
+    {
+    int k, ec;
+    struct libusb_transfer *transfer;
+    probe->done = 1;
+    lua_rawgeti(L, results, i);
+    for(k = 0; k < 4; k++)
+        {
+        transfer = probe->transfer[k];
+        if(!transfer) continue;
+        if(k == PROBE_LANGID)
+            {
+            if(probe->langid >= 0)
+                {
+                lua_pushinteger(L, probe->langid);
+                CacheSet(L, probe->device_ud, KEY_LANGID);
+                lua_pop(L, 1);
+                }
+            else /* no strings could be requested */
+                {
+                if(transfer->status != LIBUSB_TRANSFER_COMPLETED)
+                    pushtransferstatus(L, transfer->status);
+                else
+                    pusherrcode(L, LIBUSB_ERROR_IO);
+                lua_setfield(L, -2, "error");
+                }
+            }
+        else if(transfer->status == LIBUSB_TRANSFER_COMPLETED &&
+                PushString(L, libusb_control_transfer_get_data(transfer), transfer->actual_length, 1) == 0)
+            {
+            CacheSet(L, probe->device_ud, KEY_ASCII(probe->index[k]));
+            lua_setfield(L, -2, StringName[k]);
+            }
+        libusb_free_transfer(transfer);
+        probe->transfer[k] = NULL;
+        }
+    if(config)
+        {
+        ec = pushactiveconfig(L, probe->device, probe->device_ud);
+        if(ec == 0) lua_setfield(L, -2, "config");
+        }
+    if(func)
+        {
+        lua_pushvalue(L, func);
+        lua_pushvalue(L, -2);
+        if(lua_pcall(L, 1, 0, 0) != LUA_OK)
+            {
+            if(*errref == LUA_NOREF)
+                *errref = luaL_ref(L, LUA_REGISTRYINDEX);
+            else
+                lua_pop(L, 1);
+            }
+        }
+    lua_pop(L, 1);
+    }
+
+static int OptBooleanField(lua_State *L, int arg, const char *name, int defval)
+    {
+    int val;
+    if(lua_isnoneornil(L, arg)) return defval;
+    lua_getfield(L, arg, name);
+    val = lua_isnil(L, -1) ? defval : lua_toboolean(L, -1);
+    lua_pop(L, 1);
+    return val;
+    }
+
+static int ProbeRun(lua_State *L)
+/* Protected function: ProbeRun(batch, {device}, results, [func]) */
+    {
+    int i, k, ec;
+    ud_t *device_ud;
+    probe_t *probe;
+    struct libusb_device_descriptor desc;
+    batch_t *batch = (batch_t*)lua_touserdata(L, 1);
+    probeall_t *pa = (probeall_t*)(batch->transfer + batch->ntransfers);
+    int func = lua_isnil(L, 4) ? 0 : 4;
+
+    /* Open the devices and check the cache (no transfers involved) */
+    for(i = 0; i < pa->n; i++)
+        {
+        probe = &pa->probe[i];
+        lua_rawgeti(L, 2, i+1);
+        probe->device = checkdevice(L, -1, &device_ud);
+        probe->device_ud = device_ud;
+        lua_newtable(L);
+        lua_insert(L, -2);
+        lua_setfield(L, -2, "device");
+        if(pa->open || pa->strings)
+            {
+            probe->ec = libusb_open(probe->device, &probe->devhandle);
+            if(probe->ec)
+                {
+                probe->devhandle = NULL;
+                pusherrcode(L, probe->ec);
+                lua_setfield(L, -2, "error");
+                }
+            else if(pa->open)
+                {
+                newdevhandle(L, probe->device, probe->devhandle);
+                lua_setfield(L, -2, "devhandle");
+                }
+            }
+        if(pa->strings && probe->devhandle && libusb_get_device_descriptor(probe->device, &desc) == 0)
+            {
+            probe->index[0] = desc.iManufacturer;
+            probe->index[1] = desc.iProduct;
+            probe->index[2] = desc.iSerialNumber;
+            for(k = 0; k < 3; k++)
+                {
+                if(probe->index[k] && CacheGet(L, device_ud, KEY_ASCII(probe->index[k])))
+                    {
+                    lua_setfield(L, -2, StringName[k]);
+                    probe->index[k] = 0;
+                    }
+                }
+            if(CacheGet(L, device_ud, KEY_LANGID))
+                {
+                probe->langid = lua_tointeger(L, -1);
+                lua_pop(L, 1);
+                }
+            }
+        lua_rawseti(L, 3, i+1);
+        }
+
+    /* Submit the transfers for all the devices */
+    for(i = 0; i < pa->n; i++)
+        {
+        probe = &pa->probe[i];
+        if(!(probe->index[0] || probe->index[1] || probe->index[2])) continue;
+        if(probe->langid < 0)
+            ProbeSubmit(probe, PROBE_LANGID);
+        else
+            ProbeSubmitStrings(probe);
+        }
+
+    /* Deliver the results as they become available. Note that this may also
+     * dispatch the callbacks of other transfers submitted on the same context. */
+    do {
+        if(batch->remaining > 0)
+            {
+            batch->completed = 0;
+            ec = libusb_handle_events_completed(batch->context, &batch->completed);
+            if(ec < 0 && ec != LIBUSB_ERROR_INTERRUPTED && !batch->aborted)
+                BatchCancel(batch); /* the transfers then complete as cancelled */
+            }
+        for(i = 0; i < pa->n; i++)
+            {
+            probe = &pa->probe[i];
+            if(probe->done || probe->pending > 0) continue;
+            ProbeDeliver(L, probe, 3, i+1, pa->config, func, &pa->errref);
+            if(probe->devhandle && !pa->open)
+                { libusb_close(probe->devhandle); probe->devhandle = NULL; }
+            }
+        } while(batch->remaining > 0);
+    return 0;
+    }
+
+static int ProbeAll(lua_State *L)
+/* results = context:probe_all({device}, [options], [func])
+ * The state is kept in a userdata (so that it can't be released while transfers
+ * are in flight), and the probing runs in protected mode so that on errors the
+ * outstanding transfers can be cancelled and drained before propagating them.
+ */
+    {
+    int i, n, open, strings, config;
+    ud_t *device_ud;
+    batch_t *batch;
+    probeall_t *pa;
+    void *extra;
+    unsigned int timeout = 1000;
+    context_t *context = checkcontext(L, 1, NULL);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    if(!lua_isnoneornil(L, 3))
+        {
+        luaL_checktype(L, 3, LUA_TTABLE);
+        lua_getfield(L, 3, "timeout");
+        timeout = luaL_optinteger(L, -1, 1000);
+        lua_pop(L, 1);
+        }
+    open = OptBooleanField(L, 3, "open", 0);
+    strings = OptBooleanField(L, 3, "strings", 0);
+    config = OptBooleanField(L, 3, "config", 0);
+    if(!lua_isnoneornil(L, 4) && !lua_isfunction(L, 4))
+        return argerror(L, 4, ERR_FUNCTION);
+    lua_settop(L, 4);
+    n = luaL_len(L, 2);
+    for(i = 0; i < n; i++)
+        {
+        lua_rawgeti(L, 2, i+1);
+        if(!testdevice(L, -1, &device_ud)) return argerror(L, 2, ERR_TYPE);
+        if(device_ud->context != context) return argerror(L, 2, ERR_VALUE);
+        lua_pop(L, 1);
+        }
+    lua_createtable(L, n, 0); /* results, at 5 */
+    if(n <= 0) return 1;
+    batch = newbatch(L, context, 4*n, sizeof(probeall_t) + n*sizeof(probe_t), &extra); /* at 6 */
+    pa = (probeall_t*)extra;
+    pa->n = n;
+    pa->open = open;
+    pa->strings = strings;
+    pa->config = config;
+    pa->errref = LUA_NOREF;
+    pa->probe = (probe_t*)(pa + 1);
+    for(i = 0; i < n; i++)
+        {
+        pa->probe[i].batch = batch;
+        pa->probe[i].transfer = &batch->transfer[4*i];
+        pa->probe[i].timeout = timeout;
+        pa->probe[i].langid = -1;
+        }
+
+    lua_pushcfunction(L, ProbeRun);
+    lua_pushvalue(L, 6);
+    lua_pushvalue(L, 2);
+    lua_pushvalue(L, 5);
+    lua_pushvalue(L, 4);
+    if(lua_pcall(L, 4, 0, 0) != LUA_OK)
+        {
+        BatchAbort(L, batch);
+        if(pa->errref != LUA_NOREF) luaL_unref(L, LUA_REGISTRYINDEX, pa->errref);
+        if(!open) /* close the devhandles not closed yet */
+            for(i = 0; i < n; i++)
+                if(pa->probe[i].devhandle) libusb_close(pa->probe[i].devhandle);
+        return lua_error(L);
+        }
+
+    if(pa->errref != LUA_NOREF)
+        {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, pa->errref);
+        luaL_unref(L, LUA_REGISTRYINDEX, pa->errref);
+        return lua_error(L);
+        }
+    lua_pop(L, 1); /* batch */
+    return 1;
+    }
+
 static int Get_configuration(lua_State *L)
     {
     int value;
@@ -126,10 +780,12 @@ static int Get_configuration(lua_State *L)
 
 static int Set_configuration(lua_State *L)
     {
-    devhandle_t *devhandle = checkdevhandle(L, 1, NULL);
+    ud_t *ud;
+    devhandle_t *devhandle = checkdevhandle(L, 1, &ud);
     int value = luaL_checkinteger(L, 2);
     int ec = libusb_set_configuration(devhandle, value);
     CheckError(L, ec);
+    invalidateconfigcache(L, ud->parent_ud);
     return 0;
     }
 
@@ -144,8 +800,10 @@ static int Clear_halt(lua_State *L)
 
 static int Reset_device(lua_State *L)
     {
-    devhandle_t *devhandle = checkdevhandle(L, 1, NULL);
+    ud_t *ud;
+    devhandle_t *devhandle = checkdevhandle(L, 1, &ud);
     int ec = libusb_reset_device(devhandle);
+    invalidatedevicecache(L, ud->parent_ud);
     CheckError(L, ec);
     return 0;
     }
@@ -155,10 +813,13 @@ static int Get_bos_descriptor(lua_State *L)
     ud_t *ud;
     devhandle_t *devhandle = checkdevhandle(L, 1, &ud);
     struct libusb_bos_descriptor *bos;
-    int ec = libusb_get_bos_descriptor(devhandle, &bos);
+    int ec;
+    if(CacheGet(L, ud->parent_ud, KEY_BOS)) return 1;
+    ec = libusb_get_bos_descriptor(devhandle, &bos);
     CheckError(L, ec);
     pushbosdescriptor(L, bos, ud->context);
     libusb_free_bos_descriptor(bos);
+    CacheSet(L, ud->parent_ud, KEY_BOS);
     return 1;
     }
 
@@ -208,6 +869,8 @@ static const struct luaL_Reg Methods[] =
         { "claim_interface", ClaimInterface },
         { "get_descriptor", Get_descriptor },
         { "get_string_descriptor", Get_string_descriptor },
+        { "get_strings", Get_strings },
+        { "flush_descriptor_cache", FlushCache },
         { "get_configuration", Get_configuration },
         { "set_configuration", Set_configuration },
         { "clear_halt", Clear_halt },
@@ -230,9 +893,16 @@ static const struct luaL_Reg Functions[] =
         { NULL, NULL } /* sentinel */
     };
 
+static const struct luaL_Reg ContextMethods[] = 
+    {
+        { "probe_all", ProbeAll },
+        { NULL, NULL } /* sentinel */
+    };
+
 void moonusb_open_devhandle(lua_State *L)
     {
     udata_define(L, DEVHANDLE_MT, Methods, MetaMethods);
+    udata_addmethods(L, CONTEXT_MT, ContextMethods);
     luaL_setfuncs(L, Functions, 0);
     }
 
@@ -29,6 +29,7 @@ static int freedevice(lua_State *L, ud_t *ud)
     {
     device_t *device = (device_t*)ud->handle;
     freechildren(L, DEVHANDLE_MT, ud);
+    freechildren(L, CONFIG_MT, ud);
     if(!freeuserdata(L, ud, "device")) return 0;
     /* After having deleted all devhandles, now the ref count should be 1
      * and by decrementing it to 0 libusb should delete it */
@@ -44,6 +45,70 @@ int newdevice(lua_State *L, context_t *context, device_t *device)
     ud->parent_ud = userdata(context);
     ud->context = context;
     ud->destructor = freedevice;
+    ud->ref1 = LUA_NOREF; /* config cache (see config.c) */
+    ud->ref2 = LUA_NOREF; /* descriptor cache (see devhandle.c) */
+    return 1;
+    }
+
+int getdevice(lua_State *L, context_t *context, device_t *device)
+/* Pushes the device object, creating it if it doesn't exist yet */
+    {
+    if(!userdata(device))
+        return newdevice(L, context, device);
+    pushdevice(L, device);
+    return 1;
+    }
+
+int getdevinfo(device_t *device, devinfo_t *info)
+/* Collects the device metadata that is available without opening the device
+ * (libusb retrieves it during enumeration, so no I/O is involved). */
+    {
+    int n, ec;
+    memset(info, 0, sizeof(devinfo_t));
+    info->device = device;
+    ec = libusb_get_device_descriptor(device, &info->desc);
+    if(ec) return ec;
+    info->speed = libusb_get_device_speed(device);
+    info->bus = libusb_get_bus_number(device);
+    info->address = libusb_get_device_address(device);
+    n = libusb_get_port_numbers(device, info->ports, sizeof(info->ports));
+    info->nports = n > 0 ? n : 0;
+    return 0;
+    }
+
+int pushdevinfo(lua_State *L, const devinfo_t *info)
+    {
+    int i;
+    lua_newtable(L);
+    lua_pushinteger(L, info->desc.idVendor);
+    lua_setfield(L, -2, "vendor_id");
+    lua_pushinteger(L, info->desc.idProduct);
+    lua_setfield(L, -2, "product_id");
+    pushclass(L, info->desc.bDeviceClass);
+    lua_setfield(L, -2, "class");
+    lua_pushinteger(L, info->desc.bDeviceSubClass);
+    lua_setfield(L, -2, "subclass");
+    lua_pushinteger(L, info->desc.bDeviceProtocol);
+    lua_setfield(L, -2, "protocol");
+    lua_pushinteger(L, info->desc.iManufacturer);
+    lua_setfield(L, -2, "manufacturer_index");
+    lua_pushinteger(L, info->desc.iProduct);
+    lua_setfield(L, -2, "product_index");
+    lua_pushinteger(L, info->desc.iSerialNumber);
+    lua_setfield(L, -2, "serial_number_index");
+    pushspeed(L, info->speed);
+    lua_setfield(L, -2, "speed");
+    lua_pushinteger(L, info->bus);
+    lua_setfield(L, -2, "bus_number");
+    lua_pushinteger(L, info->address);
+    lua_setfield(L, -2, "device_address");
+    lua_newtable(L);
+    for(i=0; i<info->nports; i++)
+        {
+        lua_pushinteger(L, info->ports[i]);
+        lua_rawseti(L, -2, i+1);
+        }
+    lua_setfield(L, -2, "port_numbers");
     return 1;
     }
 
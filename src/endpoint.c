@@ -0,0 +1,224 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2021 Stefano Trettel
+ *
+ * Software repository: MoonUSB, https://github.com/stetre/moonusb
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "internal.h"
+
+/* An endpoint object caches the transfer parameters of an endpoint of a claimed
+ * interface, derived once from the active configuration descriptor, so that its
+ * methods need not to validate them (or look them up) at each transfer.
+ */
+
+#define DIRECTION(endpoint) ((endpoint)->address & LIBUSB_ENDPOINT_DIR_MASK)
+
+static int freeendpoint(lua_State *L, ud_t *ud)
+    {
+    endpoint_t *endpoint = (endpoint_t*)ud->handle;
+    if(!freeuserdata(L, ud, "endpoint")) return 0;
+    Free(L, endpoint);
+    return 0;
+    }
+
+static const struct libusb_endpoint_descriptor *Search(const config_t *config, int number, int altsetting, unsigned char address)
+    {
+    int i, j, k;
+    const struct libusb_interface_descriptor *alt;
+    for(i = 0; i < config->bNumInterfaces; i++)
+        {
+        for(j = 0; j < config->interface[i].num_altsetting; j++)
+            {
+            alt = &config->interface[i].altsetting[j];
+            if(alt->bInterfaceNumber != number || alt->bAlternateSetting != altsetting) continue;
+            for(k = 0; k < alt->bNumEndpoints; k++)
+                if(alt->endpoint[k].bEndpointAddress == address) return &alt->endpoint[k];
+            return NULL;
+            }
+        }
+    return NULL;
+    }
+
+static int Create(lua_State *L)
+/* endpoint = interface:endpoint(address, [timeout]) */
+    {
+    int ec;
+    ud_t *ud, *interface_ud;
+    config_t *config;
+    endpoint_t *endpoint;
+    const struct libusb_endpoint_descriptor *desc;
+    interface_t *interface = checkinterface(L, 1, &interface_ud);
+    unsigned char address = luaL_checkinteger(L, 2);
+    unsigned int timeout = luaL_optinteger(L, 3, 0);
+    device_t *device = libusb_get_device(interface->devhandle);
+    ec = libusb_get_active_config_descriptor(device, &config);
+    CheckError(L, ec);
+    desc = Search(config, interface->number, interface->altsetting, address);
+    if(!desc)
+        { libusb_free_config_descriptor(config); return argerror(L, 2, ERR_VALUE); }
+    endpoint = MallocNoErr(L, sizeof(endpoint_t));
+    if(!endpoint)
+        { libusb_free_config_descriptor(config); return luaL_error(L, errstring(ERR_MEMORY)); }
+    endpoint->devhandle = interface->devhandle;
+    endpoint->address = address;
+    endpoint->type = desc->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK;
+    endpoint->max_packet_size = desc->wMaxPacketSize & 0x07ff;
+    endpoint->mult = 1;
+    if(endpoint->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS || endpoint->type == LIBUSB_TRANSFER_TYPE_INTERRUPT)
+        endpoint->mult += (desc->wMaxPacketSize >> 11) & 0x03;
+    endpoint->max_iso_packet_size = endpoint->max_packet_size * endpoint->mult;
+    endpoint->interval = desc->bInterval;
+    endpoint->timeout = timeout;
+    libusb_free_config_descriptor(config);
+    ud = newuserdata(L, endpoint, ENDPOINT_MT, "endpoint");
+    ud->parent_ud = interface_ud;
+    ud->context = interface_ud->context;
+    ud->destructor = freeendpoint;
+    return 1;
+    }
+
+static int OptLength(lua_State *L, int arg, endpoint_t *endpoint)
+/* The default length is one packet (or one service interval, for isochronous endpoints) */
+    {
+    int length;
+    int defval = endpoint->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS ?
+            endpoint->max_iso_packet_size : endpoint->max_packet_size;
+    length = luaL_optinteger(L, arg, defval);
+    if(length < 0) return argerror(L, arg, ERR_VALUE);
+    if(endpoint->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS)
+        {
+        if(length == 0 || endpoint->max_iso_packet_size == 0 || length % endpoint->max_iso_packet_size != 0)
+            return argerror(L, arg, ERR_LENGTH);
+        }
+    return length;
+    }
+
+static int Submit(lua_State *L)
+/* transfer = endpoint:submit(ptr, [length], func) */
+    {
+    endpoint_t *endpoint = checkendpoint(L, 1, NULL);
+    unsigned char *ptr = (unsigned char*)checklightuserdata(L, 2);
+    int length = OptLength(L, 3, endpoint);
+    if(!lua_isfunction(L, 4)) return argerror(L, 4, ERR_FUNCTION);
+    if(endpoint->type == LIBUSB_TRANSFER_TYPE_CONTROL) return luaL_error(L, errstring(ERR_OPERATION));
+    return submittransfer(L, endpoint->devhandle, endpoint->address, endpoint->type, ptr, length,
+            endpoint->max_iso_packet_size, endpoint->timeout, 4);
+    }
+
+static int Transfer(lua_State *L, int direction)
+    {
+    int ec, transferred;
+    endpoint_t *endpoint = checkendpoint(L, 1, NULL);
+    unsigned char *ptr = (unsigned char*)checklightuserdata(L, 2);
+    int length = OptLength(L, 3, endpoint);
+    unsigned int timeout = luaL_optinteger(L, 4, endpoint->timeout);
+    if(DIRECTION(endpoint) != direction) return luaL_error(L, errstring(ERR_OPERATION));
+    if(endpoint->type != LIBUSB_TRANSFER_TYPE_BULK && endpoint->type != LIBUSB_TRANSFER_TYPE_INTERRUPT)
+        return luaL_error(L, errstring(ERR_OPERATION)); /* isochronous transfers can only be asynchronous */
+    ec = synctransfer(endpoint->devhandle, endpoint->type, endpoint->address, ptr, length, &transferred, timeout);
+    CheckError(L, ec);
+    lua_pushinteger(L, transferred);
+    return 1;
+    }
+
+static int Read(lua_State *L)
+    { return Transfer(L, LIBUSB_ENDPOINT_IN); }
+
+static int Write(lua_State *L)
+    { return Transfer(L, LIBUSB_ENDPOINT_OUT); }
+
+static int Set_timeout(lua_State *L)
+    {
+    endpoint_t *endpoint = checkendpoint(L, 1, NULL);
+    endpoint->timeout = luaL_checkinteger(L, 2);
+    return 0;
+    }
+
+static int Index(lua_State *L)
+/* ep.field, or method lookup */
+    {
+    const char *key;
+    endpoint_t *endpoint = checkendpoint(L, 1, NULL);
+    lua_pushvalue(L, 2);
+    lua_rawget(L, lua_upvalueindex(1)); /* methods */
+    if(!lua_isnil(L, -1) || lua_type(L, 2) != LUA_TSTRING)
+        return 1;
+    lua_pop(L, 1);
+    key = lua_tostring(L, 2);
+    if(strcmp(key, "address") == 0)
+        lua_pushinteger(L, endpoint->address);
+    else if(strcmp(key, "direction") == 0)
+        pushdirection(L, DIRECTION(endpoint));
+    else if(strcmp(key, "transfer_type") == 0)
+        pushtransfertype(L, endpoint->type);
+    else if(strcmp(key, "max_packet_size") == 0)
+        lua_pushinteger(L, endpoint->max_packet_size);
+    else if(strcmp(key, "mult") == 0)
+        lua_pushinteger(L, endpoint->mult);
+    else if(strcmp(key, "max_iso_packet_size") == 0)
+        lua_pushinteger(L, endpoint->max_iso_packet_size);
+    else if(strcmp(key, "interval") == 0)
+        lua_pushinteger(L, endpoint->interval);
+    else if(strcmp(key, "timeout") == 0)
+        lua_pushinteger(L, endpoint->timeout);
+    else
+        lua_pushnil(L);
+    return 1;
+    }
+
+DESTROY_FUNC(endpoint)
+PARENT_FUNC(endpoint)
+
+static const struct luaL_Reg Methods[] = 
+    {
+        { "free", Destroy },
+        { "interface", Parent },
+        { "submit", Submit },
+        { "read", Read },
+        { "write", Write },
+        { "set_timeout", Set_timeout },
+        { NULL, NULL } /* sentinel */
+    };
+
+static const struct luaL_Reg MetaMethods[] = 
+    {
+        { "__gc",  Destroy },
+        { NULL, NULL } /* sentinel */
+    };
+
+static const struct luaL_Reg InterfaceMethods[] = 
+    {
+        { "endpoint", Create },
+        { NULL, NULL } /* sentinel */
+    };
+
+void moonusb_open_endpoint(lua_State *L)
+    {
+    udata_define(L, ENDPOINT_MT, Methods, MetaMethods);
+    luaL_getmetatable(L, ENDPOINT_MT);
+    lua_pushvalue(L, -1);
+    lua_pushcclosure(L, Index, 1);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+    udata_addmethods(L, INTERFACE_MT, InterfaceMethods);
+    }
+
@@ -285,6 +285,9 @@ static int Enum(lua_State *L)
     CASE(hotplugevent);
     CASE(transferstatus);
     CASE(bostype);
+    CASE(endianness);
+    CASE(hidreporttype);
+    CASE(traceevent);
 #undef CASE
     return 0;
     }
@@ -316,6 +319,22 @@ void moonusb_open_enums(lua_State *L)
     ADD(MOONUSB_TYPE_FLOAT, "float");
     ADD(MOONUSB_TYPE_DOUBLE, "double");
 
+    domain = DOMAIN_ENDIANNESS; /* non-libusb */
+    ADD(MOONUSB_ENDIANNESS_NATIVE, "native");
+    ADD(MOONUSB_ENDIANNESS_LITTLE, "little");
+    ADD(MOONUSB_ENDIANNESS_BIG, "big");
+
+    domain = DOMAIN_HID_REPORT_TYPE; /* non-libusb */
+    ADD(MOONUSB_HID_INPUT, "input");
+    ADD(MOONUSB_HID_OUTPUT, "output");
+    ADD(MOONUSB_HID_FEATURE, "feature");
+
+    domain = DOMAIN_TRACE_EVENT; /* non-libusb */
+    ADD(MOONUSB_TRACE_SUBMIT, "submit");
+    ADD(MOONUSB_TRACE_COMPLETE, "complete");
+    ADD(MOONUSB_TRACE_CANCEL, "cancel");
+    ADD(MOONUSB_TRACE_RESUBMIT, "resubmit");
+
     domain = DOMAIN_CLASS;
     ADD(CLASS_PER_INTERFACE, "per interface");
     ADD(CLASS_AUDIO, "audio");
@@ -62,6 +62,9 @@ void enums_freelist(lua_State *L, int *list);
 #define DOMAIN_HOTPLUG_EVENT            14
 #define DOMAIN_TRANSFER_STATUS          15
 #define DOMAIN_BOS_TYPE                 16
+#define DOMAIN_ENDIANNESS               17
+#define DOMAIN_HID_REPORT_TYPE          18
+#define DOMAIN_TRACE_EVENT              19
 
 /* Types for usb.sizeof() & friends */
 #define MOONUSB_TYPE_CHAR         1
@@ -75,6 +78,22 @@ void enums_freelist(lua_State *L, int *list);
 #define MOONUSB_TYPE_FLOAT        9 
 #define MOONUSB_TYPE_DOUBLE       10
 
+/* Byte orders for hostmem views & friends */
+#define MOONUSB_ENDIANNESS_NATIVE  0
+#define MOONUSB_ENDIANNESS_LITTLE  1
+#define MOONUSB_ENDIANNESS_BIG     2
+
+/* HID report types (same values as in the HID Get_Report request) */
+#define MOONUSB_HID_INPUT      1
+#define MOONUSB_HID_OUTPUT     2
+#define MOONUSB_HID_FEATURE    3
+
+/* Transfer tracer events */
+#define MOONUSB_TRACE_SUBMIT    1
+#define MOONUSB_TRACE_COMPLETE  2
+#define MOONUSB_TRACE_CANCEL    3
+#define MOONUSB_TRACE_RESUBMIT  4
+
 /* USB class codes, used instead of libusb_class_code.
  * (see https://www.usb.org/defined-class-codes). 
  */
@@ -215,6 +234,24 @@ void enums_freelist(lua_State *L, int *list);
 #define pushbostype(L, val) enums_push((L), DOMAIN_BOS_TYPE, (int)(val))
 #define valuesbostype(L) enums_values((L), DOMAIN_BOS_TYPE)
 
+#define testendianness(L, arg, err) enums_test((L), DOMAIN_ENDIANNESS, (arg), (err))
+#define optendianness(L, arg, defval) enums_opt((L), DOMAIN_ENDIANNESS, (arg), (defval))
+#define checkendianness(L, arg) enums_check((L), DOMAIN_ENDIANNESS, (arg))
+#define pushendianness(L, val) enums_push((L), DOMAIN_ENDIANNESS, (int)(val))
+#define valuesendianness(L) enums_values((L), DOMAIN_ENDIANNESS)
+
+#define testhidreporttype(L, arg, err) enums_test((L), DOMAIN_HID_REPORT_TYPE, (arg), (err))
+#define opthidreporttype(L, arg, defval) enums_opt((L), DOMAIN_HID_REPORT_TYPE, (arg), (defval))
+#define checkhidreporttype(L, arg) enums_check((L), DOMAIN_HID_REPORT_TYPE, (arg))
+#define pushhidreporttype(L, val) enums_push((L), DOMAIN_HID_REPORT_TYPE, (int)(val))
+#define valueshidreporttype(L) enums_values((L), DOMAIN_HID_REPORT_TYPE)
+
+#define testtraceevent(L, arg, err) enums_test((L), DOMAIN_TRACE_EVENT, (arg), (err))
+#define opttraceevent(L, arg, defval) enums_opt((L), DOMAIN_TRACE_EVENT, (arg), (defval))
+#define checktraceevent(L, arg) enums_check((L), DOMAIN_TRACE_EVENT, (arg))
+#define pushtraceevent(L, val) enums_push((L), DOMAIN_TRACE_EVENT, (int)(val))
+#define valuestraceevent(L) enums_values((L), DOMAIN_TRACE_EVENT)
+
 #if 0 /* scaffolding 8yy */
 #define testxxx(L, arg, err) enums_test((L), DOMAIN_XXX, (arg), (err))
 #define optxxx(L, arg, defval) enums_opt((L), DOMAIN_XXX, (arg), (defval))
@@ -0,0 +1,519 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2021 Stefano Trettel
+ *
+ * Software repository: MoonUSB, https://github.com/stetre/moonusb
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "internal.h"
+
+/* HID report descriptor parser and report decoder.
+ * (Ref. Device Class Definition for HID 1.11, sec. 6.2.2).
+ */
+
+typedef moonusb_hidfield_t field_t;
+
+#define MAX_GLOBAL_STACK 8
+#define MAX_REPORT_COUNT 4096 /* bounds the number of fields a single main item can add */
+#define MAX_REPORT_BITS (65536*8) /* bounds the size of a report */
+
+typedef struct { /* global items state */
+    uint32_t usage_page;
+    int32_t logical_min, logical_max;
+    uint32_t report_size, report_count, report_id;
+} globals_t;
+
+typedef struct { /* local items state */
+    uint32_t *usage;
+    size_t nusages, maxusages;
+    uint32_t usage_min, usage_max;
+    int has_min, has_max;
+} locals_t;
+
+typedef struct {
+    globals_t global[MAX_GLOBAL_STACK];
+    int top; /* current globals = global[top] */
+    locals_t local;
+    field_t *field;
+    int nfields, maxfields;
+} parser_t;
+
+static int freehid(lua_State *L, ud_t *ud)
+    {
+    hid_t *hid = (hid_t*)ud->handle;
+    if(!freeuserdata(L, ud, "hid")) return 0;
+    if(hid->field) Free(L, hid->field);
+    if(hid->input) Free(L, hid->input);
+    if(hid->prev) Free(L, hid->prev);
+    Free(L, hid);
+    return 0;
+    }
+
+static void ParserFree(lua_State *L, parser_t *p)
+    {
+    if(p->local.usage) Free(L, p->local.usage);
+    if(p->field) Free(L, p->field);
+    }
+
+static int AddUsage(lua_State *L, locals_t *local, uint32_t usage)
+    {
+    uint32_t *usages;
+    if(local->nusages == local->maxusages)
+        {
+        local->maxusages = local->maxusages ? 2*local->maxusages : 16;
+        usages = (uint32_t*)MallocNoErr(L, local->maxusages*sizeof(uint32_t));
+        if(!usages) return ERR_MEMORY;
+        if(local->usage)
+            {
+            memcpy(usages, local->usage, local->nusages*sizeof(uint32_t));
+            Free(L, local->usage);
+            }
+        local->usage = usages;
+        }
+    local->usage[local->nusages++] = usage;
+    return 0;
+    }
+
+static field_t *AddField(lua_State *L, parser_t *p)
+    {
+    field_t *field;
+    if(p->nfields == p->maxfields)
+        {
+        p->maxfields = p->maxfields ? 2*p->maxfields : 64;
+        field = (field_t*)MallocNoErr(L, p->maxfields*sizeof(field_t));
+        if(!field) return NULL;
+        if(p->field)
+            {
+            memcpy(field, p->field, p->nfields*sizeof(field_t));
+            Free(L, p->field);
+            }
+        p->field = field;
+        }
+    field = &p->field[p->nfields++];
+    memset(field, 0, sizeof(field_t));
+    return field;
+    }
+
+static uint32_t FullUsage(globals_t *g, uint32_t usage)
+/* Usages given with less than 4 bytes refer to the current usage page */
+    {
+    return (usage & 0xffff0000) ? usage : (g->usage_page << 16) | usage;
+    }
+
+static int MainItem(lua_State *L, parser_t *p, hid_t *hid, int type, uint32_t flags)
+    {
+    uint32_t i, *bitpos;
+    field_t *field;
+    globals_t *g = &p->global[p->top];
+    locals_t *local = &p->local;
+    if(g->report_size > 64 || g->report_id > 255 || g->report_count > MAX_REPORT_COUNT)
+        return ERR_RANGE;
+    if(g->report_size == 0 && g->report_count > 0) /* 0-bit fields can't be decoded */
+        return ERR_RANGE;
+    bitpos = &hid->bitsize[type-1][g->report_id];
+    if(g->report_id != 0 && *bitpos == 0)
+        *bitpos = 8; /* the first byte carries the report id */
+    if(*bitpos + (uint64_t)g->report_size*g->report_count > MAX_REPORT_BITS)
+        return ERR_RANGE;
+    for(i = 0; i < g->report_count; i++)
+        {
+        if(!(flags & 0x01)) /* not constant (padding) */
+            {
+            if((field = AddField(L, p)) == NULL)
+                return ERR_MEMORY;
+            field->type = type;
+            field->report_id = g->report_id;
+            field->flags = flags;
+            field->bitoffset = *bitpos;
+            field->bitsize = g->report_size;
+            field->logical_min = g->logical_min;
+            field->logical_max = g->logical_max;
+            if(local->has_min && local->has_max)
+                {
+                field->usage_min = FullUsage(g, local->usage_min);
+                field->usage_max = FullUsage(g, local->usage_max);
+                }
+            else if(local->nusages > 0)
+                {
+                field->usage_min = FullUsage(g, local->usage[0]);
+                field->usage_max = FullUsage(g, local->usage[local->nusages-1]);
+                }
+            if(flags & 0x02) /* variable */
+                {
+                if(local->nusages > 0)
+                    field->usage = FullUsage(g, local->usage[i < local->nusages ? i : local->nusages-1]);
+                else if(local->has_min)
+                    {
+                    field->usage = field->usage_min + i;
+                    if(local->has_max && field->usage > field->usage_max)
+                        field->usage = field->usage_max;
+                    }
+                }
+            }
+        *bitpos += g->report_size;
+        }
+    return 0;
+    }
+
+static int Parse(lua_State *L, parser_t *p, hid_t *hid, const unsigned char *data, size_t len)
+    {
+    int err;
+    size_t pos = 0, size;
+    unsigned int tag, itemtype;
+    uint32_t u;
+    int32_t s;
+    globals_t *g;
+    while(pos < len)
+        {
+        unsigned char prefix = data[pos];
+        if(prefix == 0xfe) /* long item: skip */
+            {
+            if(pos + 2 >= len) return ERR_LENGTH;
+            pos += 3 + data[pos+1];
+            continue;
+            }
+        size = prefix & 0x03;
+        if(size == 3) size = 4;
+        itemtype = (prefix >> 2) & 0x03;
+        tag = prefix >> 4;
+        if(pos + 1 + size > len) return ERR_LENGTH;
+        u = 0;
+        switch(size)
+            {
+            case 4: u |= (uint32_t)data[pos+4] << 24; u |= (uint32_t)data[pos+3] << 16; /* fallthrough */
+            case 2: u |= (uint32_t)data[pos+2] << 8; /* fallthrough */
+            case 1: u |= data[pos+1];
+            }
+        s = size == 1 ? (int8_t)u : size == 2 ? (int16_t)u : (int32_t)u;
+        pos += 1 + size;
+        g = &p->global[p->top];
+        switch(itemtype)
+            {
+            case 0: /* main */
+                switch(tag)
+                    {
+                    case 0x8: err = MainItem(L, p, hid, MOONUSB_HID_INPUT, u); break;
+                    case 0x9: err = MainItem(L, p, hid, MOONUSB_HID_OUTPUT, u); break;
+                    case 0xb: err = MainItem(L, p, hid, MOONUSB_HID_FEATURE, u); break;
+                    default: err = 0; /* collection, end collection */
+                    }
+                if(err) return err;
+                /* local items apply only to the next main item */
+                p->local.nusages = 0;
+                p->local.has_min = p->local.has_max = 0;
+                break;
+            case 1: /* global */
+                switch(tag)
+                    {
+                    case 0x0: g->usage_page = u; break;
+                    case 0x1: g->logical_min = s; break;
+                    case 0x2: g->logical_max = s;
+                        /* a non-negative range may use the full unsigned size */
+                        if(g->logical_min >= 0 && s < 0) g->logical_max = (int32_t)(u & 0x7fffffff);
+                        break;
+                    case 0x7: g->report_size = u; break;
+                    case 0x8: if(u == 0 || u > 255) return ERR_RANGE;
+                        g->report_id = u; hid->has_report_ids = 1; break;
+                    case 0x9: g->report_count = u; break;
+                    case 0xa: /* push */
+                        if(p->top == MAX_GLOBAL_STACK-1) return ERR_RANGE;
+                        p->global[p->top+1] = *g; p->top++; break;
+                    case 0xb: /* pop */
+                        if(p->top == 0) return ERR_RANGE;
+                        p->top--; break;
+                    default: break; /* physical min/max, unit exponent, unit */
+                    }
+                break;
+            case 2: /* local */
+                switch(tag)
+                    {
+                    case 0x0: /* usage */
+                        if(size < 4) u &= 0xffff;
+                        if((err = AddUsage(L, &p->local, u)) != 0) return err;
+                        break;
+                    case 0x1: p->local.usage_min = size < 4 ? u & 0xffff : u; p->local.has_min = 1; break;
+                    case 0x2: p->local.usage_max = size < 4 ? u & 0xffff : u; p->local.has_max = 1; break;
+                    default: break; /* designators, strings, delimiters */
+                    }
+                break;
+            default: return ERR_VALUE; /* reserved */
+            }
+        }
+    return 0;
+    }
+
+static int IndexInputFields(lua_State *L, hid_t *hid)
+/* Groups the indices of input fields by report id (counting sort) */
+    {
+    int i, id, n;
+    int count[257];
+    memset(count, 0, sizeof(count));
+    for(i = 0; i < hid->nfields; i++)
+        if(hid->field[i].type == MOONUSB_HID_INPUT) count[hid->field[i].report_id+1]++;
+    for(id = 1; id < 257; id++) count[id] += count[id-1];
+    memcpy(hid->input_first, count, sizeof(count));
+    n = count[256];
+    if(n == 0) return 0;
+    hid->input = (int*)MallocNoErr(L, n*sizeof(int));
+    if(!hid->input) return ERR_MEMORY;
+    for(i = 0; i < hid->nfields; i++)
+        if(hid->field[i].type == MOONUSB_HID_INPUT)
+            hid->input[count[hid->field[i].report_id]++] = i;
+    return 0;
+    }
+
+static const unsigned char *CheckData(lua_State *L, int arg, size_t *len)
+/* Accepts either a binary string or an hostmem */
+    {
+    hostmem_t *hostmem;
+    if(lua_type(L, arg) == LUA_TSTRING)
+        return (const unsigned char*)lua_tolstring(L, arg, len);
+    hostmem = checkhostmem(L, arg, NULL);
+    *len = hostmem->size;
+    return hostmem->ptr;
+    }
+
+static int Create(lua_State *L)
+/* hid = hid_parse(descriptor) */
+    {
+    int i, err;
+    ud_t *ud;
+    hid_t *hid;
+    parser_t p;
+    size_t len;
+    const unsigned char *data = CheckData(L, 1, &len);
+    hid = (hid_t*)MallocNoErr(L, sizeof(hid_t));
+    if(!hid) return errmemory(L);
+    memset(hid, 0, sizeof(hid_t));
+    memset(&p, 0, sizeof(p));
+    err = Parse(L, &p, hid, data, len);
+    if(!err)
+        {
+        hid->nfields = p.nfields;
+        hid->field = p.field;
+        p.field = NULL;
+        err = IndexInputFields(L, hid);
+        }
+    if(!err && hid->nfields > 0)
+        {
+        hid->prev = (lua_Integer*)MallocNoErr(L, hid->nfields*sizeof(lua_Integer));
+        if(!hid->prev) err = ERR_MEMORY;
+        else for(i = 0; i < hid->nfields; i++) hid->prev[i] = LUA_MININTEGER; /* never decoded */
+        }
+    ParserFree(L, &p);
+    if(err)
+        {
+        if(hid->field) Free(L, hid->field);
+        if(hid->input) Free(L, hid->input);
+        if(hid->prev) Free(L, hid->prev);
+        Free(L, hid);
+        return luaL_error(L, "invalid report descriptor (%s)", errstring(err));
+        }
+    ud = newuserdata(L, hid, HID_MT, "hid");
+    ud->parent_ud = NULL;
+    ud->destructor = freehid;
+    return 1;
+    }
+
+static lua_Integer FieldValue(field_t *field, const unsigned char *report)
+    {
+    uint64_t val = getbits(report, field->bitoffset, field->bitsize);
+    if(field->logical_min < 0 && field->bitsize < 64 && (val & ((uint64_t)1 << (field->bitsize-1))))
+        val |= ~(uint64_t)0 << field->bitsize; /* sign extension */
+    return (lua_Integer)val;
+    }
+
+static int Decode(lua_State *L)
+/* dst, nchanged, report_id = hid:decode(report, [dst], [changed]) */
+    {
+    int i, k, first, last, nchanged = 0;
+    size_t len;
+    lua_Integer val;
+    hid_t *hid = checkhid(L, 1, NULL);
+    const unsigned char *report = CheckData(L, 2, &len);
+    view_t *view = NULL;
+    int report_id = 0;
+    int changed;
+    lua_settop(L, 4); /* so that a missing dst can be replaced at index 3 */
+    changed = !lua_isnoneornil(L, 4);
+    if(changed) luaL_checktype(L, 4, LUA_TTABLE);
+    if(lua_isnoneornil(L, 3))
+        {
+        lua_newtable(L);
+        lua_replace(L, 3);
+        }
+    else if((view = testview(L, 3, NULL)) == NULL)
+        luaL_checktype(L, 3, LUA_TTABLE);
+    if(hid->has_report_ids)
+        {
+        if(len < 1) return argerror(L, 2, ERR_LENGTH);
+        report_id = report[0];
+        }
+    if(len*8 < hid->bitsize[MOONUSB_HID_INPUT-1][report_id])
+        return argerror(L, 2, ERR_LENGTH);
+    first = hid->input_first[report_id];
+    last = hid->input_first[report_id+1];
+    if(view && last > first && (size_t)hid->input[last-1] >= view->count)
+        return argerror(L, 3, ERR_LENGTH);
+    for(k = first; k < last; k++)
+        {
+        i = hid->input[k];
+        val = FieldValue(&hid->field[i], report);
+        if(view)
+            {
+            lua_pushinteger(L, val);
+            toelem(L, -1, view->type, view->ptr + i*view->elemsize, view->swap);
+            lua_pop(L, 1);
+            }
+        else
+            {
+            lua_pushinteger(L, val);
+            lua_rawseti(L, 3, i+1);
+            }
+        if(val != hid->prev[i])
+            {
+            hid->prev[i] = val;
+            nchanged++;
+            if(changed)
+                {
+                lua_pushinteger(L, i+1);
+                lua_rawseti(L, 4, nchanged);
+                }
+            }
+        }
+    if(changed) /* clear any stale entries left from previous calls */
+        {
+        for(k = lua_rawlen(L, 4); k > nchanged; k--)
+            {
+            lua_pushnil(L);
+            lua_rawseti(L, 4, k);
+            }
+        }
+    lua_pushvalue(L, 3);
+    lua_pushinteger(L, nchanged);
+    lua_pushinteger(L, report_id);
+    return 3;
+    }
+
+static int Fields(lua_State *L)
+/* { fieldinfo } = hid:fields() */
+    {
+    int i;
+    field_t *field;
+    hid_t *hid = checkhid(L, 1, NULL);
+    lua_createtable(L, hid->nfields, 0);
+    for(i = 0; i < hid->nfields; i++)
+        {
+        field = &hid->field[i];
+        lua_newtable(L);
+        pushhidreporttype(L, field->type); lua_setfield(L, -2, "report_type");
+        lua_pushinteger(L, field->report_id); lua_setfield(L, -2, "report_id");
+        if(field->flags & 0x02) /* variable */
+            {
+            lua_pushinteger(L, field->usage >> 16); lua_setfield(L, -2, "usage_page");
+            lua_pushinteger(L, field->usage & 0xffff); lua_setfield(L, -2, "usage");
+            }
+        else
+            {
+            lua_pushinteger(L, field->usage_min >> 16); lua_setfield(L, -2, "usage_page");
+            lua_pushinteger(L, field->usage_min & 0xffff); lua_setfield(L, -2, "usage_min");
+            lua_pushinteger(L, field->usage_max & 0xffff); lua_setfield(L, -2, "usage_max");
+            }
+        lua_pushinteger(L, field->logical_min); lua_setfield(L, -2, "logical_min");
+        lua_pushinteger(L, field->logical_max); lua_setfield(L, -2, "logical_max");
+        lua_pushinteger(L, field->bitoffset); lua_setfield(L, -2, "bit_offset");
+        lua_pushinteger(L, field->bitsize); lua_setfield(L, -2, "bit_size");
+        lua_pushboolean(L, field->flags & 0x02); lua_setfield(L, -2, "variable");
+        lua_pushboolean(L, field->flags & 0x04); lua_setfield(L, -2, "relative");
+        lua_pushinteger(L, field->flags); lua_setfield(L, -2, "flags");
+        lua_rawseti(L, -2, i+1);
+        }
+    return 1;
+    }
+
+static int ReportSize(lua_State *L)
+/* nbytes = hid:report_size(report_type, [report_id=0]) */
+    {
+    hid_t *hid = checkhid(L, 1, NULL);
+    int type = checkhidreporttype(L, 2);
+    lua_Integer id = luaL_optinteger(L, 3, 0);
+    if(id < 0 || id > 255)
+        return argerror(L, 3, ERR_RANGE);
+    lua_pushinteger(L, (hid->bitsize[type-1][id] + 7)/8);
+    return 1;
+    }
+
+static int ReportIds(lua_State *L)
+/* { report_id } = hid:report_ids(report_type) */
+    {
+    int id, n = 0;
+    hid_t *hid = checkhid(L, 1, NULL);
+    int type = checkhidreporttype(L, 2);
+    lua_newtable(L);
+    for(id = 0; id < 256; id++)
+        {
+        if(hid->bitsize[type-1][id] == 0) continue;
+        lua_pushinteger(L, id);
+        lua_rawseti(L, -2, ++n);
+        }
+    return 1;
+    }
+
+static int Reset(lua_State *L)
+/* Forgets the previously decoded values, so that the next decode reports all fields as changed */
+    {
+    int i;
+    hid_t *hid = checkhid(L, 1, NULL);
+    for(i = 0; i < hid->nfields; i++) hid->prev[i] = LUA_MININTEGER;
+    return 0;
+    }
+
+DESTROY_FUNC(hid)
+
+static const struct luaL_Reg Methods[] = 
+    {
+        { "free", Destroy },
+        { "decode", Decode },
+        { "fields", Fields },
+        { "report_size", ReportSize },
+        { "report_ids", ReportIds },
+        { "reset", Reset },
+        { NULL, NULL } /* sentinel */
+    };
+
+static const struct luaL_Reg MetaMethods[] = 
+    {
+        { "__gc",  Destroy },
+        { NULL, NULL } /* sentinel */
+    };
+
+static const struct luaL_Reg Functions[] = 
+    {
+        { "hid_parse", Create },
+        { NULL, NULL } /* sentinel */
+    };
+
+void moonusb_open_hid(lua_State *L)
+    {
+    udata_define(L, HID_MT, Methods, MetaMethods);
+    luaL_setfuncs(L, Functions, 0);
+    }
+
@@ -26,6 +26,13 @@
 #include "internal.h"
 
 #if defined(LINUX)
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #define AlignedAlloc aligned_alloc
 #define AlignedFree  free
 #elif defined(MINGW)
@@ -59,12 +66,23 @@ static int freehostmem(lua_State *L, ud_t *ud)
     ud_t *parent_ud = ud->parent_ud;
     int dma = IsDma(ud);
     int allocated = IsAllocated(ud);
+    int mapped = IsMapped(ud);
+    freechildren(L, VIEW_MT, ud);
     if(!freeuserdata(L, ud, "hostmem")) return 0;
     if(allocated)
         {
         devhandle = parent_ud ? (devhandle_t*)parent_ud->handle : NULL;
         FreeMem(dma ? devhandle : NULL, hostmem->ptr, hostmem->size);
         }
+#if defined(LINUX)
+    if(mapped)
+        {
+        munmap(hostmem->ptr, hostmem->size);
+        close(hostmem->fd);
+        }
+#else
+    (void)mapped;
+#endif
     Free(L, hostmem);
     return 0;
     }
@@ -187,6 +205,133 @@ static int CreateHostmem(lua_State *L)
     return 1;
     }
 
+/*------------------------------------------------------------------------------*
+ | Shared memory                                                                |
+ *------------------------------------------------------------------------------*/
+
+#if defined(LINUX)
+
+static int CreateMapped(lua_State *L, int fd, size_t size, off_t offset)
+/* Maps size bytes of the file fd, starting from offset, and creates a hostmem
+ * object for them. The hostmem takes ownership of fd (also on error).
+ * The object is created before mapping, so that the mapping can't be leaked
+ * by an error raised while creating it.
+ */
+    {
+    ud_t *ud;
+    hostmem_t* hostmem;
+    unsigned char *ptr;
+    hostmem = (hostmem_t*)MallocNoErr(L, sizeof(hostmem_t));
+    if(!hostmem)
+        {
+        close(fd);
+        return luaL_error(L, errstring(ERR_MEMORY));
+        }
+    hostmem->fd = fd;
+    ud = newhostmem(L, hostmem, NULL); /* not yet marked as mapped */
+    ptr = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, offset);
+    if(ptr == MAP_FAILED)
+        {
+        int errnum = errno;
+        close(fd);
+        ud->destructor(L, ud);
+        return luaL_error(L, "%s", strerror(errnum));
+        }
+    hostmem->ptr = ptr;
+    hostmem->size = size;
+    MarkMapped(ud);
+    return 1;
+    }
+
+static int CreateMemfd(lua_State *L)
+    {
+    int fd;
+    size_t size = luaL_checkinteger(L, 1);
+    const char *name = luaL_optstring(L, 2, "moonusb");
+    if(size == 0)
+        return luaL_argerror(L, 1, errstring(ERR_VALUE));
+    fd = memfd_create(name, MFD_CLOEXEC);
+    if(fd < 0)
+        return luaL_error(L, "%s", strerror(errno));
+    if(ftruncate(fd, size) != 0)
+        {
+        close(fd);
+        return luaL_error(L, "%s", strerror(errno));
+        }
+    return CreateMapped(L, fd, size, 0);
+    }
+
+static int ImportFd(lua_State *L)
+    {
+    struct stat st;
+    int fd = luaL_checkinteger(L, 1);
+    size_t size = luaL_checkinteger(L, 2);
+    off_t offset = luaL_optinteger(L, 3, 0);
+    if(size == 0)
+        return luaL_argerror(L, 2, errstring(ERR_VALUE));
+    if(offset < 0)
+        return luaL_argerror(L, 3, errstring(ERR_VALUE));
+    /* mapping past the end of the file would raise SIGBUS on access */
+    if(fstat(fd, &st) != 0)
+        return luaL_error(L, "%s", strerror(errno));
+    if((uint64_t)offset > (uint64_t)st.st_size || size > (uint64_t)(st.st_size - offset))
+        return luaL_error(L, errstring(ERR_BOUNDARIES));
+    /* the hostmem keeps its own duplicate, so the caller may close fd */
+    fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if(fd < 0)
+        return luaL_error(L, "%s", strerror(errno));
+    return CreateMapped(L, fd, size, offset);
+    }
+
+static int ExportFd(lua_State *L)
+    {
+    ud_t *ud;
+    hostmem_t* hostmem = checkhostmem(L, 1, &ud);
+    if(!IsMapped(ud))
+        return luaL_argerror(L, 1, "hostmem is not backed by a file descriptor");
+    lua_pushinteger(L, hostmem->fd);
+    return 1;
+    }
+
+static uint64_t *CheckAtomic(lua_State *L, hostmem_t *hostmem, size_t offset)
+/* Returns a pointer to the (naturally aligned) uint64_t at offset */
+    {
+    if((offset >= hostmem->size) || (sizeof(uint64_t) > hostmem->size - offset))
+        { luaL_error(L, errstring(ERR_BOUNDARIES)); return NULL; }
+    if(((uintptr_t)(hostmem->ptr + offset) % sizeof(uint64_t)) != 0)
+        { luaL_error(L, "misaligned offset"); return NULL; }
+    return (uint64_t*)(hostmem->ptr + offset);
+    }
+
+static int AtomicGet(lua_State *L)
+    {
+    hostmem_t* hostmem = checkhostmem(L, 1, NULL);
+    size_t offset = luaL_checkinteger(L, 2);
+    uint64_t *ptr = CheckAtomic(L, hostmem, offset);
+    lua_pushinteger(L, __atomic_load_n(ptr, __ATOMIC_ACQUIRE));
+    return 1;
+    }
+
+static int AtomicSet(lua_State *L)
+    {
+    hostmem_t* hostmem = checkhostmem(L, 1, NULL);
+    size_t offset = luaL_checkinteger(L, 2);
+    uint64_t value = luaL_checkinteger(L, 3);
+    uint64_t *ptr = CheckAtomic(L, hostmem, offset);
+    __atomic_store_n(ptr, value, __ATOMIC_RELEASE);
+    return 0;
+    }
+
+#else
+
+#define CreateMemfd notsupported
+#define ImportFd notsupported
+#define ExportFd notsupported
+#define AtomicGet notsupported
+#define AtomicSet notsupported
+
+#endif
+
 static int WriteData(lua_State *L)
     {
     size_t size;
@@ -312,6 +457,153 @@ static int Read(lua_State *L)
     return 1;
     }
 
+static int ReadInto(lua_State *L)
+/* n = hostmem:read_into(offset, nbytes, type, dst, [dstoffset]) */
+    {
+    int type;
+    lua_Integer base;
+    hostmem_t* hostmem = checkhostmem(L, 1, NULL);
+    size_t offset = luaL_optinteger(L, 2, 0);
+    size_t size = luaL_optinteger(L, 3, hostmem->size - offset);
+    if((offset >= hostmem->size) || (size > hostmem->size - offset))
+        return luaL_error(L, errstring(ERR_BOUNDARIES));
+    type = checktype(L, 4);
+    luaL_checktype(L, 5, LUA_TTABLE);
+    base = luaL_optinteger(L, 6, 0);
+    if(base < 0)
+        return argerror(L, 6, ERR_VALUE);
+    if(size > 0)
+        unpackinto(L, type, hostmem->ptr + offset, size, 5, base);
+    lua_pushinteger(L, size/sizeoftype(type));
+    return 1;
+    }
+
+/*------------------------------------------------------------------------------*
+ | File descriptor I/O                                                          |
+ *------------------------------------------------------------------------------*/
+
+#if defined(LINUX)
+
+static int PushIOResult(lua_State *L, ssize_t n)
+/* Pushes the no. of bytes transferred, or nil if the operation would block.
+ * Other errors are raised.
+ */
+    {
+    if(n >= 0)
+        { lua_pushinteger(L, n); return 1; }
+    if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        { lua_pushnil(L); return 1; }
+    return luaL_error(L, "%s", strerror(errno));
+    }
+
+static unsigned char *CheckRange(lua_State *L, int arg, hostmem_t *hostmem, size_t *size)
+/* Checks the optional offset and size at arg and arg+1 */
+    {
+    size_t offset = luaL_optinteger(L, arg, 0);
+    if(offset > hostmem->size)
+        { luaL_error(L, errstring(ERR_BOUNDARIES)); return NULL; }
+    *size = luaL_optinteger(L, arg+1, hostmem->size - offset);
+    if(*size > hostmem->size - offset) /* offset == hostmem->size is ok if size is 0 */
+        { luaL_error(L, errstring(ERR_BOUNDARIES)); return NULL; }
+    return hostmem->ptr + offset;
+    }
+
+static int Write_to_fd(lua_State *L)
+    {
+    size_t size;
+    hostmem_t* hostmem = checkhostmem(L, 1, NULL);
+    int fd = luaL_checkinteger(L, 2);
+    unsigned char *ptr = CheckRange(L, 3, hostmem, &size);
+    if(size == 0)
+        { lua_pushinteger(L, 0); return 1; }
+    return PushIOResult(L, write(fd, ptr, size));
+    }
+
+static int Read_from_fd(lua_State *L)
+    {
+    size_t size;
+    off_t fileoffset;
+    hostmem_t* hostmem = checkhostmem(L, 1, NULL);
+    int fd = luaL_checkinteger(L, 2);
+    unsigned char *ptr = CheckRange(L, 3, hostmem, &size);
+    if(size == 0)
+        { lua_pushinteger(L, 0); return 1; }
+    if(lua_isnoneornil(L, 5))
+        return PushIOResult(L, read(fd, ptr, size));
+    fileoffset = luaL_checkinteger(L, 5);
+    return PushIOResult(L, pread(fd, ptr, size, fileoffset));
+    }
+
+static struct iovec *CheckIovecList(lua_State *L, int arg, int *count)
+/* Checks a list of {hostmem, offset, size} tuples and converts it to an array
+ * of iovec. The array is a userdata left on the top of the stack, so that it is
+ * collected also if an error is raised.
+ */
+    {
+    int i;
+    size_t size;
+    hostmem_t *hostmem;
+    struct iovec *iov;
+    luaL_checktype(L, arg, LUA_TTABLE);
+    *count = luaL_len(L, arg);
+    if(*count == 0) { argerror(L, arg, ERR_EMPTY); return NULL; }
+    if(*count > IOV_MAX) { argerror(L, arg, ERR_LENGTH); return NULL; }
+    iov = (struct iovec*)lua_newuserdata(L, (*count)*sizeof(struct iovec));
+    for(i = 0; i < *count; i++)
+        {
+        lua_rawgeti(L, arg, i+1);
+        if(lua_type(L, -1) != LUA_TTABLE)
+            { argerror(L, arg, ERR_ELEMTYPE); return NULL; }
+        lua_rawgeti(L, -1, 1);
+        hostmem = testhostmem(L, -1, NULL);
+        lua_pop(L, 1);
+        if(!hostmem)
+            { argerror(L, arg, ERR_ELEMTYPE); return NULL; }
+        lua_rawgeti(L, -1, 2);
+        lua_rawgeti(L, -2, 3);
+        iov[i].iov_base = CheckRange(L, lua_gettop(L)-1, hostmem, &size);
+        iov[i].iov_len = size;
+        lua_pop(L, 3);
+        }
+    return iov;
+    }
+
+static int Writev(lua_State *L)
+    {
+    int count;
+    ssize_t n;
+    int fd = luaL_checkinteger(L, 1);
+    struct iovec *iov = CheckIovecList(L, 2, &count);
+    n = writev(fd, iov, count);
+    return PushIOResult(L, n);
+    }
+
+static int Readv(lua_State *L)
+    {
+    int count;
+    ssize_t n;
+    off_t fileoffset;
+    int fd = luaL_checkinteger(L, 1);
+    struct iovec *iov = CheckIovecList(L, 2, &count);
+    if(lua_isnoneornil(L, 3))
+        n = readv(fd, iov, count);
+    else
+        {
+        fileoffset = luaL_checkinteger(L, 3);
+        n = preadv(fd, iov, count, fileoffset);
+        }
+    return PushIOResult(L, n);
+    }
+
+#else
+
+#define Write_to_fd notsupported
+#define Read_from_fd notsupported
+#define Writev notsupported
+#define Readv notsupported
+
+#endif
+
 static int Ptr(lua_State *L)
     {
     hostmem_t* hostmem = checkhostmem(L, 1, NULL);
@@ -358,8 +650,14 @@ static const struct luaL_Reg Methods[] =
         { "copy", Copy },
         { "clear", Clear },
         { "read", Read },
+        { "read_into", ReadInto },
         { "ptr", Ptr },
         { "size", Size },
+        { "write_to_fd", Write_to_fd },
+        { "read_from_fd", Read_from_fd },
+        { "export_fd", ExportFd },
+        { "atomic_get", AtomicGet },
+        { "atomic_set", AtomicSet },
         { NULL, NULL } /* sentinel */
     };
 
@@ -374,7 +672,11 @@ static const struct luaL_Reg Functions[] =
         { "malloc", CreateMalloc },
         { "aligned_alloc", CreateAlignedAlloc },
         { "hostmem", CreateHostmem },
+        { "memfd_alloc", CreateMemfd },
+        { "hostmem_import_fd", ImportFd },
         { "free",  Destroy },
+        { "writev", Writev },
+        { "readv", Readv },
         { NULL, NULL } /* sentinel */
     };
 
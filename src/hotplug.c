@@ -27,11 +27,15 @@
 
 static int freehotplug(lua_State *L, ud_t *ud)
     {
+    size_t i;
     hotplug_t *hotplug = (hotplug_t*)ud->handle;
     context_t *context = ud->context;
 //  freechildren(L, _MT, ud);
     if(!freeuserdata(L, ud, "hotplug")) return 0;
     libusb_hotplug_deregister_callback(context, hotplug->cb_handle);
+    for(i = 0; i < hotplug->nqueue; i++)
+        libusb_unref_device(hotplug->queue[i].device);
+    Free(L, hotplug->queue);
     Free(L, hotplug);
     return 0;
     }
@@ -52,7 +56,11 @@ static int Callback(context_t *context, device_t *device, libusb_hotplug_event e
     if(!device_ud) /* new device, create it */
         newdevice(L, context, device); /* this also pushes the device on the stack */
     else
+        {
+        if(event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT)
+            invalidatedevicecache(L, device_ud);
         pushdevice(L, device);
+        }
     pushhotplugevent(L, event);
     rc = lua_pcall(L, 3, 1, 0);
     if(rc!=LUA_OK)
@@ -97,17 +105,138 @@ static int Hotplug_register(lua_State *L)
     return 1;
     }
 
+/*------------------------------------------------------------------------------*
+ | Queued mode                                                                  |
+ *------------------------------------------------------------------------------*/
+
+/* In queued mode, the events are not delivered to a Lua callback from within libusb's
+ * event handling. They are instead queued in C and retrieved by the script in batches
+ * with hotplug:drain(). An event is retained in the queue for at least the debounce
+ * time, and if the opposite event for the same device occurs in the meanwhile, the
+ * two cancel out (e.g. a device flapping because of a bad cable).
+ * Events are matched by device_t. Since libusb creates a new one each time a device
+ * is plugged, this cancels the 'arrived' and 'left' events of a device that was
+ * attached only briefly, while a 'left' and the following 'arrived' are both kept
+ * so that the script gets the new device_t.
+ */
+
+static void Dequeue(hotplug_t *hotplug, size_t i, size_t count)
+/* Removes count events from the queue, starting from the i-th */
+    {
+    size_t k;
+    for(k = i; k < i + count; k++)
+        libusb_unref_device(hotplug->queue[k].device);
+    hotplug->nqueue -= count;
+    memmove(hotplug->queue + i, hotplug->queue + i + count, (hotplug->nqueue - i)*sizeof(moonusb_hotplugevent_t));
+    }
+
+static int QueueCallback(context_t *context, device_t *device, libusb_hotplug_event event, void *user_data)
+    {
+#define hotplug ((hotplug_t*)(user_data))
+    size_t i;
+    ud_t *device_ud;
+    double t = now();
+    (void)context;
+    if(event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT)
+        {
+        device_ud = userdata(device);
+        if(device_ud) invalidatedevicecache(moonusb_L, device_ud);
+        }
+    /* Search for a pending opposite event for the same device, still in the debounce window */
+    for(i = hotplug->nqueue; i > 0; i--)
+        {
+        moonusb_hotplugevent_t *ev = &hotplug->queue[i-1];
+        if(t - ev->time > hotplug->debounce) break;
+        if(ev->device == device)
+            {
+            if(ev->event != (int)event)
+                { Dequeue(hotplug, i-1, 1); return 0; }
+            break;
+            }
+        }
+    if(growarray((void**)&hotplug->queue, &hotplug->maxqueue, hotplug->nqueue+1, sizeof(moonusb_hotplugevent_t)) != 0)
+        { hotplug->overflow = 1; return 0; }
+    libusb_ref_device(device);
+    hotplug->queue[hotplug->nqueue].device = device;
+    hotplug->queue[hotplug->nqueue].event = event;
+    hotplug->queue[hotplug->nqueue].time = t;
+    hotplug->nqueue++;
+    return 0;
+#undef hotplug
+    }
+
+static int Drain(lua_State *L)
+/* {device}, {event}, npending = hotplug:drain([maxevents]) */
+    {
+    ud_t *ud;
+    size_t i, n, maxevents;
+    double t = now();
+    hotplug_t *hotplug = checkhotplug(L, 1, &ud);
+    if(!hotplug->queued) return luaL_error(L, "hotplug is not in queued mode");
+    maxevents = luaL_optinteger(L, 2, 0);
+    if(hotplug->overflow)
+        { hotplug->overflow = 0; return luaL_error(L, errstring(ERR_MEMORY)); }
+    for(n = 0; n < hotplug->nqueue; n++)
+        {
+        if(maxevents > 0 && n == maxevents) break;
+        if(t - hotplug->queue[n].time < hotplug->debounce) break; /* not yet ripe */
+        }
+    lua_createtable(L, n, 0);
+    lua_createtable(L, n, 0);
+    for(i = 0; i < n; i++)
+        {
+        getdevice(L, ud->context, hotplug->queue[i].device);
+        lua_rawseti(L, -3, i+1);
+        pushhotplugevent(L, hotplug->queue[i].event);
+        lua_rawseti(L, -2, i+1);
+        }
+    Dequeue(hotplug, 0, n);
+    lua_pushinteger(L, hotplug->nqueue);
+    return 3;
+    }
+
+static int Hotplug_queue(lua_State *L)
+    {
+    ud_t *ud;
+    int ec;
+    hotplug_t *hotplug;
+    context_t *context = checkcontext(L, 1, NULL);
+    int events = LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT;
+    double debounce = luaL_optnumber(L, 2, 0);
+    int enumerate = optboolean(L, 3, 0);
+    int vendor_id = luaL_optinteger(L, 4, LIBUSB_HOTPLUG_MATCH_ANY);
+    int product_id = luaL_optinteger(L, 5, LIBUSB_HOTPLUG_MATCH_ANY);
+    int dev_class = luaL_optinteger(L, 6, LIBUSB_HOTPLUG_MATCH_ANY);
+    int flags = enumerate ? LIBUSB_HOTPLUG_ENUMERATE : 0;
+    if(debounce < 0) return argerror(L, 2, ERR_VALUE);
+    hotplug = Malloc(L, sizeof(hotplug_t));
+    hotplug->queued = 1;
+    hotplug->debounce = debounce;
+    ud = newuserdata(L, hotplug, HOTPLUG_MT, "hotplug");
+    ud->parent_ud = userdata(context);
+    ud->destructor = freehotplug;
+    ud->context = context;
+    ud->ref1 = LUA_NOREF;
+    ec = libusb_hotplug_register_callback(context, events, flags, vendor_id, product_id, 
+            dev_class, QueueCallback, hotplug, &(hotplug->cb_handle));
+    if(ec)
+        { ud->destructor(L, ud); CheckError(L, ec); return 0; }
+    return 1;
+    }
+
 DESTROY_FUNC(hotplug)
 
 static const struct luaL_Reg ContextMethods[] = 
     {
         { "hotplug_register", Hotplug_register },
+        { "hotplug_queue", Hotplug_queue },
         { NULL, NULL } /* sentinel */
     };
 
 static const struct luaL_Reg Methods[] = 
     {
         { "deregister", Destroy },
+        { "drain", Drain },
         { NULL, NULL } /* sentinel */
     };
 
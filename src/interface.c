@@ -29,7 +29,7 @@ static int freeinterface(lua_State *L, ud_t *ud)
     {
     interface_t *interface = (interface_t*)ud->handle;
     int isclaimed = IsClaimed(ud);
-//  freechildren(L, _MT, ud);
+    freechildren(L, ENDPOINT_MT, ud);
     if(!freeuserdata(L, ud, "interface")) return 0;
     if(isclaimed)
         libusb_release_interface(interface->devhandle, interface->number);
@@ -63,10 +63,14 @@ int newinterface(lua_State *L, devhandle_t *devhandle, int interface_number)
 
 static int Set_alt_setting(lua_State *L)
     {
-    interface_t *interface = checkinterface(L, 1, NULL);
+    ud_t *ud;
+    interface_t *interface = checkinterface(L, 1, &ud);
     int alt_setting = luaL_checkinteger(L, 2);
     int ec = libusb_set_interface_alt_setting(interface->devhandle, interface->number, alt_setting);
     CheckError(L, ec);
+    interface->altsetting = alt_setting;
+    /* the endpoints of the previous alternate setting are no longer valid */
+    freechildren(L, ENDPOINT_MT, ud);
     return 0;
     }
 
@@ -28,6 +28,7 @@
 
 #ifdef LINUX
 #define _ISOC11_SOURCE /* see man aligned_alloc(3) */
+#define _GNU_SOURCE /* see man preadv(2), memfd_create(2) */
 #endif
 #include <string.h>
 #include <stdlib.h>
@@ -65,11 +66,15 @@ int copytable(lua_State *L);
 int noprintf(const char *fmt, ...); 
 #define now moonusb_now
 double now(void);
+#define nowns moonusb_nowns
+uint64_t nowns(void);
 #define sleeep moonusb_sleeep
 void sleeep(double seconds);
 #define since(t) (now() - (t))
 #define notavailable moonusb_notavailable
 int notavailable(lua_State *L, ...);
+#define notsupported moonusb_notsupported
+int notsupported(lua_State *L);
 #define Malloc moonusb_Malloc
 void *Malloc(lua_State *L, size_t size);
 #define MallocNoErr moonusb_MallocNoErr
@@ -78,6 +83,8 @@ void *MallocNoErr(lua_State *L, size_t size);
 char *Strdup(lua_State *L, const char *s);
 #define Free moonusb_Free
 void Free(lua_State *L, void *ptr);
+#define growarray moonusb_growarray
+int growarray(void **array, size_t *max, size_t n, size_t elemsize);
 #define checkboolean moonusb_checkboolean
 int checkboolean(lua_State *L, int arg);
 #define testboolean moonusb_testboolean
@@ -119,16 +126,35 @@ void pushindex(lua_State *L, int val);
 #define ERR_FOPEN           -15
 #define ERR_OPERATION       -16
 #define ERR_UNKNOWN         -17
+#define ERR_OVERLAP         -18
 #define errstring moonusb_errstring
 const char* errstring(int err);
 
 /* device.c */
 #define newdevice moonusb_newdevice
 int newdevice(lua_State *L, context_t *context, device_t *device);
+#define getdevice moonusb_getdevice
+int getdevice(lua_State *L, context_t *context, device_t *device);
+#define getdevinfo moonusb_getdevinfo
+int getdevinfo(device_t *device, devinfo_t *info);
+#define pushdevinfo moonusb_pushdevinfo
+int pushdevinfo(lua_State *L, const devinfo_t *info);
+
+/* transfer.c */
+#define submittransfer moonusb_submittransfer
+int submittransfer(lua_State *L, devhandle_t *devhandle, unsigned char endpoint, int type,
+        unsigned char *ptr, int length, int iso_packet_length, unsigned int timeout, int funcarg);
+
+/* synch.c */
+#define synctransfer moonusb_synctransfer
+int synctransfer(devhandle_t *devhandle, int type, unsigned char endpoint, unsigned char *ptr,
+        int length, int *transferred, unsigned int timeout);
 
 /* devhandle.c */
 #define newdevhandle moonusb_newdevhandle
 int newdevhandle(lua_State *L, device_t *device, devhandle_t *devhandle);
+#define invalidatedevicecache moonusb_invalidatedevicecache
+void invalidatedevicecache(lua_State *L, ud_t *device_ud);
 
 /* interface.c */
 #define newinterface moonusb_newinterface
@@ -145,6 +171,18 @@ int testdata(lua_State *L, int type, size_t n, void *dst, size_t dstsize);
 int checkdata(lua_State *L, int arg, int type, void *dst, size_t dstsize);
 #define pushdata moonusb_pushdata
 int pushdata(lua_State *L, int type, void *data, size_t datalen);
+#define unpackinto moonusb_unpackinto
+int unpackinto(lua_State *L, int type, void *data, size_t datalen, int dst, lua_Integer base);
+#define needswap moonusb_needswap
+int needswap(int endianness);
+#define pushelem moonusb_pushelem
+int pushelem(lua_State *L, int type, const void *ptr, int swap);
+#define getbits moonusb_getbits
+uint64_t getbits(const unsigned char *ptr, size_t bitoffset, unsigned int nbits);
+#define setbits moonusb_setbits
+void setbits(unsigned char *ptr, size_t bitoffset, unsigned int nbits, uint64_t val);
+#define toelem moonusb_toelem
+int toelem(lua_State *L, int arg, int type, void *ptr, int swap);
 
 /* datastructs.c */
 #define checkucharlist moonusb_checkucharlist
@@ -157,14 +195,74 @@ void pushcontrolsetup(lua_State *L, const struct libusb_control_setup *s);
 int pushdevicedescriptor(lua_State *L, const struct libusb_device_descriptor *s, device_t *device, context_t *context);
 #define pushconfigdescriptor moonusb_pushconfigdescriptor
 void pushconfigdescriptor(lua_State *L, const struct libusb_config_descriptor *s, context_t *context);
+#define pushinterfacedescriptor moonusb_pushinterfacedescriptor
+void pushinterfacedescriptor(lua_State *L, const struct libusb_interface_descriptor *s, context_t *context);
+#define pushendpointdescriptor moonusb_pushendpointdescriptor
+void pushendpointdescriptor(lua_State *L, const struct libusb_endpoint_descriptor *s, context_t *context);
 #define pushbosdescriptor moonusb_pushbosdescriptor
 void pushbosdescriptor(lua_State *L, struct libusb_bos_descriptor *s, context_t *context);
 
+/* config.c */
+#define invalidateconfigcache moonusb_invalidateconfigcache
+void invalidateconfigcache(lua_State *L, ud_t *device_ud);
+#define pushactiveconfig moonusb_pushactiveconfig
+int pushactiveconfig(lua_State *L, device_t *device, ud_t *device_ud);
+
 /* tracing.c */
 #define pusherrcode moonusb_pusherrcode
 int pusherrcode(lua_State *L, int ec);
 #define trace_objects moonusb_trace_objects
 extern int trace_objects;
+#define trace_transfers moonusb_trace_transfers
+extern int trace_transfers;
+#define tracetransfer moonusb_tracetransfer
+void tracetransfer(transfer_t *transfer, int event, int status);
+#define TRACE_TRANSFER(transfer, event, status) \
+    do { if(trace_transfers) tracetransfer((transfer), (event), (status)); } while(0)
+
+/* pcap.c */
+#define pcap_enabled moonusb_pcap_enabled
+extern int pcap_enabled;
+#define pcaptransfer moonusb_pcaptransfer
+void pcaptransfer(transfer_t *transfer, int complete);
+#define pcapsync moonusb_pcapsync
+void pcapsync(devhandle_t *devhandle, int complete, int type, unsigned char endpoint,
+        unsigned char *setup, unsigned char *data, int length, int ec);
+#define PCAP_TRANSFER(transfer, complete) \
+    do { if(pcap_enabled) pcaptransfer((transfer), (complete)); } while(0)
+#define PCAP_SYNC(devhandle, complete, type, endpoint, setup, data, length, ec) do {    \
+    if(pcap_enabled) pcapsync((devhandle), (complete), (type), (endpoint), (setup), (data), (length), (ec)); \
+} while(0)
+
+/* record.c */
+#define record_enabled moonusb_record_enabled
+extern int record_enabled;
+#define recordtransfer moonusb_recordtransfer
+void recordtransfer(transfer_t *transfer, uint64_t submit_time, uint64_t complete_time);
+#define recordforget moonusb_recordforget
+void recordforget(devhandle_t *devhandle);
+#define recordsync moonusb_recordsync
+void recordsync(devhandle_t *devhandle, int type, unsigned char endpoint, unsigned char *setup,
+        unsigned char *data, int length, int actual_length, int ec, uint64_t submit_time, uint64_t latency);
+#define RECORD_TRANSFER(transfer, submit_time, complete_time) do {  \
+    if(record_enabled) recordtransfer((transfer), (submit_time), (complete_time)); \
+} while(0)
+#define RECORD_SYNC(devhandle, type, endpoint, setup, data, length, actual_length, ec, submit_time, latency) do { \
+    if(record_enabled) recordsync((devhandle), (type), (endpoint), (setup), (data), (length),   \
+            (actual_length), (ec), (submit_time), (latency));   \
+} while(0)
+
+/* stats.c */
+#define newstats moonusb_newstats
+devstats_t *newstats(lua_State *L);
+#define freestats moonusb_freestats
+void freestats(lua_State *L, devstats_t *stats);
+#define updatestats moonusb_updatestats
+void updatestats(devstats_t *stats, unsigned char endpoint, int status, int length, uint64_t latency);
+#define syncstatus moonusb_syncstatus
+int syncstatus(int ec);
+#define transferlength moonusb_transferlength
+int transferlength(transfer_t *transfer);
 
 /* main.c */
 extern lua_State *moonusb_L;
@@ -172,6 +270,9 @@ int luaopen_moonusb(lua_State *L);
 void moonusb_open_enums(lua_State *L);
 //void moonusb_open_flags(lua_State *L);
 void moonusb_open_tracing(lua_State *L);
+void moonusb_open_pcap(lua_State *L);
+void moonusb_open_record(lua_State *L);
+void moonusb_open_usbip(lua_State *L);
 void moonusb_open_context(lua_State *L);
 void moonusb_open_device(lua_State *L);
 void moonusb_open_devhandle(lua_State *L);
@@ -182,6 +283,14 @@ void moonusb_open_hotplug(lua_State *L);
 void moonusb_open_interface(lua_State *L);
 void moonusb_open_datahandling(lua_State *L);
 void moonusb_open_hostmem(lua_State *L);
+void moonusb_open_view(lua_State *L);
+void moonusb_open_convert(lua_State *L);
+void moonusb_open_codec(lua_State *L);
+void moonusb_open_hid(lua_State *L);
+void moonusb_open_config(lua_State *L);
+void moonusb_open_inventory(lua_State *L);
+void moonusb_open_endpoint(lua_State *L);
+void moonusb_open_stats(lua_State *L);
 
 /*------------------------------------------------------------------------------*
  | Debug and other utilities                                                    |
@@ -199,7 +308,6 @@ void moonusb_open_hostmem(lua_State *L);
 #define argerror(L, arg, errcode) luaL_argerror((L), (arg), errstring((errcode)))
 #define errmemory(L) luaL_error((L), errstring((ERR_MEMORY)))
 
-#define notsupported(L) luaL_error((L), "operation not supported")
 #define badvalue(L, s)   lua_pushfstring((L), "invalid value '%s'", (s))
 
 /* Reference/unreference variables on the Lua registry */
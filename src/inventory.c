@@ -0,0 +1,260 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2021 Stefano Trettel
+ *
+ * Software repository: MoonUSB, https://github.com/stetre/moonusb
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "internal.h"
+
+/* The inventory keeps track of the attached devices by means of a hotplug
+ * callback that records arrivals and departures in C, without calling into Lua.
+ * Each recorded change increments the generation counter, so that a script can
+ * ask for the changes since the last generation it has seen, instead of
+ * re-enumerating all the devices.
+ */
+
+#define DEFAULT_LOGLIMIT 1024
+
+static void TrimLog(inventory_t *inventory, size_t count)
+/* Discards the oldest count entries from the log */
+    {
+    size_t i;
+    if(count > inventory->nlog) count = inventory->nlog;
+    for(i = 0; i < count; i++)
+        libusb_unref_device(inventory->log[i].device);
+    inventory->nlog -= count;
+    memmove(inventory->log, inventory->log + count, inventory->nlog*sizeof(moonusb_inventorylog_t));
+    inventory->base += count;
+    }
+
+static void Record(inventory_t *inventory, device_t *device, int arrived)
+    {
+    if(inventory->nlog == inventory->loglimit)
+        TrimLog(inventory, inventory->loglimit/2 + 1);
+    if(growarray((void**)&inventory->log, &inventory->maxlog, inventory->nlog+1, sizeof(moonusb_inventorylog_t)) != 0)
+        { /* lose all the history, so that changes_since() requests a rescan */
+        TrimLog(inventory, inventory->nlog);
+        inventory->base++;
+        inventory->error = 1;
+        return;
+        }
+    libusb_ref_device(device);
+    inventory->log[inventory->nlog].device = device;
+    inventory->log[inventory->nlog].arrived = arrived;
+    inventory->nlog++;
+    }
+
+static devinfo_t *Search(inventory_t *inventory, device_t *device)
+    {
+    size_t i;
+    for(i = 0; i < inventory->npresent; i++)
+        if(inventory->present[i].device == device) return &inventory->present[i];
+    return NULL;
+    }
+
+static int Callback(context_t *context, device_t *device, libusb_hotplug_event event, void *user_data)
+    {
+#define inventory ((inventory_t*)(user_data))
+    ud_t *device_ud;
+    devinfo_t *info;
+    (void)context;
+    if(event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED)
+        {
+        if(Search(inventory, device)) return 0;
+        if(growarray((void**)&inventory->present, &inventory->maxpresent, inventory->npresent+1, sizeof(devinfo_t)) != 0)
+            { inventory->error = 1; return 0; }
+        info = &inventory->present[inventory->npresent];
+        if(getdevinfo(device, info) != 0) return 0;
+        libusb_ref_device(device);
+        inventory->npresent++;
+        Record(inventory, device, 1);
+        }
+    else
+        {
+        info = Search(inventory, device);
+        if(!info) return 0;
+        Record(inventory, device, 0);
+        libusb_unref_device(device);
+        *info = inventory->present[--inventory->npresent];
+        device_ud = userdata(device);
+        if(device_ud) invalidatedevicecache(moonusb_L, device_ud);
+        }
+    return 0;
+#undef inventory
+    }
+
+static int freeinventory(lua_State *L, ud_t *ud)
+    {
+    size_t i;
+    inventory_t *inventory = (inventory_t*)ud->handle;
+    context_t *context = ud->context;
+    if(!freeuserdata(L, ud, "inventory")) return 0;
+    libusb_hotplug_deregister_callback(context, inventory->cb_handle);
+    TrimLog(inventory, inventory->nlog);
+    for(i = 0; i < inventory->npresent; i++)
+        libusb_unref_device(inventory->present[i].device);
+    Free(L, inventory->log);
+    Free(L, inventory->present);
+    Free(L, inventory);
+    return 0;
+    }
+
+static int Create(lua_State *L)
+    {
+    int ec;
+    ud_t *ud;
+    inventory_t *inventory;
+    context_t *context = checkcontext(L, 1, NULL);
+    lua_Integer loglimit = luaL_optinteger(L, 2, DEFAULT_LOGLIMIT);
+    if(loglimit < 2) return argerror(L, 2, ERR_VALUE);
+    inventory = Malloc(L, sizeof(inventory_t));
+    inventory->loglimit = loglimit;
+    ud = newuserdata(L, inventory, INVENTORY_MT, "inventory");
+    ud->parent_ud = userdata(context);
+    ud->destructor = freeinventory;
+    ud->context = context;
+    /* The inventory is seeded by the ENUMERATE flag, which causes the callback
+     * to be executed for each attached device before the register function returns. */
+    ec = libusb_hotplug_register_callback(context,
+            LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+            LIBUSB_HOTPLUG_ENUMERATE, LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+            LIBUSB_HOTPLUG_MATCH_ANY, Callback, inventory, &(inventory->cb_handle));
+    if(ec)
+        { ud->destructor(L, ud); CheckError(L, ec); return 0; }
+    return 1;
+    }
+
+static inventory_t *CheckInventory(lua_State *L, int arg, ud_t **udp)
+    {
+    inventory_t *inventory = checkinventory(L, arg, udp);
+    if(inventory->error)
+        { inventory->error = 0; luaL_error(L, errstring(ERR_MEMORY)); }
+    return inventory;
+    }
+
+static int Generation(lua_State *L)
+    {
+    inventory_t *inventory = CheckInventory(L, 1, NULL);
+    lua_pushinteger(L, inventory->base + inventory->nlog);
+    return 1;
+    }
+
+static int Devices(lua_State *L)
+    {
+    size_t i;
+    ud_t *ud;
+    inventory_t *inventory = CheckInventory(L, 1, &ud);
+    lua_newtable(L);
+    for(i = 0; i < inventory->npresent; i++)
+        {
+        getdevice(L, ud->context, inventory->present[i].device);
+        lua_rawseti(L, -2, i+1);
+        }
+    lua_pushinteger(L, inventory->base + inventory->nlog);
+    return 2;
+    }
+
+static int Changes_since(lua_State *L)
+/* arrived, left, gen = inventory:changes_since(gen)
+ * A device that arrived and left (or vice versa) within the interval is not reported.
+ */
+    {
+    ud_t *ud;
+    size_t i, first;
+    int net, narrived = 0, nleft = 0;
+    inventory_t *inventory = CheckInventory(L, 1, &ud);
+    lua_Integer gen = luaL_checkinteger(L, 2);
+    lua_Integer current = inventory->base + inventory->nlog;
+    if(gen > current) return argerror(L, 2, ERR_RANGE);
+    if(gen < inventory->base) /* history lost */
+        { lua_pushnil(L); lua_pushnil(L); lua_pushinteger(L, current); return 3; }
+    first = gen - inventory->base;
+    lua_newtable(L); /* arrived */
+    lua_newtable(L); /* left */
+    lua_newtable(L); /* net changes, by device */
+    for(i = first; i < inventory->nlog; i++)
+        {
+        lua_rawgetp(L, -1, inventory->log[i].device);
+        net = lua_tointeger(L, -1) + (inventory->log[i].arrived ? 1 : -1);
+        lua_pop(L, 1);
+        lua_pushinteger(L, net);
+        lua_rawsetp(L, -2, inventory->log[i].device);
+        }
+    for(i = first; i < inventory->nlog; i++)
+        {
+        lua_rawgetp(L, -1, inventory->log[i].device);
+        net = lua_tointeger(L, -1);
+        lua_pop(L, 1);
+        if(net == 0) continue;
+        getdevice(L, ud->context, inventory->log[i].device);
+        if(net > 0)
+            lua_rawseti(L, -4, ++narrived);
+        else
+            lua_rawseti(L, -3, ++nleft);
+        lua_pushinteger(L, 0);
+        lua_rawsetp(L, -2, inventory->log[i].device);
+        }
+    lua_pop(L, 1);
+    lua_pushinteger(L, current);
+    return 3;
+    }
+
+static int Info(lua_State *L)
+    {
+    devinfo_t *info;
+    inventory_t *inventory = CheckInventory(L, 1, NULL);
+    device_t *device = checkdevice(L, 2, NULL);
+    info = Search(inventory, device);
+    if(!info) return 0;
+    return pushdevinfo(L, info);
+    }
+
+DESTROY_FUNC(inventory)
+
+static const struct luaL_Reg ContextMethods[] = 
+    {
+        { "inventory", Create },
+        { NULL, NULL } /* sentinel */
+    };
+
+static const struct luaL_Reg Methods[] = 
+    {
+        { "free", Destroy },
+        { "generation", Generation },
+        { "devices", Devices },
+        { "changes_since", Changes_since },
+        { "info", Info },
+        { NULL, NULL } /* sentinel */
+    };
+
+static const struct luaL_Reg MetaMethods[] = 
+    {
+        { "__gc",  Destroy },
+        { NULL, NULL } /* sentinel */
+    };
+
+void moonusb_open_inventory(lua_State *L)
+    {
+    udata_define(L, INVENTORY_MT, Methods, MetaMethods);
+    udata_addmethods(L, CONTEXT_MT, ContextMethods);
+    }
+
@@ -49,6 +49,9 @@ int luaopen_moonusb(lua_State *L)
     moonusb_open_enums(L);
 //  moonusb_open_flags(L);
     moonusb_open_tracing(L);
+    moonusb_open_pcap(L);
+    moonusb_open_record(L);
+    moonusb_open_usbip(L);
     moonusb_open_context(L);
     moonusb_open_device(L);
     moonusb_open_devhandle(L);
@@ -59,6 +62,14 @@ int luaopen_moonusb(lua_State *L)
     moonusb_open_interface(L);
     moonusb_open_datahandling(L);
     moonusb_open_hostmem(L);
+    moonusb_open_view(L);
+    moonusb_open_convert(L);
+    moonusb_open_codec(L);
+    moonusb_open_hid(L);
+    moonusb_open_config(L);
+    moonusb_open_inventory(L);
+    moonusb_open_endpoint(L);
+    moonusb_open_stats(L);
 
     /* Add functions implemented in Lua */
     lua_pushvalue(L, -1); lua_setglobal(L, "moonusb");
@@ -37,22 +37,154 @@
 #define hotplug_t moonusb_hotplug_t
 #define interface_t moonusb_interface_t
 #define hostmem_t moonusb_hostmem_t
+#define view_t moonusb_view_t
+#define codec_t moonusb_codec_t
+#define hid_t moonusb_hid_t
+#define config_t struct libusb_config_descriptor
+#define devinfo_t moonusb_devinfo_t
+#define endpoint_t moonusb_endpoint_t
+#define inventory_t moonusb_inventory_t
+#define epstats_t moonusb_epstats_t
+#define devstats_t moonusb_devstats_t
+#define transferinfo_t moonusb_transferinfo_t
+
+typedef struct {
+    device_t *device;
+    int event; /* LIBUSB_HOTPLUG_EVENT_XXX */
+    double time; /* when the event was queued */
+} moonusb_hotplugevent_t;
 
 typedef struct {
     libusb_hotplug_callback_handle cb_handle; /* this is unique per context */
+    /* queued mode only: */
+    int queued;
+    int overflow; /* 1 if events were lost (out of memory) */
+    double debounce; /* seconds */
+    moonusb_hotplugevent_t *queue; /* ordered by time */
+    size_t nqueue, maxqueue;
 } moonusb_hotplug_t;
 
 typedef struct {
     int number; /* bInterfaceNumber */
+    int altsetting; /* bAlternateSetting currently selected */
     devhandle_t *devhandle;
 } moonusb_interface_t;
 
+/* endpoint of a claimed interface, with its transfer parameters: */
+typedef struct {
+    devhandle_t *devhandle;
+    unsigned char address; /* bEndpointAddress */
+    int type; /* LIBUSB_TRANSFER_TYPE_XXX */
+    int max_packet_size; /* bits 0..10 of wMaxPacketSize */
+    int mult; /* no. of transactions per microframe (1..3) */
+    int max_iso_packet_size; /* max_packet_size * mult */
+    int interval; /* bInterval */
+    unsigned int timeout; /* default timeout, in milliseconds */
+} moonusb_endpoint_t;
+
+/* per-endpoint transfer statistics (see stats.c): */
+#define STATS_NBUCKETS 528 /* latency histogram buckets (up to 2^36 ns) */
+typedef struct {
+    uint64_t transfers; /* no. of completed transfers */
+    uint64_t bytes; /* sum of actual lengths */
+    uint64_t status[7]; /* no. of completions per LIBUSB_TRANSFER_XXX status */
+    uint64_t min, max, sum; /* latency (submit to completion), in nanoseconds */
+    uint32_t hist[STATS_NBUCKETS]; /* latency histogram (log-linear buckets) */
+} moonusb_epstats_t;
+
+typedef struct {
+    epstats_t *ep[32]; /* indexed by endpoint number | (direction in ? 16 : 0), allocated on first use */
+} moonusb_devstats_t;
+
+/* transfer info (the transfer's ud->info): */
+typedef struct {
+    devstats_t *stats; /* the devhandle's stats */
+    uint64_t submit_time; /* nanoseconds, see nowns() */
+    uint64_t complete_time; /* callback entry time, 0 if not completed yet */
+} moonusb_transferinfo_t;
+
 /* host accessible memory: */
 typedef struct {
     unsigned char *ptr;
     size_t size;
+    int fd; /* memfd backing the memory (mapped hostmem only) */
 } moonusb_hostmem_t;
 
+/* typed view over an hostmem: */
+typedef struct {
+    unsigned char *ptr; /* first element */
+    size_t count; /* no. of elements */
+    size_t elemsize;
+    int type; /* MOONUSB_TYPE_XXX */
+    int swap; /* 1 if elements must be byte-swapped */
+} moonusb_view_t;
+
+/* compiled struct codec: */
+typedef struct {
+    int type; /* MOONUSB_TYPE_XXX, or 0 for bitfields */
+    int swap; /* 1 if the field must be byte-swapped */
+    int issigned; /* bitfields only */
+    int skip; /* padding */
+    size_t offset; /* byte offset, or bit offset for bitfields */
+    unsigned int nbits; /* bitfields only */
+} moonusb_codecfield_t;
+
+typedef struct {
+    size_t size; /* size of the encoded struct, in bytes */
+    int nfields;
+    moonusb_codecfield_t *field;
+} moonusb_codec_t;
+
+/* HID report field (one per report count): */
+typedef struct {
+    uint32_t usage; /* (usage page << 16) | usage id, 0 for array fields */
+    uint32_t usage_min, usage_max; /* range of selectable usages (array fields) */
+    int32_t logical_min, logical_max;
+    uint32_t bitoffset; /* from the start of the report, including the report id */
+    uint8_t bitsize;
+    uint8_t type; /* MOONUSB_HID_XXX */
+    uint8_t report_id;
+    uint16_t flags; /* data bits of the main item (constant, variable, relative, ...) */
+} moonusb_hidfield_t;
+
+/* parsed HID report descriptor: */
+typedef struct {
+    int nfields;
+    moonusb_hidfield_t *field;
+    int has_report_ids;
+    uint32_t bitsize[3][256]; /* report sizes in bits, per report type and id */
+    int *input; /* indices of input fields, grouped by report id */
+    int input_first[257]; /* input[input_first[id] .. input_first[id+1]-1] */
+    lua_Integer *prev; /* last decoded value, per field */
+} moonusb_hid_t;
+
+/* device metadata (see getdevinfo in device.c): */
+typedef struct {
+    device_t *device;
+    struct libusb_device_descriptor desc;
+    int speed;
+    uint8_t bus;
+    uint8_t address;
+    uint8_t nports; /* no. of valid entries in ports[] */
+    uint8_t ports[7];
+} moonusb_devinfo_t;
+
+/* hotplug-driven device inventory: */
+typedef struct {
+    device_t *device;
+    int arrived; /* 1 = arrived, 0 = left */
+} moonusb_inventorylog_t;
+
+typedef struct {
+    libusb_hotplug_callback_handle cb_handle;
+    int error; /* 1 if an event could not be recorded (out of memory) */
+    devinfo_t *present; /* devices currently attached */
+    size_t npresent, maxpresent;
+    moonusb_inventorylog_t *log; /* log[i] is the change with generation base+i+1 */
+    size_t nlog, maxlog, loglimit;
+    lua_Integer base;
+} moonusb_inventory_t;
+
 /* Objects' metatable names */
 #define CONTEXT_MT "moonusb_context"
 #define DEVICE_MT "moonusb_device"
@@ -61,6 +193,12 @@ typedef struct {
 #define HOTPLUG_MT "moonusb_hotplug"
 #define INTERFACE_MT "moonusb_interface"
 #define HOSTMEM_MT "moonusb_hostmem"
+#define VIEW_MT "moonusb_view"
+#define CODEC_MT "moonusb_codec"
+#define HID_MT "moonusb_hid"
+#define CONFIG_MT "moonusb_config"
+#define INVENTORY_MT "moonusb_inventory"
+#define ENDPOINT_MT "moonusb_endpoint"
 
 /* Userdata memory associated with objects */
 #define ud_t moonusb_ud_t
@@ -105,6 +243,10 @@ struct moonusb_ud_s {
 #define MarkSubmitted(ud)       MarkSet((ud)->marks, 5) 
 #define CancelSubmitted(ud)     MarkReset((ud)->marks, 5)
 
+#define IsMapped(ud)            MarkGet((ud)->marks, 6)
+#define MarkMapped(ud)          MarkSet((ud)->marks, 6) 
+#define CancelMapped(ud)        MarkReset((ud)->marks, 6)
+
 #if 0
 /* .c */
 #define  moonusb_
@@ -181,6 +323,13 @@ void** checkxxxlist(lua_State *L, int arg, int *count, int *err, const char *mt)
 #define pushinterface(L, handle) pushxxx((L), (void*)(handle))
 #define checkinterfacelist(L, arg, count, err) checkxxxlist((L), (arg), (count), (err), INTERFACE_MT)
 
+/* endpoint.c */
+#define checkendpoint(L, arg, udp) (endpoint_t*)checkxxx((L), (arg), (udp), ENDPOINT_MT)
+#define testendpoint(L, arg, udp) (endpoint_t*)testxxx((L), (arg), (udp), ENDPOINT_MT)
+#define optendpoint(L, arg, udp) (endpoint_t*)optxxx((L), (arg), (udp), ENDPOINT_MT)
+#define pushendpoint(L, handle) pushxxx((L), (void*)(handle))
+#define checkendpointlist(L, arg, count, err) checkxxxlist((L), (arg), (count), (err), ENDPOINT_MT)
+
 /* hostmem.c */
 #define checkhostmem(L, arg, udp) (hostmem_t*)checkxxx((L), (arg), (udp), HOSTMEM_MT)
 #define testhostmem(L, arg, udp) (hostmem_t*)testxxx((L), (arg), (udp), HOSTMEM_MT)
@@ -188,6 +337,41 @@ void** checkxxxlist(lua_State *L, int arg, int *count, int *err, const char *mt)
 #define pushhostmem(L, handle) pushxxx((L), (void*)(handle))
 #define checkhostmemlist(L, arg, count, err) checkxxxlist((L), (arg), (count), (err), HOSTMEM_MT)
 
+/* view.c */
+#define checkview(L, arg, udp) (view_t*)checkxxx((L), (arg), (udp), VIEW_MT)
+#define testview(L, arg, udp) (view_t*)testxxx((L), (arg), (udp), VIEW_MT)
+#define optview(L, arg, udp) (view_t*)optxxx((L), (arg), (udp), VIEW_MT)
+#define pushview(L, handle) pushxxx((L), (void*)(handle))
+#define checkviewlist(L, arg, count, err) checkxxxlist((L), (arg), (count), (err), VIEW_MT)
+
+/* codec.c */
+#define checkcodec(L, arg, udp) (codec_t*)checkxxx((L), (arg), (udp), CODEC_MT)
+#define testcodec(L, arg, udp) (codec_t*)testxxx((L), (arg), (udp), CODEC_MT)
+#define optcodec(L, arg, udp) (codec_t*)optxxx((L), (arg), (udp), CODEC_MT)
+#define pushcodec(L, handle) pushxxx((L), (void*)(handle))
+#define checkcodeclist(L, arg, count, err) checkxxxlist((L), (arg), (count), (err), CODEC_MT)
+
+/* hid.c */
+#define checkhid(L, arg, udp) (hid_t*)checkxxx((L), (arg), (udp), HID_MT)
+#define testhid(L, arg, udp) (hid_t*)testxxx((L), (arg), (udp), HID_MT)
+#define opthid(L, arg, udp) (hid_t*)optxxx((L), (arg), (udp), HID_MT)
+#define pushhid(L, handle) pushxxx((L), (void*)(handle))
+#define checkhidlist(L, arg, count, err) checkxxxlist((L), (arg), (count), (err), HID_MT)
+
+/* inventory.c */
+#define checkinventory(L, arg, udp) (inventory_t*)checkxxx((L), (arg), (udp), INVENTORY_MT)
+#define testinventory(L, arg, udp) (inventory_t*)testxxx((L), (arg), (udp), INVENTORY_MT)
+#define optinventory(L, arg, udp) (inventory_t*)optxxx((L), (arg), (udp), INVENTORY_MT)
+#define pushinventory(L, handle) pushxxx((L), (void*)(handle))
+#define checkinventorylist(L, arg, count, err) checkxxxlist((L), (arg), (count), (err), INVENTORY_MT)
+
+/* config.c */
+#define checkconfig(L, arg, udp) (config_t*)checkxxx((L), (arg), (udp), CONFIG_MT)
+#define testconfig(L, arg, udp) (config_t*)testxxx((L), (arg), (udp), CONFIG_MT)
+#define optconfig(L, arg, udp) (config_t*)optxxx((L), (arg), (udp), CONFIG_MT)
+#define pushconfig(L, handle) pushxxx((L), (void*)(handle))
+#define checkconfiglist(L, arg, count, err) checkxxxlist((L), (arg), (count), (err), CONFIG_MT)
+
 #if 0 // 7yy
 /* zzz.c */
 #define checkzzz(L, arg, udp) (zzz_t*)checkxxx((L), (arg), (udp), ZZZ_MT)
@@ -0,0 +1,349 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2021 Stefano Trettel
+ *
+ * Software repository: MoonUSB, https://github.com/stetre/moonusb
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "internal.h"
+#include <sys/time.h>
+#include <errno.h>
+
+/* Capture of transfers in pcapng format, with the Linux usbmon link type
+ * (LINKTYPE_USB_LINUX_MMAPPED), so that captures can be inspected with Wireshark
+ * & friends. Each transfer produces a submission ('S') and a completion ('C') packet,
+ * each consisting of the 64-byte usbmon header, followed by the iso descriptors
+ * (isochronous transfers only), followed by the captured data.
+ *
+ * Output is double buffered in memory, so that no file writes happen in the transfer
+ * path. Packets are appended to the current buffer and, when it fills up, the two
+ * buffers are swapped. The buffers are written to the file only by pcap_flush() and
+ * pcap_close(): if the other buffer has not been written yet when the current one
+ * fills up, packets are dropped (and counted) until the next flush.
+ */
+
+#define LINKTYPE_USB_LINUX_MMAPPED 220
+#define DEFAULT_BUFSIZE (1024*1024)
+
+/* usbmon transfer types */
+#define USBMON_ISO      0
+#define USBMON_INTR     1
+#define USBMON_CONTROL  2
+#define USBMON_BULK     3
+
+typedef struct {
+    uint64_t id;
+    uint8_t type; /* 'S', 'C', 'E' */
+    uint8_t xfer_type; /* USBMON_XXX */
+    uint8_t epnum; /* including the direction bit */
+    uint8_t devnum;
+    uint16_t busnum;
+    char flag_setup; /* 0 if setup is valid, '-' otherwise */
+    char flag_data; /* 0 if data is captured, '<' or '>' otherwise */
+    int64_t ts_sec;
+    int32_t ts_usec;
+    int32_t status;
+    uint32_t length; /* length of data (submitted or actual) */
+    uint32_t len_cap; /* length of captured data (including iso descriptors) */
+    union {
+        uint8_t setup[8];
+        struct { int32_t error_count; int32_t numdesc; } iso;
+    } s;
+    int32_t interval;
+    int32_t start_frame;
+    uint32_t xfer_flags;
+    uint32_t ndesc;
+} usbmon_packet_t;
+
+typedef struct {
+    int32_t status;
+    uint32_t offset;
+    uint32_t len;
+    uint32_t pad;
+} usbmon_isodesc_t;
+
+int pcap_enabled = 0;
+static FILE *File = NULL;
+static uint32_t Snaplen = 0; /* max no. of data bytes captured per packet (0 = unlimited) */
+static unsigned char *Buf[2] = { NULL, NULL };
+static size_t Used[2] = { 0, 0 };
+static size_t Bufsize = 0;
+static int Cur = 0; /* index of the buffer being filled */
+static lua_Integer Dropped = 0; /* no. of packets dropped since the last flush */
+
+static int Errno(int status, int complete)
+/* Maps a libusb_transfer_status to the negated errno that usbmon would report */
+    {
+    if(!complete) return -115; /* -EINPROGRESS */
+    switch(status)
+        {
+        case LIBUSB_TRANSFER_COMPLETED: return 0;
+        case LIBUSB_TRANSFER_TIMED_OUT: return -110; /* -ETIMEDOUT */
+        case LIBUSB_TRANSFER_CANCELLED: return -2; /* -ENOENT */
+        case LIBUSB_TRANSFER_STALL: return -32; /* -EPIPE */
+        case LIBUSB_TRANSFER_NO_DEVICE: return -19; /* -ENODEV */
+        case LIBUSB_TRANSFER_OVERFLOW: return -75; /* -EOVERFLOW */
+        default: return -71; /* -EPROTO */
+        }
+    }
+
+static unsigned char *Reserve(size_t len)
+/* Reserves len bytes in the current buffer, swapping the buffers if it is full.
+ * Returns NULL if the packet must be dropped. */
+    {
+    unsigned char *p;
+    if(Used[Cur] + len > Bufsize)
+        {
+        if(len > Bufsize || Used[!Cur] > 0) /* not written yet */
+            { Dropped++; return NULL; }
+        Cur = !Cur;
+        }
+    p = Buf[Cur] + Used[Cur];
+    Used[Cur] += len;
+    return p;
+    }
+
+static int WriteBuffers(void)
+/* Writes the buffered packets to the file, the older buffer first.
+ * Returns 0 on success, or -1 on error (with errno set). */
+    {
+    int i = !Cur, k;
+    for(k = 0; k < 2; k++, i = !i)
+        {
+        if(Used[i] == 0) continue;
+        if(fwrite(Buf[i], 1, Used[i], File) != Used[i]) return -1;
+        Used[i] = 0;
+        }
+    return fflush(File) == 0 ? 0 : -1;
+    }
+
+static void Packet(devhandle_t *devhandle, uint64_t id, int complete, int type, unsigned char endpoint,
+        const unsigned char *setup, int length, const unsigned char *data, int datalen,
+        int status, const struct libusb_iso_packet_descriptor *iso, int ndesc)
+/* length: the length of data as reported by usbmon, datalen: the no. of bytes to be captured */
+    {
+    usbmon_packet_t hdr;
+    usbmon_isodesc_t desc;
+    struct timeval tv;
+    device_t *device = libusb_get_device(devhandle);
+    uint32_t block[7];
+    uint64_t ts;
+    uint32_t caplen, offset = 0;
+    unsigned char *p;
+    size_t pad;
+    int i;
+    int in = (endpoint & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN;
+    gettimeofday(&tv, NULL);
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.id = id;
+    hdr.type = complete ? 'C' : 'S';
+    switch(type)
+        {
+        case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS: hdr.xfer_type = USBMON_ISO; break;
+        case LIBUSB_TRANSFER_TYPE_INTERRUPT: hdr.xfer_type = USBMON_INTR; break;
+        case LIBUSB_TRANSFER_TYPE_CONTROL: hdr.xfer_type = USBMON_CONTROL; break;
+        default: hdr.xfer_type = USBMON_BULK;
+        }
+    hdr.epnum = endpoint;
+    hdr.devnum = libusb_get_device_address(device);
+    hdr.busnum = libusb_get_bus_number(device);
+    hdr.ts_sec = tv.tv_sec;
+    hdr.ts_usec = tv.tv_usec;
+    hdr.status = Errno(status, complete);
+    hdr.length = length;
+    if(setup && !complete)
+        memcpy(hdr.s.setup, setup, 8);
+    else
+        hdr.flag_setup = '-';
+    if(ndesc > 0)
+        {
+        hdr.s.iso.numdesc = ndesc;
+        hdr.ndesc = ndesc;
+        }
+    /* Data is captured for OUT submissions and IN completions only */
+    if(in != complete) datalen = 0;
+    if(Snaplen > 0 && (uint32_t)datalen > Snaplen) datalen = Snaplen;
+    if(datalen == 0)
+        hdr.flag_data = in ? '<' : '>';
+    caplen = ndesc*sizeof(usbmon_isodesc_t) + datalen;
+    hdr.len_cap = caplen;
+    /* Enhanced Packet Block */
+    ts = (uint64_t)tv.tv_sec*1000000 + tv.tv_usec;
+    block[0] = 6;
+    block[1] = 32 + ((sizeof(hdr) + caplen + 3) & ~3u);
+    block[2] = 0; /* interface id */
+    block[3] = (uint32_t)(ts >> 32);
+    block[4] = (uint32_t)ts;
+    block[5] = sizeof(hdr) + caplen; /* captured length */
+    block[6] = sizeof(hdr) + ndesc*sizeof(usbmon_isodesc_t) + length; /* original length */
+    if((p = Reserve(block[1])) == NULL) return;
+    memcpy(p, block, sizeof(block)); p += sizeof(block);
+    memcpy(p, &hdr, sizeof(hdr)); p += sizeof(hdr);
+    for(i = 0; i < ndesc; i++)
+        {
+        desc.status = complete ? Errno(iso[i].status, 1) : -18; /* -EXDEV */
+        desc.offset = offset;
+        desc.len = complete ? iso[i].actual_length : iso[i].length;
+        desc.pad = 0;
+        offset += iso[i].length;
+        memcpy(p, &desc, sizeof(desc)); p += sizeof(desc);
+        }
+    if(datalen > 0) memcpy(p, data, datalen);
+    p += datalen;
+    pad = block[1] - 32 - sizeof(hdr) - caplen;
+    memset(p, 0, pad); p += pad;
+    memcpy(p, &block[1], sizeof(uint32_t));
+    }
+
+void pcaptransfer(transfer_t *transfer, int complete)
+    {
+    int length, datalen, ndesc = 0;
+    unsigned char endpoint = transfer->endpoint;
+    unsigned char *setup = NULL, *data = transfer->buffer;
+    if(transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL)
+        {
+        setup = transfer->buffer;
+        data = transfer->buffer + LIBUSB_CONTROL_SETUP_SIZE;
+        endpoint = setup[0] & LIBUSB_ENDPOINT_DIR_MASK; /* direction from bmRequestType */
+        length = complete ? transfer->actual_length : transfer->length - (int)LIBUSB_CONTROL_SETUP_SIZE;
+        }
+    else
+        length = complete ? transfer->actual_length : transfer->length;
+    datalen = length;
+    if(transfer->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS)
+        {
+        ndesc = transfer->num_iso_packets;
+        length = datalen = transfer->length; /* iso data is captured as a whole */
+        }
+    Packet(transfer->dev_handle, (uint64_t)(uintptr_t)transfer, complete, transfer->type, endpoint,
+            setup, length, data, datalen, complete ? transfer->status : 0, transfer->iso_packet_desc, ndesc);
+    }
+
+void pcapsync(devhandle_t *devhandle, int complete, int type, unsigned char endpoint,
+        unsigned char *setup, unsigned char *data, int length, int ec)
+/* Captures the submission (complete=0) or the completion (complete=1) of a synchronous
+ * transfer. setup is NULL for non-control transfers, length is the requested length
+ * on submission and the actual length on completion, and ec is the returned error code.
+ */
+    {
+    uint64_t id = (uint64_t)(uintptr_t)data;
+    if(setup) endpoint = setup[0] & LIBUSB_ENDPOINT_DIR_MASK;
+    Packet(devhandle, id, complete, type, endpoint, setup, length, data, length,
+            complete ? syncstatus(ec) : 0, NULL, 0);
+    }
+
+static int Close(lua_State *L)
+/* ndropped = usb.pcap_close() */
+    {
+    int ec;
+    lua_Integer dropped = Dropped;
+    if(!File) return 0;
+    pcap_enabled = 0;
+    ec = WriteBuffers();
+    if(fclose(File) != 0) ec = -1;
+    File = NULL;
+    Free(L, Buf[0]);
+    Free(L, Buf[1]);
+    Buf[0] = Buf[1] = NULL;
+    Used[0] = Used[1] = 0;
+    Dropped = 0;
+    if(ec != 0) return luaL_error(L, "%s", strerror(errno));
+    lua_pushinteger(L, dropped);
+    return 1;
+    }
+
+static int Open(lua_State *L)
+/* usb.pcap_open(filename, [snaplen], [bufsize]) */
+    {
+    uint32_t shb[7], idb[5];
+    const char *filename = luaL_checkstring(L, 1);
+    lua_Integer snaplen = luaL_optinteger(L, 2, 0);
+    lua_Integer bufsize = luaL_optinteger(L, 3, DEFAULT_BUFSIZE);
+    if(snaplen < 0) return argerror(L, 2, ERR_VALUE);
+    if(bufsize <= 0) return argerror(L, 3, ERR_VALUE);
+    Close(L);
+    Buf[0] = (unsigned char*)MallocNoErr(L, bufsize);
+    Buf[1] = (unsigned char*)MallocNoErr(L, bufsize);
+    if(!Buf[0] || !Buf[1])
+        {
+        Free(L, Buf[0]); Free(L, Buf[1]);
+        Buf[0] = Buf[1] = NULL;
+        return luaL_error(L, errstring(ERR_MEMORY));
+        }
+    File = fopen(filename, "wb");
+    if(!File)
+        {
+        Free(L, Buf[0]); Free(L, Buf[1]);
+        Buf[0] = Buf[1] = NULL;
+        return luaL_error(L, errstring(ERR_FOPEN));
+        }
+    setvbuf(File, NULL, _IONBF, 0); /* we do our own buffering */
+    Bufsize = bufsize;
+    Cur = 0;
+    Snaplen = snaplen;
+    /* Section Header Block */
+    shb[0] = 0x0A0D0D0A;
+    shb[1] = sizeof(shb);
+    shb[2] = 0x1A2B3C4D; /* byte-order magic */
+    shb[3] = 1; /* major=1, minor=0 (little endian hosts) */
+    if(*(const uint8_t*)&shb[2] != 0x4D) shb[3] = 1 << 16; /* big endian hosts */
+    shb[4] = shb[5] = 0xffffffff; /* section length: unspecified */
+    shb[6] = sizeof(shb);
+    /* Interface Description Block */
+    idb[0] = 1;
+    idb[1] = sizeof(idb);
+    idb[2] = LINKTYPE_USB_LINUX_MMAPPED; /* linktype and reserved (0) */
+    if(*(const uint8_t*)&shb[2] != 0x4D) idb[2] <<= 16;
+    idb[3] = 0; /* snaplen: unlimited */
+    idb[4] = sizeof(idb);
+    if(fwrite(shb, sizeof(shb), 1, File) != 1 || fwrite(idb, sizeof(idb), 1, File) != 1)
+        {
+        int err = errno;
+        Close(L);
+        return luaL_error(L, "%s", strerror(err));
+        }
+    pcap_enabled = 1;
+    return 0;
+    }
+
+static int Flush(lua_State *L)
+/* ndropped = usb.pcap_flush() */
+    {
+    if(!File) return 0;
+    if(WriteBuffers() != 0) return luaL_error(L, "%s", strerror(errno));
+    lua_pushinteger(L, Dropped);
+    Dropped = 0;
+    return 1;
+    }
+
+static const struct luaL_Reg Functions[] = 
+    {
+        { "pcap_open", Open },
+        { "pcap_close", Close },
+        { "pcap_flush", Flush },
+        { NULL, NULL } /* sentinel */
+    };
+
+void moonusb_open_pcap(lua_State *L)
+    {
+    luaL_setfuncs(L, Functions, 0);
+    }
+
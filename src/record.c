@@ -0,0 +1,312 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2021 Stefano Trettel
+ *
+ * Software repository: MoonUSB, https://github.com/stetre/moonusb
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "internal.h"
+
+/* Recording of a device's descriptors and transfers, for replay by the emulator
+ * (see emulator.replay() in moonusb/emulator.lua).
+ *
+ * The log is a sequence of records, in host byte order. The file starts with a
+ * header (magic, version, device speed), followed by a control record for each of
+ * the device's descriptors (as if they were read with GET_DESCRIPTOR requests),
+ * followed by a record for each completed transfer on the recorded device, in order
+ * of completion. Each transfer record consists of a fixed size record_t, followed by
+ * the setup packet (control transfers only), followed by the iso packet descriptors
+ * (isochronous transfers only), followed by the data (IN transfers only, so that
+ * the log is dominated by what the device actually produced).
+ */
+
+#define RECORD_MAGIC "MUSBREC"
+#define RECORD_VERSION 1
+#define DEFAULT_BUFSIZE (1024*1024)
+
+typedef struct {
+    char magic[8];
+    uint16_t version;
+    uint8_t speed; /* libusb_speed */
+    uint8_t reserved[5];
+} header_t;
+
+typedef struct {
+    uint8_t type; /* libusb_transfer_type */
+    uint8_t endpoint; /* including the direction bit (from bmRequestType for control transfers) */
+    uint8_t status; /* libusb_transfer_status */
+    uint8_t reserved;
+    uint32_t latency; /* microseconds from submission to completion */
+    uint64_t time; /* microseconds from the start of the recording to the submission */
+    uint32_t length; /* requested length (excluding the setup packet) */
+    uint32_t actual_length;
+    uint32_t num_iso_packets;
+    uint32_t datalen; /* length of the data following the record */
+} record_t;
+
+typedef struct {
+    uint32_t length;
+    uint32_t actual_length;
+    uint32_t status; /* libusb_transfer_status */
+} isodesc_t;
+
+int record_enabled = 0;
+static FILE *File = NULL;
+static devhandle_t *Devhandle = NULL; /* the recorded device */
+static uint64_t Start; /* nanoseconds, see nowns() */
+
+static void Record(int type, unsigned char endpoint, int status, uint64_t submit_time, uint64_t latency,
+        int length, int actual_length, const unsigned char *setup,
+        const struct libusb_iso_packet_descriptor *iso, int ndesc, const unsigned char *data, int datalen)
+    {
+    int i;
+    record_t rec;
+    isodesc_t desc;
+    memset(&rec, 0, sizeof(rec));
+    rec.type = type;
+    rec.endpoint = endpoint;
+    rec.status = status;
+    rec.latency = latency/1000;
+    rec.time = submit_time > Start ? (submit_time - Start)/1000 : 0;
+    rec.length = length;
+    rec.actual_length = actual_length;
+    rec.num_iso_packets = ndesc;
+    rec.datalen = (endpoint & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN ? datalen : 0;
+    fwrite(&rec, sizeof(rec), 1, File);
+    if(setup) fwrite(setup, LIBUSB_CONTROL_SETUP_SIZE, 1, File);
+    for(i = 0; i < ndesc; i++)
+        {
+        desc.length = iso[i].length;
+        desc.actual_length = iso[i].actual_length;
+        desc.status = iso[i].status;
+        fwrite(&desc, sizeof(desc), 1, File);
+        }
+    if(rec.datalen > 0) fwrite(data, 1, rec.datalen, File);
+    }
+
+void recordtransfer(transfer_t *transfer, uint64_t submit_time, uint64_t complete_time)
+    {
+    int length, ndesc = 0;
+    unsigned char endpoint = transfer->endpoint;
+    unsigned char *setup = NULL, *data = transfer->buffer;
+    if(transfer->dev_handle != Devhandle) return;
+    length = transfer->length;
+    if(transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL)
+        {
+        setup = transfer->buffer;
+        data = transfer->buffer + LIBUSB_CONTROL_SETUP_SIZE;
+        endpoint = setup[0] & LIBUSB_ENDPOINT_DIR_MASK;
+        length -= LIBUSB_CONTROL_SETUP_SIZE;
+        }
+    if(transfer->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS)
+        ndesc = transfer->num_iso_packets;
+    Record(transfer->type, endpoint, transfer->status, submit_time, complete_time - submit_time,
+        length, transferlength(transfer), setup, transfer->iso_packet_desc, ndesc, data,
+        ndesc > 0 ? length : transfer->actual_length); /* iso data is recorded as a whole */
+    }
+
+void recordsync(devhandle_t *devhandle, int type, unsigned char endpoint, unsigned char *setup,
+        unsigned char *data, int length, int actual_length, int ec, uint64_t submit_time, uint64_t latency)
+    {
+    if(devhandle != Devhandle) return;
+    if(setup) endpoint = setup[0] & LIBUSB_ENDPOINT_DIR_MASK;
+    Record(type, endpoint, syncstatus(ec), submit_time, latency, length, actual_length,
+        setup, NULL, 0, data, actual_length);
+    }
+
+void recordforget(devhandle_t *devhandle)
+/* Called when a devhandle is closed: if it is the recorded one, stops recording
+ * (the file stays open until record_close() so that write errors can be reported) */
+    {
+    if(devhandle != Devhandle) return;
+    record_enabled = 0;
+    Devhandle = NULL;
+    }
+
+/*------------------------------------------------------------------------------*
+ | Descriptors                                                                  |
+ *------------------------------------------------------------------------------*/
+
+#define PUT(b) do { if(buf) buf[n] = (b); n++; } while(0)
+#define PUT16(w) do { PUT((w) & 0xff); PUT(((w) >> 8) & 0xff); } while(0)
+#define PUTEXTRA(x, len) do { if(buf && (len) > 0) memcpy(buf+n, (x), (len)); n += (len); } while(0)
+
+static int Serialize(const struct libusb_config_descriptor *config, unsigned char *buf)
+/* Rebuilds the raw configuration descriptor, with its interface, endpoint and
+ * extra descriptors. Returns its length (if buf is NULL, returns the length only).
+ */
+    {
+    int i, j, k, n = 0;
+    PUT(LIBUSB_DT_CONFIG_SIZE); PUT(LIBUSB_DT_CONFIG);
+    PUT16(0); /* wTotalLength, patched by the caller */
+    PUT(config->bNumInterfaces); PUT(config->bConfigurationValue);
+    PUT(config->iConfiguration); PUT(config->bmAttributes); PUT(config->MaxPower);
+    PUTEXTRA(config->extra, config->extra_length);
+    for(i = 0; i < config->bNumInterfaces; i++)
+        {
+        const struct libusb_interface *itf = &config->interface[i];
+        for(j = 0; j < itf->num_altsetting; j++)
+            {
+            const struct libusb_interface_descriptor *alt = &itf->altsetting[j];
+            PUT(LIBUSB_DT_INTERFACE_SIZE); PUT(LIBUSB_DT_INTERFACE);
+            PUT(alt->bInterfaceNumber); PUT(alt->bAlternateSetting); PUT(alt->bNumEndpoints);
+            PUT(alt->bInterfaceClass); PUT(alt->bInterfaceSubClass); PUT(alt->bInterfaceProtocol);
+            PUT(alt->iInterface);
+            PUTEXTRA(alt->extra, alt->extra_length);
+            for(k = 0; k < alt->bNumEndpoints; k++)
+                {
+                const struct libusb_endpoint_descriptor *ep = &alt->endpoint[k];
+                int audio = ep->bLength == LIBUSB_DT_ENDPOINT_AUDIO_SIZE;
+                PUT(audio ? LIBUSB_DT_ENDPOINT_AUDIO_SIZE : LIBUSB_DT_ENDPOINT_SIZE);
+                PUT(LIBUSB_DT_ENDPOINT);
+                PUT(ep->bEndpointAddress); PUT(ep->bmAttributes); PUT16(ep->wMaxPacketSize);
+                PUT(ep->bInterval);
+                if(audio) { PUT(ep->bRefresh); PUT(ep->bSynchAddress); }
+                PUTEXTRA(ep->extra, ep->extra_length);
+                }
+            }
+        }
+    if(buf) { buf[2] = n & 0xff; buf[3] = (n >> 8) & 0xff; }
+    return n;
+    }
+
+#undef PUT
+#undef PUT16
+#undef PUTEXTRA
+
+static void Descriptor(int type, int index, int langid, const unsigned char *data, int len)
+/* Records a descriptor as a completed GET_DESCRIPTOR control transfer */
+    {
+    unsigned char setup[LIBUSB_CONTROL_SETUP_SIZE];
+    setup[0] = LIBUSB_ENDPOINT_IN;
+    setup[1] = LIBUSB_REQUEST_GET_DESCRIPTOR;
+    setup[2] = index; setup[3] = type;
+    setup[4] = langid & 0xff; setup[5] = (langid >> 8) & 0xff;
+    setup[6] = len & 0xff; setup[7] = (len >> 8) & 0xff;
+    Record(LIBUSB_TRANSFER_TYPE_CONTROL, LIBUSB_ENDPOINT_IN, LIBUSB_TRANSFER_COMPLETED, Start, 0,
+        len, len, setup, NULL, 0, data, len);
+    }
+
+static void Descriptors(devhandle_t *devhandle)
+    {
+    int i, len, langid = 0;
+    unsigned char buf[LIBUSB_DT_DEVICE_SIZE], *cbuf;
+    unsigned char str[255];
+    struct libusb_device_descriptor dd;
+    struct libusb_config_descriptor *config;
+    device_t *device = libusb_get_device(devhandle);
+    if(libusb_get_device_descriptor(device, &dd) != LIBUSB_SUCCESS) return;
+    buf[0] = LIBUSB_DT_DEVICE_SIZE; buf[1] = LIBUSB_DT_DEVICE;
+    buf[2] = dd.bcdUSB & 0xff; buf[3] = dd.bcdUSB >> 8;
+    buf[4] = dd.bDeviceClass; buf[5] = dd.bDeviceSubClass; buf[6] = dd.bDeviceProtocol;
+    buf[7] = dd.bMaxPacketSize0;
+    buf[8] = dd.idVendor & 0xff; buf[9] = dd.idVendor >> 8;
+    buf[10] = dd.idProduct & 0xff; buf[11] = dd.idProduct >> 8;
+    buf[12] = dd.bcdDevice & 0xff; buf[13] = dd.bcdDevice >> 8;
+    buf[14] = dd.iManufacturer; buf[15] = dd.iProduct; buf[16] = dd.iSerialNumber;
+    buf[17] = dd.bNumConfigurations;
+    Descriptor(LIBUSB_DT_DEVICE, 0, 0, buf, LIBUSB_DT_DEVICE_SIZE);
+    for(i = 0; i < dd.bNumConfigurations; i++)
+        {
+        if(libusb_get_config_descriptor(device, i, &config) != LIBUSB_SUCCESS) continue;
+        len = Serialize(config, NULL);
+        cbuf = (unsigned char*)MallocNoErr(NULL, len);
+        if(cbuf)
+            {
+            Serialize(config, cbuf);
+            Descriptor(LIBUSB_DT_CONFIG, i, 0, cbuf, len);
+            Free(NULL, cbuf);
+            }
+        libusb_free_config_descriptor(config);
+        }
+    /* String descriptors (these are actually read from the device) */
+    len = libusb_get_string_descriptor(devhandle, 0, 0, str, sizeof(str));
+    if(len < 4) return;
+    Descriptor(LIBUSB_DT_STRING, 0, 0, str, len);
+    langid = str[2] | (str[3] << 8);
+    for(i = 1; i <= 3; i++)
+        {
+        int index = i==1 ? dd.iManufacturer : i==2 ? dd.iProduct : dd.iSerialNumber;
+        if(index == 0) continue;
+        len = libusb_get_string_descriptor(devhandle, index, langid, str, sizeof(str));
+        if(len > 0) Descriptor(LIBUSB_DT_STRING, index, langid, str, len);
+        }
+    }
+
+/*------------------------------------------------------------------------------*
+ | Lua interface                                                                |
+ *------------------------------------------------------------------------------*/
+
+static int Close(lua_State *L)
+    {
+    int ec;
+    if(!File) return 0;
+    record_enabled = 0;
+    Devhandle = NULL;
+    ec = fclose(File);
+    File = NULL;
+    if(ec != 0) return luaL_error(L, errstring(ERR_OPERATION));
+    return 0;
+    }
+
+static int Open(lua_State *L)
+/* usb.record_open(devhandle, filename, [bufsize]) */
+    {
+    header_t hdr;
+    devhandle_t *devhandle = checkdevhandle(L, 1, NULL);
+    const char *filename = luaL_checkstring(L, 2);
+    lua_Integer bufsize = luaL_optinteger(L, 3, DEFAULT_BUFSIZE);
+    if(bufsize <= 0) return argerror(L, 3, ERR_VALUE);
+    Close(L);
+    File = fopen(filename, "wb");
+    if(!File) return luaL_error(L, errstring(ERR_FOPEN));
+    setvbuf(File, NULL, _IOFBF, bufsize);
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, RECORD_MAGIC, sizeof(RECORD_MAGIC));
+    hdr.version = RECORD_VERSION;
+    hdr.speed = libusb_get_device_speed(libusb_get_device(devhandle));
+    fwrite(&hdr, sizeof(hdr), 1, File);
+    Devhandle = devhandle;
+    Start = nowns();
+    Descriptors(devhandle);
+    record_enabled = 1;
+    return 0;
+    }
+
+static int Flush(lua_State *L)
+    {
+    if(File && fflush(File) != 0) return luaL_error(L, errstring(ERR_OPERATION));
+    return 0;
+    }
+
+static const struct luaL_Reg Functions[] = 
+    {
+        { "record_open", Open },
+        { "record_close", Close },
+        { "record_flush", Flush },
+        { NULL, NULL } /* sentinel */
+    };
+
+void moonusb_open_record(lua_State *L)
+    {
+    luaL_setfuncs(L, Functions, 0);
+    }
+
@@ -0,0 +1,267 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2021 Stefano Trettel
+ *
+ * Software repository: MoonUSB, https://github.com/stetre/moonusb
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "internal.h"
+
+/* Per-endpoint transfer statistics, collected in C for every devhandle.
+ * Latencies are measured from submission to completion (callback entry for
+ * asynchronous transfers, return of the libusb call for synchronous ones),
+ * and accumulated in a log-linear histogram with 16 sub-buckets per power of two
+ * (i.e. with a relative error below ~6%), from which percentiles are derived.
+ */
+
+#define SUBBITS 4
+#define SUBCOUNT (1 << SUBBITS)
+#define MAXLATENCY (((uint64_t)1 << 36) - 1) /* ~68 s, larger values are clamped */
+
+static int Bucket(uint64_t v)
+    {
+    int msb, shift;
+    if(v < SUBCOUNT) return (int)v;
+    if(v > MAXLATENCY) v = MAXLATENCY;
+    msb = 63 - __builtin_clzll(v);
+    shift = msb - SUBBITS;
+    return (shift + 1)*SUBCOUNT + (int)((v >> shift) & (SUBCOUNT - 1));
+    }
+
+static uint64_t BucketValue(int i)
+/* Highest value falling in the i-th bucket */
+    {
+    int shift;
+    if(i < SUBCOUNT) return i;
+    shift = i/SUBCOUNT - 1;
+    return (((uint64_t)(SUBCOUNT + i%SUBCOUNT + 1)) << shift) - 1;
+    }
+
+#define Slot(endpoint) (((endpoint) & 0x0f) | (((endpoint) & LIBUSB_ENDPOINT_IN) >> 3))
+#define Address(slot) (((slot) & 0x0f) | (((slot) & 0x10) << 3))
+
+devstats_t *newstats(lua_State *L)
+    {
+    devstats_t *stats = (devstats_t*)Malloc(L, sizeof(devstats_t));
+    memset(stats, 0, sizeof(devstats_t));
+    return stats;
+    }
+
+void freestats(lua_State *L, devstats_t *stats)
+/* Frees the per-endpoint stats (not the devstats_t itself) */
+    {
+    int i;
+    for(i = 0; i < 32; i++)
+        if(stats->ep[i]) { Free(L, stats->ep[i]); stats->ep[i] = NULL; }
+    }
+
+void updatestats(devstats_t *stats, unsigned char endpoint, int status, int length, uint64_t latency)
+    {
+    epstats_t *ep = stats->ep[Slot(endpoint)];
+    if(!ep)
+        {
+        ep = (epstats_t*)MallocNoErr(NULL, sizeof(epstats_t));
+        if(!ep) return; /* stats are best effort */
+        memset(ep, 0, sizeof(epstats_t));
+        ep->min = UINT64_MAX;
+        stats->ep[Slot(endpoint)] = ep;
+        }
+    ep->transfers++;
+    if(length > 0) ep->bytes += length;
+    if(status >= 0 && status < 7) ep->status[status]++;
+    if(latency < ep->min) ep->min = latency;
+    if(latency > ep->max) ep->max = latency;
+    ep->sum += latency;
+    ep->hist[Bucket(latency)]++;
+    }
+
+int syncstatus(int ec)
+/* Maps the libusb_error returned by a synchronous transfer to a libusb_transfer_status */
+    {
+    switch(ec)
+        {
+        case LIBUSB_SUCCESS: return LIBUSB_TRANSFER_COMPLETED;
+        case LIBUSB_ERROR_TIMEOUT: return LIBUSB_TRANSFER_TIMED_OUT;
+        case LIBUSB_ERROR_PIPE: return LIBUSB_TRANSFER_STALL;
+        case LIBUSB_ERROR_NO_DEVICE: return LIBUSB_TRANSFER_NO_DEVICE;
+        case LIBUSB_ERROR_OVERFLOW: return LIBUSB_TRANSFER_OVERFLOW;
+        default: return LIBUSB_TRANSFER_ERROR;
+        }
+    }
+
+int transferlength(transfer_t *transfer)
+/* Returns the no. of bytes actually transferred. For isochronous transfers libusb
+ * leaves actual_length to 0, and the lengths are in the packet descriptors. */
+    {
+    int i, length = 0;
+    if(transfer->type != LIBUSB_TRANSFER_TYPE_ISOCHRONOUS)
+        return transfer->actual_length;
+    for(i = 0; i < transfer->num_iso_packets; i++)
+        length += transfer->iso_packet_desc[i].actual_length;
+    return length;
+    }
+
+/*------------------------------------------------------------------------------*
+ | Lua interface                                                                |
+ *------------------------------------------------------------------------------*/
+
+static double Percentile(epstats_t *ep, double p)
+    {
+    int i;
+    uint64_t n = 0, target = (uint64_t)(p*ep->transfers + 0.5);
+    if(target == 0) target = 1;
+    for(i = 0; i < STATS_NBUCKETS; i++)
+        {
+        n += ep->hist[i];
+        if(n >= target)
+            {
+            uint64_t v = BucketValue(i);
+            return (v < ep->max ? v : ep->max)*1e-9;
+            }
+        }
+    return ep->max*1e-9;
+    }
+
+#define SetInteger(name, val) do { lua_pushinteger(L, (val)); lua_setfield(L, -2, (name)); } while(0)
+#define SetNumber(name, val) do { lua_pushnumber(L, (val)); lua_setfield(L, -2, (name)); } while(0)
+
+static void PushEpStats(lua_State *L, epstats_t *ep)
+    {
+    int i, n;
+    lua_newtable(L);
+    SetInteger("transfers", ep->transfers);
+    SetInteger("bytes", ep->bytes);
+    SetInteger("errors", ep->transfers - ep->status[LIBUSB_TRANSFER_COMPLETED]);
+    SetInteger("timeouts", ep->status[LIBUSB_TRANSFER_TIMED_OUT]);
+    SetInteger("stalls", ep->status[LIBUSB_TRANSFER_STALL]);
+    lua_newtable(L);
+    for(i = 0; i < 7; i++)
+        {
+        if(ep->status[i] == 0) continue;
+        pushtransferstatus(L, i);
+        lua_pushinteger(L, ep->status[i]);
+        lua_rawset(L, -3);
+        }
+    lua_setfield(L, -2, "status");
+    lua_newtable(L);
+    if(ep->transfers > 0)
+        {
+        SetNumber("min", ep->min*1e-9);
+        SetNumber("max", ep->max*1e-9);
+        SetNumber("mean", ((double)ep->sum/ep->transfers)*1e-9);
+        SetNumber("p50", Percentile(ep, 0.50));
+        SetNumber("p90", Percentile(ep, 0.90));
+        SetNumber("p99", Percentile(ep, 0.99));
+        SetNumber("p999", Percentile(ep, 0.999));
+        }
+    lua_setfield(L, -2, "latency");
+    lua_newtable(L);
+    n = 0;
+    for(i = 0; i < STATS_NBUCKETS; i++)
+        {
+        if(ep->hist[i] == 0) continue;
+        lua_newtable(L);
+        lua_pushnumber(L, BucketValue(i)*1e-9);
+        lua_rawseti(L, -2, 1);
+        lua_pushinteger(L, ep->hist[i]);
+        lua_rawseti(L, -2, 2);
+        lua_rawseti(L, -2, ++n);
+        }
+    lua_setfield(L, -2, "histogram");
+    }
+
+static void PushStats(lua_State *L, devstats_t *stats, int reset)
+    {
+    int i;
+    lua_newtable(L);
+    for(i = 0; i < 32; i++)
+        {
+        if(!stats->ep[i]) continue;
+        PushEpStats(L, stats->ep[i]);
+        lua_rawseti(L, -2, Address(i));
+        }
+    if(reset) freestats(L, stats);
+    }
+
+static int Stats(lua_State *L)
+    {
+    ud_t *ud;
+    int reset;
+    (void)checkdevhandle(L, 1, &ud);
+    reset = optboolean(L, 2, 0);
+    PushStats(L, (devstats_t*)ud->info, reset);
+    return 1;
+    }
+
+static int ResetStats(lua_State *L)
+    {
+    ud_t *ud;
+    (void)checkdevhandle(L, 1, &ud);
+    freestats(L, (devstats_t*)ud->info);
+    return 0;
+    }
+
+typedef struct {
+    context_t *context;
+    int reset;
+} scan_t;
+
+static int ScanDevhandle(lua_State *L, const void *mem, const char *mt, const void *info)
+    {
+    ud_t *ud = (ud_t*)mem;
+    const scan_t *scan = (const scan_t*)info;
+    (void)mt;
+    if(!IsValid(ud) || ud->context != scan->context) return 0;
+    pushuserdata(L, ud);
+    PushStats(L, (devstats_t*)ud->info, scan->reset);
+    lua_rawset(L, -3);
+    return 0;
+    }
+
+static int ContextStats(lua_State *L)
+    {
+    scan_t scan;
+    scan.context = checkcontext(L, 1, NULL);
+    scan.reset = optboolean(L, 2, 0);
+    lua_newtable(L);
+    udata_scan(L, DEVHANDLE_MT, &scan, ScanDevhandle);
+    return 1;
+    }
+
+static const struct luaL_Reg DevhandleMethods[] = 
+    {
+        { "stats", Stats },
+        { "reset_stats", ResetStats },
+        { NULL, NULL } /* sentinel */
+    };
+
+static const struct luaL_Reg ContextMethods[] = 
+    {
+        { "stats", ContextStats },
+        { NULL, NULL } /* sentinel */
+    };
+
+void moonusb_open_stats(lua_State *L)
+    {
+    udata_addmethods(L, DEVHANDLE_MT, DevhandleMethods);
+    udata_addmethods(L, CONTEXT_MT, ContextMethods);
+    }
+
@@ -30,7 +30,9 @@ static int Control_transfer(lua_State *L)
 // expects the setup packet in the first 8 bytes
     {
     int ec;
-    devhandle_t *devhandle = checkdevhandle(L, 1, NULL);
+    ud_t *ud;
+    uint64_t t, dt;
+    devhandle_t *devhandle = checkdevhandle(L, 1, &ud);
     unsigned char *ptr = (unsigned char*)checklightuserdata(L, 2);
     int length = luaL_checkinteger(L, 3);
     unsigned int timeout = luaL_checkinteger(L, 4);
@@ -38,8 +40,15 @@ static int Control_transfer(lua_State *L)
     unsigned char *data = ptr + sizeof(struct libusb_control_setup);
     if(length < (s->wLength + 8))
         return argerror(L, 3, ERR_VALUE);
+    PCAP_SYNC(devhandle, 0, LIBUSB_TRANSFER_TYPE_CONTROL, 0, ptr, data, s->wLength, 0);
+    t = nowns();
     ec = libusb_control_transfer(devhandle, s->bmRequestType, s->bRequest, s->wValue, s->wIndex,
             data, s->wLength, timeout);
+    dt = nowns() - t;
+    updatestats((devstats_t*)ud->info, 0, syncstatus(ec>=0 ? 0 : ec), ec>=0 ? ec : 0, dt);
+    RECORD_SYNC(devhandle, LIBUSB_TRANSFER_TYPE_CONTROL, 0, ptr, data, s->wLength, ec>=0 ? ec : 0,
+            ec>=0 ? 0 : ec, t, dt);
+    PCAP_SYNC(devhandle, 1, LIBUSB_TRANSFER_TYPE_CONTROL, 0, ptr, data, ec>=0 ? ec : 0, ec>=0 ? 0 : ec);
     if(ec>=0)
         {
         lua_pushinteger(L, ec); // actual length of data starting from ptr+8
@@ -49,8 +58,30 @@ static int Control_transfer(lua_State *L)
     return 0;
     }
 
+int synctransfer(devhandle_t *devhandle, int type, unsigned char endpoint, unsigned char *ptr,
+        int length, int *transferred, unsigned int timeout)
+/* Executes a synchronous bulk or interrupt transfer, updating the stats and the
+ * recording/capture if enabled. Returns the libusb error code.
+ */
+    {
+    int ec;
+    uint64_t t, dt;
+    *transferred = 0;
+    PCAP_SYNC(devhandle, 0, type, endpoint, NULL, ptr, length, 0);
+    t = nowns();
+    if(type == LIBUSB_TRANSFER_TYPE_BULK)
+        ec = libusb_bulk_transfer(devhandle, endpoint, ptr, length, transferred, timeout);
+    else
+        ec = libusb_interrupt_transfer(devhandle, endpoint, ptr, length, transferred, timeout);
+    dt = nowns() - t;
+    updatestats((devstats_t*)userdata(devhandle)->info, endpoint, syncstatus(ec), *transferred, dt);
+    RECORD_SYNC(devhandle, type, endpoint, NULL, ptr, length, *transferred, ec, t, dt);
+    PCAP_SYNC(devhandle, 1, type, endpoint, NULL, ptr, *transferred, ec);
+    return ec;
+    }
+
 // actual_length = f(devhandle, endpoint, ptr, length, timeout, datastring)
-#define F(Func, func)                                                   \
+#define F(Func, type)                                                   \
 static int Func(lua_State *L)                                           \
     {                                                                   \
     int ec, transferred;                                                \
@@ -59,13 +90,13 @@ static int Func(lua_State *L)                                           \
     unsigned char *ptr = (unsigned char*)checklightuserdata(L, 3);      \
     int length = luaL_checkinteger(L, 4);                               \
     unsigned int timeout = luaL_checkinteger(L, 5);                     \
-    ec = func(devhandle, endpoint, ptr, length, &transferred, timeout); \
+    ec = synctransfer(devhandle, type, endpoint, ptr, length, &transferred, timeout); \
     CheckError(L, ec);                                                  \
     lua_pushinteger(L, transferred);                                    \
     return 1;                                                           \
     }
-F(Bulk_transfer, libusb_bulk_transfer)
-F(Interrupt_transfer, libusb_interrupt_transfer)
+F(Bulk_transfer, LIBUSB_TRANSFER_TYPE_BULK)
+F(Interrupt_transfer, LIBUSB_TRANSFER_TYPE_INTERRUPT)
 #undef F
 
 static const struct luaL_Reg Methods[] = 
@@ -46,6 +46,166 @@ static int Since(lua_State *L)
     return 1;
     }
 
+/*------------------------------------------------------------------------------*
+ | Transfer tracer                                                              |
+ *------------------------------------------------------------------------------*/
+
+/* When enabled, transfer events are recorded in a fixed-size ring of binary records,
+ * overwriting the oldest ones when the ring is full. Recording an event costs a
+ * timestamp and a 48-byte store, so it can be left enabled in production.
+ */
+
+#define TRACE_MAGIC "MUSBTRC"
+#define TRACE_VERSION 1
+
+typedef struct {
+    uint64_t time; /* nanoseconds, same clock as usb.now() */
+    uint64_t devhandle;
+    uint64_t transfer;
+    uint32_t seq;
+    int32_t length;
+    int32_t actual_length;
+    int32_t status; /* libusb_transfer_status (complete), or libusb_error (others) */
+    uint8_t endpoint;
+    uint8_t type; /* libusb_transfer_type */
+    uint8_t event; /* MOONUSB_TRACE_XXX */
+    uint8_t reserved[5];
+} tracerecord_t;
+
+int trace_transfers = 0;
+static tracerecord_t *Ring = NULL;
+static uint64_t RingMask = 0; /* ring size - 1 */
+static uint64_t Head = 0; /* no. of records written */
+static uint64_t Tail = 0; /* no. of records read */
+
+void tracetransfer(transfer_t *transfer, int event, int status)
+    {
+    tracerecord_t *rec = &Ring[Head & RingMask];
+    rec->time = nowns();
+    rec->devhandle = (uint64_t)(uintptr_t)transfer->dev_handle;
+    rec->transfer = (uint64_t)(uintptr_t)transfer;
+    rec->seq = (uint32_t)Head;
+    rec->length = transfer->length;
+    rec->actual_length = event == MOONUSB_TRACE_COMPLETE ? transfer->actual_length : 0;
+    rec->status = status;
+    rec->endpoint = transfer->endpoint;
+    rec->type = transfer->type;
+    rec->event = event;
+    Head++;
+    }
+
+static uint64_t Lost(void)
+/* Skips the records that have been overwritten, and returns their number */
+    {
+    uint64_t lost = 0;
+    if(Head - Tail > RingMask + 1)
+        {
+        lost = Head - Tail - (RingMask + 1);
+        Tail += lost;
+        }
+    return lost;
+    }
+
+static int TraceTransfers(lua_State *L)
+/* usb.trace_transfers(nrecords|false) */
+    {
+    uint64_t size = 16;
+    lua_Integer n = lua_toboolean(L, 1) ? luaL_checkinteger(L, 1) : 0;
+    if(n < 0) return argerror(L, 1, ERR_VALUE);
+    trace_transfers = 0;
+    Free(L, Ring);
+    Ring = NULL;
+    Head = Tail = 0;
+    if(n == 0) return 0;
+    while(size < (uint64_t)n) size <<= 1;
+    Ring = (tracerecord_t*)Malloc(L, size*sizeof(tracerecord_t));
+    RingMask = size - 1;
+    trace_transfers = 1;
+    return 0;
+    }
+
+static void PushRecord(lua_State *L, const tracerecord_t *rec)
+    {
+    lua_newtable(L);
+    lua_pushnumber(L, rec->time*1.0e-9);
+    lua_setfield(L, -2, "time");
+    pushtraceevent(L, rec->event);
+    lua_setfield(L, -2, "event");
+    lua_pushinteger(L, rec->seq);
+    lua_setfield(L, -2, "seq");
+    if(userdata((void*)(uintptr_t)rec->devhandle)) /* still alive */
+        {
+        pushdevhandle(L, (void*)(uintptr_t)rec->devhandle);
+        lua_setfield(L, -2, "devhandle");
+        }
+    lua_pushinteger(L, (lua_Integer)rec->transfer);
+    lua_setfield(L, -2, "transfer_id");
+    lua_pushinteger(L, rec->endpoint);
+    lua_setfield(L, -2, "endpoint");
+    pushtransfertype(L, rec->type);
+    lua_setfield(L, -2, "transfer_type");
+    lua_pushinteger(L, rec->length);
+    lua_setfield(L, -2, "length");
+    lua_pushinteger(L, rec->actual_length);
+    lua_setfield(L, -2, "actual_length");
+    if(rec->event == MOONUSB_TRACE_COMPLETE)
+        pushtransferstatus(L, rec->status);
+    else
+        pusherrcode(L, rec->status);
+    lua_setfield(L, -2, "status");
+    }
+
+static int TraceRead(lua_State *L)
+/* {record}, lost = usb.trace_read([maxrecords]) */
+    {
+    lua_Integer i, n, maxrecords = luaL_optinteger(L, 1, 0);
+    uint64_t lost;
+    if(!Ring) return luaL_error(L, "transfer tracing is not enabled");
+    lost = Lost();
+    n = Head - Tail;
+    if(maxrecords > 0 && n > maxrecords) n = maxrecords;
+    lua_createtable(L, n, 0);
+    for(i = 0; i < n; i++)
+        {
+        PushRecord(L, &Ring[(Tail + i) & RingMask]);
+        lua_rawseti(L, -2, i+1);
+        }
+    Tail += n;
+    lua_pushinteger(L, lost);
+    return 2;
+    }
+
+static int TraceDump(lua_State *L)
+/* n, lost = usb.trace_dump(filename) 
+ * File layout: 8-byte magic, uint32 version, uint32 record size, uint64 no. of records,
+ * followed by the records (native byte order, see tracerecord_t).
+ */
+    {
+    FILE *f;
+    uint64_t n, lost, first, count;
+    uint32_t hdr[2] = { TRACE_VERSION, sizeof(tracerecord_t) };
+    const char *filename = luaL_checkstring(L, 1);
+    if(!Ring) return luaL_error(L, "transfer tracing is not enabled");
+    f = fopen(filename, "wb");
+    if(!f) return luaL_error(L, errstring(ERR_FOPEN));
+    lost = Lost();
+    n = Head - Tail;
+    fwrite(TRACE_MAGIC, 1, 8, f);
+    fwrite(hdr, sizeof(hdr), 1, f);
+    fwrite(&n, sizeof(n), 1, f);
+    /* The records may wrap around the end of the ring */
+    first = Tail & RingMask;
+    count = RingMask + 1 - first;
+    if(count > n) count = n;
+    fwrite(&Ring[first], sizeof(tracerecord_t), count, f);
+    fwrite(&Ring[0], sizeof(tracerecord_t), n - count, f);
+    if(fclose(f) != 0) return luaL_error(L, errstring(ERR_OPERATION));
+    Tail += n;
+    lua_pushinteger(L, n);
+    lua_pushinteger(L, lost);
+    return 2;
+    }
+
 /* ----------------------------------------------------------------------- */
  
 static int Setlocale(lua_State *L)
@@ -138,6 +298,9 @@ static int AddVersions(lua_State *L)
 static const struct luaL_Reg Functions[] = 
     {
         { "trace_objects", TraceObjects },
+        { "trace_transfers", TraceTransfers },
+        { "trace_read", TraceRead },
+        { "trace_dump", TraceDump },
         { "now", Now },
         { "since", Since },
         { "setlocale", Setlocale },
@@ -32,7 +32,10 @@ static int freetransfer(lua_State *L, ud_t *ud)
 //  freechildren(L, _MT, ud);
     if(!freeuserdata(L, ud, "transfer")) return 0;
     if(submitted) 
-        (void)libusb_cancel_transfer(transfer);
+        {
+        int ec = libusb_cancel_transfer(transfer);
+        TRACE_TRANSFER(transfer, MOONUSB_TRACE_CANCEL, ec);
+        }
     libusb_free_transfer(transfer);
     return 0;
     }
@@ -46,6 +49,8 @@ static ud_t *newtransfer(lua_State *L, int iso_packets, devhandle_t *devhandle)
     ud->parent_ud = userdata(devhandle);
     ud->context = userdata(devhandle)->context;
     ud->destructor = freetransfer;
+    ud->info = Malloc(L, sizeof(transferinfo_t));
+    ((transferinfo_t*)ud->info)->stats = (devstats_t*)userdata(devhandle)->info;
     return ud;
     }
 
@@ -65,7 +70,12 @@ static int Get_endpoint(lua_State *L)
 
 static int Submit(lua_State *L, transfer_t *transfer, ud_t *ud, int new_transfer)
     {
-    int ec = libusb_submit_transfer(transfer);
+    int ec;
+    ((transferinfo_t*)ud->info)->submit_time = nowns();
+    ((transferinfo_t*)ud->info)->complete_time = 0;
+    ec = libusb_submit_transfer(transfer);
+    TRACE_TRANSFER(transfer, new_transfer ? MOONUSB_TRACE_SUBMIT : MOONUSB_TRACE_RESUBMIT, ec);
+    if(ec == LIBUSB_SUCCESS) PCAP_TRANSFER(transfer, 0);
     switch(ec)
         {
         case LIBUSB_SUCCESS:        break;
@@ -83,10 +93,12 @@ static int Submit(lua_State *L, transfer_t *transfer, ud_t *ud, int new_transfer
 
 static int Cancel(lua_State *L)
     {
+    int ec;
     transfer_t *transfer = checktransfer(L, 1, NULL);
     /* This will cause the callback to be executed, and the transfer
      * to be deleted at the end of it */
-    (void)libusb_cancel_transfer(transfer);
+    ec = libusb_cancel_transfer(transfer);
+    TRACE_TRANSFER(transfer, MOONUSB_TRACE_CANCEL, ec);
     return 0;
     }
 
@@ -95,8 +107,18 @@ static void Callback(transfer_t *transfer)
 #define L moonusb_L
     int rc, resubmit;
     int top = lua_gettop(L);
-    ud_t *ud = userdata(transfer);
+    ud_t *ud;
+    transferinfo_t *info;
+    uint64_t t = nowns();
+    TRACE_TRANSFER(transfer, MOONUSB_TRACE_COMPLETE, transfer->status);
+    PCAP_TRANSFER(transfer, 1);
+    ud = userdata(transfer);
     if(!ud) { unexpected(L); return; }
+    info = (transferinfo_t*)ud->info;
+    info->complete_time = t;
+    updatestats(info->stats, transfer->endpoint, transfer->status, transferlength(transfer),
+            t - info->submit_time);
+    RECORD_TRANSFER(transfer, info->submit_time, t);
     CancelSubmitted(ud);
     lua_rawgeti(L, LUA_REGISTRYINDEX, ud->ref1);
     pushtransfer(L, transfer);
@@ -190,24 +212,83 @@ static int Submit_interrupt_transfer(lua_State *L)
     }
 
 static int Submit_iso_transfer(lua_State *L)
+/* iso_packet_length (arg 6) is either the length of all packets, or a table with
+ * the length of each packet */
     {
+    int i;
     ud_t *ud;
     transfer_t *transfer;
+    lua_Integer sum = 0, len;
     devhandle_t *devhandle = checkdevhandle(L, 1, NULL);
     unsigned char endpoint = luaL_checkinteger(L, 2);
     unsigned char *ptr = (unsigned char*)checklightuserdata(L, 3);
     int length = luaL_checkinteger(L, 4);
     int num_iso_packets = luaL_checkinteger(L, 5);
-    unsigned int iso_packet_length = luaL_checkinteger(L, 6); //@@ alt: a table of lengths?
+    int lengths = lua_istable(L, 6);
+    unsigned int iso_packet_length = lengths ? 0 : luaL_checkinteger(L, 6);
     unsigned int timeout = luaL_checkinteger(L, 7);
     if(!lua_isfunction(L, 8)) return argerror(L, 8, ERR_FUNCTION);
-    if(length != (int)(num_iso_packets*iso_packet_length)) return argerror(L, 3, ERR_VALUE);
+    if(num_iso_packets < 0) return argerror(L, 5, ERR_VALUE);
+    if(lengths)
+        {
+        if(luaL_len(L, 6) != num_iso_packets) return argerror(L, 6, ERR_LENGTH);
+        for(i = 0; i < num_iso_packets; i++)
+            {
+            lua_rawgeti(L, 6, i+1);
+            len = lua_tointeger(L, -1);
+            if(!lua_isinteger(L, -1) || len < 0) return argerror(L, 6, ERR_ELEMVALUE);
+            lua_pop(L, 1);
+            sum += len;
+            }
+        if(sum != length) return argerror(L, 3, ERR_VALUE);
+        }
+    else if(length != (int)(num_iso_packets*iso_packet_length)) return argerror(L, 3, ERR_VALUE);
     ud = newtransfer(L, num_iso_packets, devhandle);
     transfer = (transfer_t*)ud->handle;
     Reference(L, 8, ud->ref1);
-    libusb_set_iso_packet_lengths(transfer, iso_packet_length);
+    /* fill first: libusb_fill_iso_transfer() sets num_iso_packets, which
+     * libusb_set_iso_packet_lengths() relies on */
     libusb_fill_iso_transfer(transfer, devhandle, endpoint, ptr, length,
            num_iso_packets, Callback, NULL, timeout);
+    if(!lengths)
+        libusb_set_iso_packet_lengths(transfer, iso_packet_length);
+    else
+        for(i = 0; i < num_iso_packets; i++)
+            {
+            lua_rawgeti(L, 6, i+1);
+            transfer->iso_packet_desc[i].length = lua_tointeger(L, -1);
+            lua_pop(L, 1);
+            }
+    return Submit(L, transfer, ud, 1);
+    }
+
+int submittransfer(lua_State *L, devhandle_t *devhandle, unsigned char endpoint, int type,
+        unsigned char *ptr, int length, int iso_packet_length, unsigned int timeout, int funcarg)
+/* Creates and submits a non-control transfer, with the callback at funcarg.
+ * Arguments are expected to be already validated (this is used by endpoint objects).
+ */
+    {
+    ud_t *ud;
+    transfer_t *transfer;
+    int num_iso_packets = type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS ? length / iso_packet_length : 0;
+    ud = newtransfer(L, num_iso_packets, devhandle);
+    transfer = (transfer_t*)ud->handle;
+    Reference(L, funcarg, ud->ref1);
+    switch(type)
+        {
+        case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
+            libusb_fill_iso_transfer(transfer, devhandle, endpoint, ptr, length,
+                    num_iso_packets, Callback, NULL, timeout);
+            libusb_set_iso_packet_lengths(transfer, iso_packet_length);
+            break;
+        case LIBUSB_TRANSFER_TYPE_INTERRUPT:
+            libusb_fill_interrupt_transfer(transfer, devhandle, endpoint, ptr, length,
+                    Callback, NULL, timeout);
+            break;
+        default:
+            libusb_fill_bulk_transfer(transfer, devhandle, endpoint, ptr, length,
+                    Callback, NULL, timeout);
+        }
     return Submit(L, transfer, ud, 1);
     }
 
@@ -293,6 +374,18 @@ static int Get_stream_id(lua_State *L)
     return 1;
     }
 
+static int Get_timestamps(lua_State *L)
+    {
+    ud_t *ud;
+    transferinfo_t *info;
+    (void)checktransfer(L, 1, &ud);
+    info = (transferinfo_t*)ud->info;
+    lua_pushnumber(L, info->submit_time*1e-9);
+    if(info->complete_time == 0) return 1;
+    lua_pushnumber(L, info->complete_time*1e-9);
+    return 2;
+    }
+
 DESTROY_FUNC(transfer)
 
 static const struct luaL_Reg Methods[] = 
@@ -303,6 +396,7 @@ static const struct luaL_Reg Methods[] =
         { "get_iso_packet_descriptors", Get_iso_packet_descriptors },
         { "get_actual_length", Get_actual_length },
         { "get_stream_id", Get_stream_id },
+        { "get_timestamps", Get_timestamps },
         { NULL, NULL } /* sentinel */
     };
 
@@ -0,0 +1,249 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2021 Stefano Trettel
+ *
+ * Software repository: MoonUSB, https://github.com/stetre/moonusb
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "internal.h"
+
+/* Send path of the emulator's USB/IP transport (see moonusb/emulator.lua).
+ *
+ * Responses are sent with writev(), gathering a header packed in a preallocated
+ * buffer and the payload as is, so that the payload (a string or host memory)
+ * is never copied. When corked, responses are queued instead of being sent, and
+ * the whole queue is sent with a single writev() when uncorked (or when full).
+ * Payload strings and hostmems queued while corked are anchored in a table referenced
+ * in the registry, so that they are not collected before being sent.
+ */
+
+#if defined(LINUX)
+#include <errno.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <sys/uio.h>
+
+#define USBIP_RET_SUBMIT  0x00000003
+#define USBIP_RET_UNLINK  0x00000004
+#define HDRSIZE 48
+#define MAXRESP 256 /* max no. of responses in the queue */
+#define MAXIOV (3*MAXRESP) /* header, data, iso descriptors */
+
+static uint8_t Hdr[MAXRESP][HDRSIZE];
+static struct iovec Iov[MAXIOV];
+static int Nresp = 0, Niov = 0;
+static int Fd = -1; /* fd of the queued responses */
+static int Corked = 0;
+static int Anchor = LUA_NOREF; /* table of the queued payloads */
+
+static int Sendv(int fd, struct iovec *iov, int iovcnt)
+/* Sends all the data in iov (modifying it). Returns 0 on success, or -1
+ * if the connection is closed. Other errors are raised. */
+    {
+    ssize_t n;
+    struct pollfd pfd;
+    while(iovcnt > 0)
+        {
+        n = writev(fd, iov, iovcnt);
+        if(n < 0)
+            {
+            if(errno == EINTR) continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK) /* LuaSocket sockets are non-blocking */
+                {
+                pfd.fd = fd; pfd.events = POLLOUT;
+                poll(&pfd, 1, -1);
+                continue;
+                }
+            if(errno == EPIPE || errno == ECONNRESET) return -1;
+            return -2;
+            }
+        while(iovcnt > 0 && (size_t)n >= iov->iov_len)
+            { n -= iov->iov_len; iov++; iovcnt--; }
+        if(iovcnt > 0)
+            { iov->iov_base = (char*)iov->iov_base + n; iov->iov_len -= n; }
+        }
+    return 0;
+    }
+
+static int Flush(lua_State *L)
+/* Sends the queued responses. Returns 1 on success, 0 if the connection is closed. */
+    {
+    int rc, errnum;
+    if(Niov == 0) return 1;
+    rc = Sendv(Fd, Iov, Niov);
+    errnum = errno;
+    Nresp = Niov = 0;
+    luaL_unref(L, LUA_REGISTRYINDEX, Anchor);
+    Anchor = LUA_NOREF;
+    if(rc == -2) return luaL_error(L, "%s", strerror(errnum));
+    return rc == 0;
+    }
+
+static void Put32(uint8_t *p, uint32_t val)
+    { val = htonl(val); memcpy(p, &val, 4); }
+
+static void AddPayload(lua_State *L, int arg, const void *ptr, size_t len)
+/* Adds the payload at arg to the queue, anchoring it if it is a Lua value that
+ * must outlive the call (i.e. if corked, otherwise it is sent before returning) */
+    {
+    if(len == 0) return;
+    Iov[Niov].iov_base = (void*)ptr;
+    Iov[Niov].iov_len = len;
+    Niov++;
+    if(!Corked) return;
+    if(lua_type(L, arg) == LUA_TLIGHTUSERDATA) return; /* the caller ensures it stays valid */
+    if(Anchor == LUA_NOREF)
+        { lua_newtable(L); Anchor = luaL_ref(L, LUA_REGISTRYINDEX); }
+    lua_rawgeti(L, LUA_REGISTRYINDEX, Anchor);
+    lua_pushvalue(L, arg);
+    lua_rawseti(L, -2, Niov);
+    lua_pop(L, 1);
+    }
+
+static const void *CheckPayload(lua_State *L, int arg, size_t length, size_t *len)
+/* Payload: a string, a hostmem, or a pointer (to length bytes), or nil */
+    {
+    hostmem_t *hostmem;
+    *len = 0;
+    if(lua_isnoneornil(L, arg)) return NULL;
+    if(lua_type(L, arg) == LUA_TSTRING) return lua_tolstring(L, arg, len);
+    if(lua_type(L, arg) == LUA_TLIGHTUSERDATA)
+        { *len = length; return lua_touserdata(L, arg); }
+    hostmem = checkhostmem(L, arg, NULL);
+    if(length > hostmem->size) { luaL_error(L, errstring(ERR_BOUNDARIES)); return NULL; }
+    *len = length;
+    return hostmem->ptr;
+    }
+
+static uint8_t *NewResponse(lua_State *L, int fd)
+/* Makes room in the queue for a response to fd, and returns its header buffer */
+    {
+    if(Niov > 0 && (fd != Fd || Nresp == MAXRESP)) Flush(L);
+    Fd = fd;
+    memset(Hdr[Nresp], 0, HDRSIZE);
+    Iov[Niov].iov_base = Hdr[Nresp];
+    Iov[Niov].iov_len = HDRSIZE;
+    Niov++;
+    return Hdr[Nresp++];
+    }
+
+static int Done(lua_State *L)
+    {
+    lua_pushboolean(L, Corked ? 1 : Flush(L));
+    return 1;
+    }
+
+static int SendRetSubmit(lua_State *L)
+/* ok = usbip_send_ret_submit(fd, seqnum, devid, direction, ep, status, actual_length,
+ *                            start_frame, number_of_packets, error_count, [data], [iso_descriptors])
+ * The arguments are all checked before queueing anything, so that an error can't
+ * leave a partial response in the queue.
+ */
+    {
+    size_t datalen, isolen;
+    const void *data, *iso;
+    uint8_t *hdr;
+    int fd = luaL_checkinteger(L, 1);
+    uint32_t seqnum = luaL_checkinteger(L, 2);
+    uint32_t devid = luaL_checkinteger(L, 3);
+    uint32_t direction = luaL_checkinteger(L, 4);
+    uint32_t ep = luaL_checkinteger(L, 5);
+    uint32_t status = (uint32_t)luaL_checkinteger(L, 6);
+    uint32_t actual_length = luaL_checkinteger(L, 7);
+    uint32_t start_frame = luaL_checkinteger(L, 8);
+    uint32_t number_of_packets = luaL_checkinteger(L, 9);
+    uint32_t error_count = luaL_checkinteger(L, 10);
+    data = CheckPayload(L, 11, actual_length, &datalen);
+    iso = luaL_optlstring(L, 12, NULL, &isolen);
+    hdr = NewResponse(L, fd);
+    Put32(hdr, USBIP_RET_SUBMIT);
+    Put32(hdr + 4, seqnum);
+    Put32(hdr + 8, devid);
+    Put32(hdr + 12, direction);
+    Put32(hdr + 16, ep);
+    Put32(hdr + 20, status);
+    Put32(hdr + 24, actual_length);
+    Put32(hdr + 28, start_frame);
+    Put32(hdr + 32, number_of_packets);
+    Put32(hdr + 36, error_count);
+    AddPayload(L, 11, data, datalen);
+    if(iso) AddPayload(L, 12, iso, isolen);
+    return Done(L);
+    }
+
+static int SendRetUnlink(lua_State *L)
+/* ok = usbip_send_ret_unlink(fd, seqnum, devid, direction, ep, status) */
+    {
+    uint8_t *hdr;
+    int fd = luaL_checkinteger(L, 1);
+    uint32_t seqnum = luaL_checkinteger(L, 2);
+    uint32_t devid = luaL_checkinteger(L, 3);
+    uint32_t direction = luaL_checkinteger(L, 4);
+    uint32_t ep = luaL_checkinteger(L, 5);
+    uint32_t status = (uint32_t)luaL_checkinteger(L, 6);
+    hdr = NewResponse(L, fd);
+    Put32(hdr, USBIP_RET_UNLINK);
+    Put32(hdr + 4, seqnum);
+    Put32(hdr + 8, devid);
+    Put32(hdr + 12, direction);
+    Put32(hdr + 16, ep);
+    Put32(hdr + 20, status);
+    return Done(L);
+    }
+
+static int Cork(lua_State *L)
+    {
+    (void)L;
+    Corked = 1;
+    return 0;
+    }
+
+static int Uncork(lua_State *L)
+/* ok = usbip_uncork() */
+    {
+    Corked = 0;
+    lua_pushboolean(L, Flush(L));
+    return 1;
+    }
+
+#else
+
+#define SendRetSubmit notsupported
+#define SendRetUnlink notsupported
+#define Cork notsupported
+#define Uncork notsupported
+
+#endif
+
+static const struct luaL_Reg Functions[] = 
+    {
+        { "usbip_send_ret_submit", SendRetSubmit },
+        { "usbip_send_ret_unlink", SendRetUnlink },
+        { "usbip_cork", Cork },
+        { "usbip_uncork", Uncork },
+        { NULL, NULL } /* sentinel */
+    };
+
+void moonusb_open_usbip(lua_State *L)
+    {
+    luaL_setfuncs(L, Functions, 0);
+    }
+
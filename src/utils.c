@@ -37,6 +37,12 @@ int notavailable(lua_State *L, ...)
     { 
     return luaL_error(L, "function not available in this CL version");
     }
+
+int notsupported(lua_State *L)
+/* Bound to the functions that are not supported on the current platform */
+    {
+    return luaL_error(L, "operation not supported");
+    }
   
 /*------------------------------------------------------------------------------*
  | Malloc                                                                       |
@@ -107,6 +113,28 @@ void Free(lua_State *L, void *ptr)
     if(ptr) Free_(ptr);
     }
 
+int growarray(void **array, size_t *max, size_t n, size_t elemsize)
+/* Ensures that the dynamic array has room for at least n elements.
+ * Does not raise errors (returns -1 if out of memory), so it can be used also in
+ * callbacks executed from within libusb. */
+    {
+    void *p;
+    size_t newmax;
+    if(n <= *max) return 0;
+    newmax = *max ? 2*(*max) : 32;
+    while(newmax < n) newmax *= 2;
+    p = MallocNoErr(NULL, newmax*elemsize);
+    if(!p) return -1;
+    if(*array)
+        {
+        memcpy(p, *array, (*max)*elemsize);
+        Free(NULL, *array);
+        }
+    *array = p;
+    *max = newmax;
+    return 0;
+    }
+
 /*------------------------------------------------------------------------------*
  | Time utilities                                                               |
  *------------------------------------------------------------------------------*/
@@ -141,6 +169,20 @@ double now(void)
 #endif
     }
 
+uint64_t nowns(void)
+/* Same as now(), in integer nanoseconds (cheaper, for timestamping in hot paths) */
+    {
+#if _POSIX_C_SOURCE >= 199309L
+    struct timespec ts;
+    if(clock_gettime(CLOCK_MONOTONIC,&ts)!=0) return 0;
+    return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+#else
+    struct timeval tv;
+    if(gettimeofday(&tv, NULL) != 0) return 0;
+    return (uint64_t)tv.tv_sec*1000000000 + tv.tv_usec*1000;
+#endif
+    }
+
 void sleeep(double seconds)
     {
 #if _POSIX_C_SOURCE >= 199309L
@@ -176,6 +218,14 @@ double now(void)
     return ((double)(ts.QuadPart))/Frequency.QuadPart;
     }
 
+uint64_t nowns(void)
+    {
+    LARGE_INTEGER ts;
+    QueryPerformanceCounter(&ts);
+    return (uint64_t)((ts.QuadPart/Frequency.QuadPart)*1000000000 +
+            ((ts.QuadPart%Frequency.QuadPart)*1000000000)/Frequency.QuadPart);
+    }
+
 void sleeep(double seconds)
     {
     DWORD msec = (DWORD)seconds * 1000;
@@ -339,6 +389,7 @@ const char* errstring(int err)
         case ERR_FOPEN: return "cannot open file";
         case ERR_OPERATION: return "operation failed";
         case ERR_UNKNOWN: return "unknown field name";
+        case ERR_OVERLAP: return "overlapping memory areas";
         default:
             return "???";
         }
@@ -0,0 +1,156 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2021 Stefano Trettel
+ *
+ * Software repository: MoonUSB, https://github.com/stetre/moonusb
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "internal.h"
+
+static int freeview(lua_State *L, ud_t *ud)
+    {
+    view_t *view = (view_t*)ud->handle;
+    if(!freeuserdata(L, ud, "view")) return 0;
+    Free(L, view);
+    return 0;
+    }
+
+static int Create(lua_State *L)
+/* view = hostmem:view(type, [offset], [count], [endianness]) */
+    {
+    ud_t *ud, *hostmem_ud;
+    view_t *view;
+    hostmem_t *hostmem = checkhostmem(L, 1, &hostmem_ud);
+    int type = checktype(L, 2);
+    size_t offset = luaL_optinteger(L, 3, 0);
+    size_t elemsize = sizeoftype(type);
+    size_t count;
+    int endianness = optendianness(L, 5, MOONUSB_ENDIANNESS_NATIVE);
+    if(offset >= hostmem->size)
+        return luaL_error(L, errstring(ERR_BOUNDARIES));
+    count = luaL_optinteger(L, 4, (hostmem->size - offset)/elemsize);
+    if(count == 0)
+        return argerror(L, 4, ERR_VALUE);
+    if(count > (hostmem->size - offset)/elemsize)
+        return luaL_error(L, errstring(ERR_BOUNDARIES));
+    view = (view_t*)Malloc(L, sizeof(view_t));
+    view->ptr = hostmem->ptr + offset;
+    view->count = count;
+    view->elemsize = elemsize;
+    view->type = type;
+    view->swap = needswap(endianness);
+    ud = newuserdata(L, view, VIEW_MT, "view");
+    ud->parent_ud = hostmem_ud;
+    ud->context = hostmem_ud->context;
+    ud->destructor = freeview;
+    return 1;
+    }
+
+static int Index(lua_State *L)
+/* val = view[i], or method lookup */
+    {
+    int isnum;
+    view_t *view = checkview(L, 1, NULL);
+    lua_Integer i = lua_tointegerx(L, 2, &isnum);
+    if(!isnum)
+        {
+        lua_pushvalue(L, 2);
+        lua_rawget(L, lua_upvalueindex(1)); /* methods */
+        return 1;
+        }
+    if(i < 1 || (lua_Unsigned)i > view->count)
+        { lua_pushnil(L); return 1; }
+    return pushelem(L, view->type, view->ptr + (i-1)*view->elemsize, view->swap);
+    }
+
+static int NewIndex(lua_State *L)
+/* view[i] = val */
+    {
+    int isnum;
+    view_t *view = checkview(L, 1, NULL);
+    lua_Integer i = lua_tointegerx(L, 2, &isnum);
+    if(!isnum)
+        return argerror(L, 2, ERR_TYPE);
+    if(i < 1 || (lua_Unsigned)i > view->count)
+        return luaL_error(L, errstring(ERR_BOUNDARIES));
+    if(toelem(L, 3, view->type, view->ptr + (i-1)*view->elemsize, view->swap) != 0)
+        return argerror(L, 3, ERR_TYPE);
+    return 0;
+    }
+
+static int Len(lua_State *L)
+    {
+    view_t *view = checkview(L, 1, NULL);
+    lua_pushinteger(L, view->count);
+    return 1;
+    }
+
+static int Ptr(lua_State *L)
+    {
+    view_t *view = checkview(L, 1, NULL);
+    lua_pushlightuserdata(L, view->ptr);
+    return 1;
+    }
+
+DESTROY_FUNC(view)
+PARENT_FUNC(view)
+
+static const struct luaL_Reg Methods[] = 
+    {
+        { "free", Destroy },
+        { "ptr", Ptr },
+        { "hostmem", Parent },
+        { NULL, NULL } /* sentinel */
+    };
+
+static const struct luaL_Reg MetaMethods[] = 
+    {
+        { "__gc",  Destroy },
+        { "__newindex",  NewIndex },
+        { "__len",  Len },
+        { NULL, NULL } /* sentinel */
+    };
+
+static const struct luaL_Reg HostmemMethods[] = 
+    {
+        { "view", Create },
+        { NULL, NULL } /* sentinel */
+    };
+
+static const struct luaL_Reg Functions[] = 
+    {
+        { NULL, NULL } /* sentinel */
+    };
+
+void moonusb_open_view(lua_State *L)
+    {
+    udata_define(L, VIEW_MT, Methods, MetaMethods);
+    /* Replace the __index table with a function that handles integer keys
+     * and falls back to the methods table for the others */
+    luaL_getmetatable(L, VIEW_MT);
+    lua_pushvalue(L, -1);
+    lua_pushcclosure(L, Index, 1);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+    udata_addmethods(L, HOSTMEM_MT, HostmemMethods);
+    luaL_setfuncs(L, Functions, 0);
+    }
+